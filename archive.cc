@@ -0,0 +1,615 @@
+/* Sample archive for the DS1921L logger
+ *
+ * 2021 Angular Fish
+ *
+ * See archive.h for the layout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "archive.h"
+
+const int64_t levelwidths[ARCHIVELEVELS] = {60LL * 1000000, 3600LL * 1000000, 86400LL * 1000000};
+const char *levelnames[ARCHIVELEVELS] = {"min", "hour", "day"};
+
+#define DAY (86400LL * 1000000)
+
+/* Raw readings and minutes for a month, hours for two years, days forever */
+const struct retention defaultretention = {30 * DAY, {30 * DAY, 730 * DAY, 0}};
+
+/* Bytes copied per compaction step */
+#define COMPACTCHUNK 65536
+
+void romToHex(const uint8_t *rom, char *hex) {
+	int i;
+	for(i = 0; i < 8; i++) sprintf(&hex[i * 2], "%02X", rom[i]);
+}
+
+bool hexToROM(const char *hex, uint8_t *rom) {
+	int i;
+	if(strlen(hex) != 16) return false;
+	for(i = 0; i < 8; i++) {
+		unsigned int byte;
+		if(sscanf(&hex[i * 2], "%2x", &byte) != 1) return false;
+		rom[i] = byte;
+	}
+	return true;
+}
+
+bool archiveOpen(struct archive *a, const char *dir) {
+	memset(a, 0, sizeof(*a));
+	snprintf(a->dir, sizeof(a->dir), "%s", dir);
+	mkdir(dir, 0755);
+	struct stat st;
+	return stat(dir, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+void closeSeries(struct archiveseries *s) {
+	int l;
+	close(s->rawfd);
+	for(l = 0; l < ARCHIVELEVELS; l++) close(s->levelfd[l]);
+}
+
+void archiveClose(struct archive *a) {
+	int i;
+	for(i = 0; i < a->count; i++) closeSeries(&a->series[i]);
+	free(a->series);
+	a->series = NULL;
+	a->count = 0;
+	a->capacity = 0;
+}
+
+int openSeriesFile(struct archive *a, const uint8_t *rom, const char *suffix, int flags) {
+	char hex[17];
+	char path[PATH_MAX + 32];
+	romToHex(rom, hex);
+	snprintf(path, sizeof(path), "%s/%s.%s", a->dir, hex, suffix);
+	return open(path, flags, 0644);
+}
+
+/* Opens the device's files into s and picks up where they left off. With
+ * create false they're only read, and have to be there already.
+ */
+bool openSeries(struct archive *a, const uint8_t *rom, struct archiveseries *s, bool create) {
+	int l;
+	memset(s, 0, sizeof(*s));
+	memcpy(s->rom, rom, 8);
+	s->rawfd = openSeriesFile(a, rom, "raw", create ? O_RDWR | O_CREAT | O_APPEND : O_RDONLY);
+	if(s->rawfd < 0) return false;
+	struct archiverecord last;
+	off_t size = lseek(s->rawfd, 0, SEEK_END);
+	if(size >= (off_t)sizeof(last) && pread(s->rawfd, &last, sizeof(last), size - size % sizeof(last) - sizeof(last)) == sizeof(last)) {
+		s->last = last.time;
+	}
+	for(l = 0; l < ARCHIVELEVELS; l++) {
+		s->levelfd[l] = openSeriesFile(a, rom, levelnames[l], create ? O_RDWR | O_CREAT : O_RDONLY);
+		if(s->levelfd[l] < 0) {
+			while(--l >= 0) close(s->levelfd[l]);
+			close(s->rawfd);
+			return false;
+		}
+		s->buckets[l] = lseek(s->levelfd[l], 0, SEEK_END) / sizeof(struct rollup);
+		if(s->buckets[l] > 0 && pread(s->levelfd[l], &s->open[l], sizeof(struct rollup), (s->buckets[l] - 1) * sizeof(struct rollup)) != sizeof(struct rollup)) {
+			s->buckets[l] = 0;
+		}
+	}
+	return true;
+}
+
+/* The device's series in the table, or -1 */
+int lookupSeries(struct archive *a, const uint8_t *rom) {
+	int i;
+	for(i = 0; i < a->count; i++) {
+		if(memcmp(a->series[i].rom, rom, 8) == 0) return i;
+	}
+	return -1;
+}
+
+/* Finds the device's files for adding to, creating and opening them the
+ * first time.
+ */
+struct archiveseries *findSeries(struct archive *a, const uint8_t *rom) {
+	int i = lookupSeries(a, rom);
+	if(i >= 0) return &a->series[i];
+	if(a->count == a->capacity) {
+		int capacity = a->capacity ? a->capacity * 2 : 16;
+		struct archiveseries *series = (struct archiveseries *)realloc(a->series, capacity * sizeof(struct archiveseries));
+		if(series == NULL) return NULL;
+		a->series = series;
+		a->capacity = capacity;
+	}
+	if(!openSeries(a, rom, &a->series[a->count], true)) return NULL;
+	return &a->series[a->count++];
+}
+
+/* Adds a reading to the bucket still filling, or starts the next one */
+void addToBucket(struct rollup *r, int64_t *buckets, int64_t width, int64_t time, float temperature) {
+	int64_t start = time - time % width;
+	if(*buckets > 0 && r->start == start) {
+		if(temperature < r->min) r->min = temperature;
+		if(temperature > r->max) r->max = temperature;
+		r->sum += temperature;
+		r->count++;
+	} else {
+		memset(r, 0, sizeof(*r));
+		r->start = start;
+		r->min = temperature;
+		r->max = temperature;
+		r->sum = temperature;
+		r->count = 1;
+		(*buckets)++;
+	}
+}
+
+/* Adds up to ARCHIVECHUNK readings with one write to each file. The
+ * buckets they touch are next to each other at the end of each level, so
+ * they're gathered up and written in one go too. Nothing changes in memory
+ * unless the raw readings made it to the disk, and a short write is cut
+ * back off so a resent batch doesn't land after half a record.
+ */
+int appendChunk(struct archiveseries *s, const struct archiverecord *records, int count) {
+	struct archiverecord raw[ARCHIVECHUNK];
+	struct rollup changed[ARCHIVELEVELS][ARCHIVECHUNK];
+	int changes[ARCHIVELEVELS];
+	int64_t first[ARCHIVELEVELS];
+	struct rollup open[ARCHIVELEVELS];
+	int64_t buckets[ARCHIVELEVELS];
+	memcpy(open, s->open, sizeof(open));
+	memcpy(buckets, s->buckets, sizeof(buckets));
+	memset(changes, 0, sizeof(changes));
+	int64_t last = s->last;
+	int n = 0;
+	int i, l;
+	for(i = 0; i < count; i++) {
+		if(records[i].time <= last) continue; // refused
+		last = records[i].time;
+		memset(&raw[n], 0, sizeof(raw[n]));
+		raw[n].time = records[i].time;
+		raw[n].temperature = records[i].temperature;
+		n++;
+		for(l = 0; l < ARCHIVELEVELS; l++) {
+			addToBucket(&open[l], &buckets[l], levelwidths[l], records[i].time, records[i].temperature);
+			int64_t index = buckets[l] - 1;
+			if(changes[l] == 0) first[l] = index;
+			changed[l][index - first[l]] = open[l];
+			if(index - first[l] == changes[l]) changes[l]++;
+		}
+	}
+	if(n == 0) return 0;
+	ssize_t written = write(s->rawfd, raw, n * sizeof(raw[0]));
+	if(written != (ssize_t)(n * sizeof(raw[0]))) {
+		if(written > 0) {
+			off_t end = lseek(s->rawfd, 0, SEEK_END);
+			if(end >= written && ftruncate(s->rawfd, end - written) != 0) {}
+		}
+		return ARCHIVEFAILED;
+	}
+	s->last = last;
+	memcpy(s->open, open, sizeof(open));
+	memcpy(s->buckets, buckets, sizeof(buckets));
+	int result = n;
+	for(l = 0; l < ARCHIVELEVELS; l++) {
+		size_t length = changes[l] * sizeof(struct rollup);
+		if(pwrite(s->levelfd[l], changed[l], length, first[l] * sizeof(struct rollup)) != (ssize_t)length) result = ARCHIVEFAILED;
+	}
+	return result;
+}
+
+int archiveAppendMany(struct archive *a, const uint8_t *rom, const struct archiverecord *records, int count) {
+	struct archiveseries *s = findSeries(a, rom);
+	if(s == NULL) return ARCHIVEFAILED;
+	int added = 0;
+	while(count > 0) {
+		int n = count < ARCHIVECHUNK ? count : ARCHIVECHUNK;
+		int result = appendChunk(s, records, n);
+		if(result == ARCHIVEFAILED) return ARCHIVEFAILED;
+		added += result;
+		records += n;
+		count -= n;
+	}
+	return added;
+}
+
+int archiveAppend(struct archive *a, const uint8_t *rom, int64_t time, float temperature) {
+	struct archiverecord record;
+	memset(&record, 0, sizeof(record));
+	record.time = time;
+	record.temperature = temperature;
+	int result = archiveAppendMany(a, rom, &record, 1);
+	return result == ARCHIVEFAILED ? ARCHIVEFAILED : result > 0 ? ARCHIVEADDED : ARCHIVEREFUSED;
+}
+
+/* Index of the first record in fd starting at or after from. Every record
+ * type starts with its time.
+ */
+int64_t findFirst(int fd, size_t recordsize, int64_t count, int64_t from) {
+	int64_t low = 0;
+	int64_t high = count;
+	while(low < high) {
+		int64_t middle = (low + high) / 2;
+		int64_t time;
+		if(pread(fd, &time, sizeof(time), middle * recordsize) != sizeof(time)) return count;
+		if(time < from) low = middle + 1;
+		else high = middle;
+	}
+	return low;
+}
+
+/* Adds r to the output, merged into the last point if it falls in the same
+ * width wide slot. Returns false once the output is full.
+ */
+bool addPoint(struct rollup *out, int *count, int max, const struct rollup *r, int64_t width) {
+	int64_t slot = width > 0 ? r->start - r->start % width : r->start;
+	struct rollup *last = *count > 0 ? &out[*count - 1] : NULL;
+	if(last != NULL && last->start == slot) {
+		if(r->min < last->min) last->min = r->min;
+		if(r->max > last->max) last->max = r->max;
+		last->sum += r->sum;
+		last->count += r->count;
+		return true;
+	}
+	if(*count == max) return false;
+	out[*count] = *r;
+	out[*count].start = slot;
+	(*count)++;
+	return true;
+}
+
+int querySeries(struct archiveseries *s, int64_t from, int64_t to, int pixels, struct rollup *out, int max) {
+	int64_t wanted = (to - from) / pixels;
+	int level = -1;
+	int l;
+	for(l = 0; l < ARCHIVELEVELS; l++) {
+		if(levelwidths[l] <= wanted) level = l;
+	}
+	/* The level has at least as many points as pixels, and they're merged
+	 * down to one per pixel as they're read.
+	 */
+	int count = 0;
+	struct rollup r;
+	if(level < 0) {
+		int64_t records = lseek(s->rawfd, 0, SEEK_END) / sizeof(struct archiverecord);
+		int64_t i = findFirst(s->rawfd, sizeof(struct archiverecord), records, from);
+		struct archiverecord record;
+		for(; i < records; i++) {
+			if(pread(s->rawfd, &record, sizeof(record), i * sizeof(record)) != sizeof(record)) break;
+			if(record.time >= to) break;
+			memset(&r, 0, sizeof(r));
+			r.start = record.time;
+			r.min = record.temperature;
+			r.max = record.temperature;
+			r.sum = record.temperature;
+			r.count = 1;
+			if(!addPoint(out, &count, max, &r, wanted)) break;
+		}
+		return count;
+	}
+	int64_t width = wanted - wanted % levelwidths[level];
+	int64_t i = findFirst(s->levelfd[level], sizeof(struct rollup), s->buckets[level], from - from % levelwidths[level]);
+	for(; i < s->buckets[level]; i++) {
+		if(pread(s->levelfd[level], &r, sizeof(r), i * sizeof(r)) != sizeof(r)) break;
+		if(r.start >= to) break;
+		if(!addPoint(out, &count, max, &r, width)) break;
+	}
+	return count;
+}
+
+/* A device that isn't in the table is only opened to read, so asking about
+ * one that was never archived doesn't leave empty files behind.
+ */
+int archiveQuery(struct archive *a, const uint8_t *rom, int64_t from, int64_t to, int pixels, struct rollup *out, int max) {
+	if(to <= from || pixels <= 0) return 0;
+	int i = lookupSeries(a, rom);
+	if(i >= 0) return querySeries(&a->series[i], from, to, pixels, out, max);
+	struct archiveseries s;
+	if(!openSeries(a, rom, &s, false)) return 0;
+	int count = querySeries(&s, from, to, pixels, out, max);
+	closeSeries(&s);
+	return count;
+}
+
+void compactionStart(struct compaction *c) {
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+}
+
+/* Where the file being compacted is, and its copy */
+void compactionPaths(struct archive *a, struct compaction *c, char *path, char *temporary) {
+	char hex[17];
+	romToHex(a->series[c->series].rom, hex);
+	snprintf(path, PATH_MAX + 32, "%s/%s.%s", a->dir, hex, c->file == 0 ? "raw" : levelnames[c->file - 1]);
+	snprintf(temporary, PATH_MAX + 40, "%s.compact", path);
+}
+
+/* Gives up on the copy, leaving the old file as it was */
+void abandonCompaction(struct archive *a, struct compaction *c, const char *why) {
+	char path[PATH_MAX + 32];
+	char temporary[PATH_MAX + 40];
+	compactionPaths(a, c, path, temporary);
+	fprintf(stderr, "Archive: can't compact %s (%s), left as it was\n", path, why);
+	close(c->fd);
+	unlink(temporary);
+	c->fd = -1;
+}
+
+/* Swaps the finished copy in for the old file. If it can't, the old file is
+ * left alone.
+ */
+bool finishCompaction(struct archive *a, struct compaction *c) {
+	struct archiveseries *s = &a->series[c->series];
+	char path[PATH_MAX + 32];
+	char temporary[PATH_MAX + 40];
+	compactionPaths(a, c, path, temporary);
+	if(fsync(c->fd) != 0) {
+		abandonCompaction(a, c, "sync");
+		return false;
+	}
+	if(rename(temporary, path) != 0) {
+		abandonCompaction(a, c, "rename");
+		return false;
+	}
+	if(c->file == 0) {
+		close(s->rawfd);
+		close(c->fd);
+		s->rawfd = openSeriesFile(a, s->rom, "raw", O_RDWR | O_CREAT | O_APPEND);
+		if(s->rawfd < 0) {
+			fprintf(stderr, "Archive: can't reopen %s after compacting it\n", path);
+			return false;
+		}
+	} else {
+		int l = c->file - 1;
+		close(s->levelfd[l]);
+		s->levelfd[l] = c->fd;
+		s->buckets[l] -= c->cut;
+	}
+	return true;
+}
+
+bool archiveCompactStep(struct archive *a, struct compaction *c, const struct retention *r, int64_t now) {
+	if(c->series >= a->count) return true;
+	struct archiveseries *s = &a->series[c->series];
+	int oldfd = c->file == 0 ? s->rawfd : s->levelfd[c->file - 1];
+	size_t recordsize = c->file == 0 ? sizeof(struct archiverecord) : sizeof(struct rollup);
+	if(c->fd < 0) {
+		/* Starting on a file: work out how much goes */
+		int64_t keep = c->file == 0 ? r->raw : r->levels[c->file - 1];
+		int64_t records = lseek(oldfd, 0, SEEK_END) / recordsize;
+		c->cut = keep == 0 ? 0 : findFirst(oldfd, recordsize, records, now - keep);
+		if(c->cut == 0 || (c->file > 0 && c->cut >= records)) {
+			/* Nothing to do, or it would drop the bucket still filling */
+			if(++c->file > ARCHIVELEVELS) {
+				c->file = 0;
+				c->series++;
+			}
+			return false;
+		}
+		char path[PATH_MAX + 32];
+		char temporary[PATH_MAX + 40];
+		compactionPaths(a, c, path, temporary);
+		c->fd = open(temporary, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if(c->fd < 0) {
+			fprintf(stderr, "Archive: can't make %s, stopping compaction\n", temporary);
+			return true;
+		}
+		c->from = c->cut * recordsize;
+	}
+	char buffer[COMPACTCHUNK];
+	ssize_t n = pread(oldfd, buffer, sizeof(buffer), c->from);
+	if(n < 0 || (n > 0 && write(c->fd, buffer, n) != n)) {
+		/* Most likely the disk is full, so there's no point going on */
+		abandonCompaction(a, c, n < 0 ? "read" : "write");
+		return true;
+	}
+	if(n > 0) {
+		c->from += n;
+		/* More to copy next step. The copy has to be finished in the same
+		 * step that reaches the end: until then readings can be added, and
+		 * the bucket still filling rewritten in place, in the old file.
+		 */
+		if(c->from < lseek(oldfd, 0, SEEK_END)) return false;
+	}
+	/* Caught up with the end, and nothing can be added between here and the
+	 * rename since the caller doesn't add readings while a step runs. A copy
+	 * that can't be swapped in is dropped and the old file kept whole, and
+	 * compaction moves on to the next file either way.
+	 */
+	if(!finishCompaction(a, c)) c->failed++;
+	c->fd = -1;
+	if(++c->file > ARCHIVELEVELS) {
+		c->file = 0;
+		c->series++;
+	}
+	return false;
+}
+
+/* Checks
+ * A device reading every CHECKSTEP over CHECKDAYS days, starting on a day
+ * boundary, with a saw tooth of temperatures so every bucket has a
+ * different min, max and mean.
+ */
+#define CHECKSTEP (10LL * 1000000)
+#define CHECKDAYS 3
+#define CHECKREADINGS (CHECKDAYS * DAY / CHECKSTEP)
+#define CHECKSTART (18500 * DAY)
+
+const uint8_t checkrom[8] = {0x21, 0xC0, 0xFF, 0xEE, 0x00, 0x00, 0x00, 0x42};
+
+float checkTemperature(int64_t i) {
+	return (i % 37) * 0.5 - 5.0 + (i / 8640) * 0.25;
+}
+
+char *checkDirectory(char *dir) {
+	return mkdtemp(dir);
+}
+
+void removeCheckDirectory(const char *dir) {
+	DIR *d = opendir(dir);
+	if(d == NULL) return;
+	struct dirent *e;
+	char path[PATH_MAX + 256];
+	while((e = readdir(d)) != NULL) {
+		if(strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+		if(unlink(path) != 0) removeCheckDirectory(path);
+	}
+	closedir(d);
+	rmdir(dir);
+}
+
+/* What archiveQuery should give for readings from to to at one point per
+ * width, worked out from the readings themselves.
+ */
+int expectedPoints(int64_t from, int64_t to, int64_t width, struct rollup *out, int max) {
+	int count = 0;
+	int64_t i;
+	for(i = 0; i < CHECKREADINGS; i++) {
+		int64_t time = CHECKSTART + i * CHECKSTEP;
+		if(time < from || time >= to) continue;
+		struct rollup r;
+		memset(&r, 0, sizeof(r));
+		r.start = time;
+		r.min = r.max = r.sum = checkTemperature(i);
+		r.count = 1;
+		if(!addPoint(out, &count, max, &r, width)) break;
+	}
+	return count;
+}
+
+bool samePoints(const struct rollup *a, const struct rollup *b, int count) {
+	int i;
+	for(i = 0; i < count; i++) {
+		if(a[i].start != b[i].start || a[i].min != b[i].min || a[i].max != b[i].max || a[i].sum != b[i].sum || a[i].count != b[i].count) return false;
+	}
+	return true;
+}
+
+/* Queries from to to at each level and compares with what the readings
+ * say it should be.
+ */
+bool checkQuery(struct archive *a, int64_t from, int64_t to, int pixels) {
+	static struct rollup got[2000];
+	static struct rollup wanted[2000];
+	int64_t width = (to - from) / pixels;
+	int l;
+	for(l = ARCHIVELEVELS - 1; l >= 0 && levelwidths[l] > width; l--) { }
+	/* Points are laid out on the level's buckets, not on the span */
+	int64_t slot = l < 0 ? width : width - width % levelwidths[l];
+	int64_t start = l < 0 ? from : from - from % levelwidths[l];
+	int count = archiveQuery(a, checkrom, from, to, pixels, got, 2000);
+	int expected = expectedPoints(start, to, slot, wanted, 2000);
+	return count > 0 && count == expected && samePoints(got, wanted, count);
+}
+
+/* Fills an archive with the check readings, half of them a run at a time
+ * and half one by one after opening it again, and queries every level.
+ */
+bool checkArchive() {
+	char dir[] = "/tmp/archiveXXXXXX";
+	if(checkDirectory(dir) == NULL) return false;
+	struct archive a;
+	bool ok = archiveOpen(&a, dir);
+	static struct archiverecord records[CHECKREADINGS];
+	int64_t i;
+	memset(records, 0, sizeof(records));
+	for(i = 0; i < CHECKREADINGS; i++) {
+		records[i].time = CHECKSTART + i * CHECKSTEP;
+		records[i].temperature = checkTemperature(i);
+	}
+	int64_t half = CHECKREADINGS / 2 + 7; // part way through a minute
+	ok = ok && archiveAppendMany(&a, checkrom, records, half) == half;
+	ok = ok && archiveAppendMany(&a, checkrom, records, 10) == 0; // had them already
+	archiveClose(&a);
+	ok = ok && archiveOpen(&a, dir);
+	for(i = half; i < CHECKREADINGS; i++) ok = ok && archiveAppend(&a, checkrom, records[i].time, records[i].temperature) == ARCHIVEADDED;
+	ok = ok && archiveAppend(&a, checkrom, records[0].time, 0) == ARCHIVEREFUSED;
+
+	ok = ok && checkQuery(&a, CHECKSTART + DAY + 1800LL * 1000000, CHECKSTART + DAY + 5400LL * 1000000, 1000); // raw
+	ok = ok && checkQuery(&a, CHECKSTART + DAY / 2, CHECKSTART + DAY * 3 / 2, 1440); // minutes
+	ok = ok && checkQuery(&a, CHECKSTART + DAY / 2, CHECKSTART + DAY * 3 / 2, 100); // minutes merged
+	ok = ok && checkQuery(&a, CHECKSTART, CHECKSTART + CHECKDAYS * DAY, 72); // hours
+	ok = ok && checkQuery(&a, CHECKSTART, CHECKSTART + CHECKDAYS * DAY, 3); // days
+
+	/* Asking about a device that was never archived leaves no files */
+	uint8_t unknown[8] = {0x21, 1, 2, 3, 4, 5, 6, 7};
+	struct rollup out[4];
+	char hex[17];
+	char path[PATH_MAX + 32];
+	struct stat st;
+	romToHex(unknown, hex);
+	snprintf(path, sizeof(path), "%s/%s.raw", dir, hex);
+	ok = ok && archiveQuery(&a, unknown, CHECKSTART, CHECKSTART + DAY, 4, out, 4) == 0 && stat(path, &st) != 0;
+
+	archiveClose(&a);
+	removeCheckDirectory(dir);
+	fprintf(stderr, "Archive check: rollups %s\n", ok ? "match the readings" : "don't match the readings");
+	return ok;
+}
+
+/* Records in one of the check device's files */
+int64_t checkRecords(struct archive *a, const char *suffix, size_t recordsize) {
+	char hex[17];
+	char path[PATH_MAX + 32];
+	struct stat st;
+	romToHex(checkrom, hex);
+	snprintf(path, sizeof(path), "%s/%s.%s", a->dir, hex, suffix);
+	return stat(path, &st) == 0 ? st.st_size / (int64_t)recordsize : -1;
+}
+
+/* Compacts the check readings down to a day of raw readings and two of
+ * minutes while more are added between steps, the way the archive sink
+ * does, and checks what's left.
+ */
+bool checkCompaction() {
+	char dir[] = "/tmp/compactXXXXXX";
+	if(checkDirectory(dir) == NULL) return false;
+	struct archive a;
+	bool ok = archiveOpen(&a, dir);
+	static struct archiverecord records[CHECKREADINGS];
+	int64_t i;
+	memset(records, 0, sizeof(records));
+	for(i = 0; i < CHECKREADINGS; i++) {
+		records[i].time = CHECKSTART + i * CHECKSTEP;
+		records[i].temperature = checkTemperature(i);
+	}
+	int64_t added = CHECKREADINGS - 100;
+	ok = ok && archiveAppendMany(&a, checkrom, records, added) == added;
+	struct retention r = {DAY, {2 * DAY, 0, 0}};
+	int64_t now = CHECKSTART + CHECKDAYS * DAY;
+	struct compaction c;
+	compactionStart(&c);
+	while(!archiveCompactStep(&a, &c, &r, now)) {
+		if(added < CHECKREADINGS) {
+			ok = ok && archiveAppend(&a, checkrom, records[added].time, records[added].temperature) == ARCHIVEADDED;
+			added++;
+		}
+	}
+	ok = ok && c.failed == 0;
+	for(; added < CHECKREADINGS; added++) ok = ok && archiveAppend(&a, checkrom, records[added].time, records[added].temperature) == ARCHIVEADDED;
+
+	ok = ok && checkRecords(&a, "raw", sizeof(struct archiverecord)) == DAY / CHECKSTEP;
+	ok = ok && checkRecords(&a, "min", sizeof(struct rollup)) == 2 * DAY / levelwidths[0];
+	ok = ok && checkRecords(&a, "hour", sizeof(struct rollup)) == CHECKDAYS * DAY / levelwidths[1];
+	ok = ok && checkRecords(&a, "raw.compact", 1) < 0 && checkRecords(&a, "min.compact", 1) < 0;
+
+	/* What's kept reads back as before, what's gone reads as nothing */
+	ok = ok && checkQuery(&a, now - 3600LL * 1000000, now, 1000);
+	ok = ok && checkQuery(&a, now - DAY, now, 1440);
+	ok = ok && checkQuery(&a, CHECKSTART, now, 72);
+	struct rollup out[4];
+	ok = ok && archiveQuery(&a, checkrom, CHECKSTART, CHECKSTART + 3600LL * 1000000, 1000, out, 4) == 0;
+
+	/* and the swapped in files carry on taking readings */
+	ok = ok && archiveAppend(&a, checkrom, now + CHECKSTEP, 4.0) == ARCHIVEADDED;
+	ok = ok && checkRecords(&a, "raw", sizeof(struct archiverecord)) == DAY / CHECKSTEP + 1;
+
+	archiveClose(&a);
+	removeCheckDirectory(dir);
+	fprintf(stderr, "Compaction check: %s\n", ok ? "kept what it should" : "didn't keep what it should");
+	return ok;
+}
@@ -0,0 +1,135 @@
+/* Sample archive for the DS1921L logger
+ *
+ * 2021 Angular Fish
+ *
+ * The archive is a directory with a few files for each device, named after
+ * its ROM ID in hex:
+ * <id>.raw  every reading, in time order
+ * <id>.min  min/max/mean of the readings in each minute
+ * <id>.hour the same for each hour
+ * <id>.day  the same for each day
+ * The rollups are kept up to date as readings come in, the last record in
+ * each file being the bucket that's still filling, so a chart over any span
+ * can be drawn from whichever level has about as many points as it has
+ * pixels instead of from every reading.
+ */
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdint.h>
+#include <limits.h>
+
+#define ARCHIVELEVELS 3
+
+/* One reading. Times are microseconds since the epoch. */
+struct archiverecord {
+	int64_t time;
+	float temperature;
+	uint32_t reserved;
+};
+
+/* A bucket of readings at one of the levels, or a single reading when a
+ * query is answered from the raw file.
+ */
+struct rollup {
+	int64_t start;
+	float min;
+	float max;
+	double sum;
+	uint32_t count;
+	uint32_t reserved;
+};
+
+/* Bucket widths in microseconds for each level */
+extern const int64_t levelwidths[ARCHIVELEVELS];
+extern const char *levelnames[ARCHIVELEVELS];
+
+struct archiveseries {
+	uint8_t rom[8];
+	int rawfd;
+	int levelfd[ARCHIVELEVELS];
+	struct rollup open[ARCHIVELEVELS]; // the bucket still filling at each level
+	int64_t buckets[ARCHIVELEVELS]; // records in each level file, counting the open one
+	int64_t last; // time of the last reading
+};
+
+struct archive {
+	char dir[PATH_MAX];
+	struct archiveseries *series; // grows as devices turn up
+	int count;
+	int capacity;
+};
+
+void romToHex(const uint8_t *rom, char *hex);
+bool hexToROM(const char *hex, uint8_t *rom);
+
+bool archiveOpen(struct archive *a, const char *dir);
+void archiveClose(struct archive *a);
+
+/* What archiveAppend did with a reading */
+#define ARCHIVEFAILED -1 // couldn't open or write the device's files
+#define ARCHIVEREFUSED 0
+#define ARCHIVEADDED 1
+
+/* Adds a reading. Readings no newer than the last one for the device are
+ * refused, since the rollups can only grow forwards.
+ */
+int archiveAppend(struct archive *a, const uint8_t *rom, int64_t time, float temperature);
+
+/* The same for a run of one device's readings in time order, with a write
+ * per file for every ARCHIVECHUNK of them instead of one per reading.
+ * Returns how many were added, or ARCHIVEFAILED.
+ */
+#define ARCHIVECHUNK 256
+int archiveAppendMany(struct archive *a, const uint8_t *rom, const struct archiverecord *records, int count);
+
+/* Retention
+ * How long each file is kept for, in microseconds, 0 for forever. Old
+ * records are cut from the front of the files by compaction, which copies
+ * what's left into a new file a chunk at a time and swaps it in once it has
+ * caught up with the end, so it can be run a step at a time between
+ * readings without holding anything up.
+ */
+struct retention {
+	int64_t raw;
+	int64_t levels[ARCHIVELEVELS];
+};
+
+extern const struct retention defaultretention;
+
+struct compaction {
+	int series; // which series and file is being worked on
+	int file; // 0 raw, then each level
+	int fd; // the new file, -1 when between files
+	off_t from; // where copying got up to in the old file
+	int64_t cut; // records being dropped
+	int failed; // files that couldn't be swapped for their compacted copy
+};
+
+void compactionStart(struct compaction *c);
+
+/* Does a chunk of compaction. Returns true once every file of every series
+ * has been done.
+ */
+bool archiveCompactStep(struct archive *a, struct compaction *c, const struct retention *r, int64_t now);
+
+/* Fills out with up to max points covering from to to, about pixels of
+ * them, read from the coarsest level that has at least that many. Returns
+ * how many. Only reads the device's files, 0 if it has none.
+ */
+int archiveQuery(struct archive *a, const uint8_t *rom, int64_t from, int64_t to, int pixels, struct rollup *out, int max);
+
+/* Makes a scratch directory from a mkdtemp template for the -V checks,
+ * NULL if it can't, and removes it and everything in it afterwards.
+ */
+char *checkDirectory(char *dir);
+void removeCheckDirectory(const char *dir);
+
+/* Checks the rollups and queries against known readings, for -V */
+bool checkArchive();
+
+/* Checks compaction keeps what the retention says and nothing else */
+bool checkCompaction();
+
+#endif
@@ -0,0 +1,529 @@
+/* Collector for DS1921L loggers on many Pis
+ *
+ * 2021 Angular Fish
+ *
+ * Takes the readings that Pis running ibutton -F send it (see forward.h) and
+ * keeps them in one archive (see archive.h). One thread looks after every
+ * connection with epoll, reading frames as they come and never waiting on
+ * any one Pi. Writing to the archive is shared out between worker threads
+ * by device, each with its own part of the archive, so a device's readings
+ * always go through the same worker and stay in order. Each worker sorts
+ * its share of a batch by device and writes each device's run with a write
+ * per file rather than a few per reading. A batch is only
+ * acknowledged once every worker has written its share, and the next
+ * reading wanted from each Pi is kept in <archive>/edges/<name> so a Pi
+ * picks up from the right place after the collector is restarted.
+ * Acknowledgements that don't fit in a Pi's socket are queued and sent
+ * when epoll says there's room, rather than the Pi being dropped, and
+ * nothing more is read from that Pi until they've gone.
+ *
+ * Every few seconds a line per Pi is printed with how many readings a
+ * second are coming in from it and how far behind its newest reading is.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include "archive.h"
+#include "forward.h"
+
+#define MAXWORKERS 64
+#define MAXEVENTS 64
+#define OUTFRAMES 4 // unsent acknowledgements before a Pi is given up on
+
+/* A batch on its way through the workers */
+struct batch {
+	struct edge *edge;
+	struct forwardrecord records[BATCHRECORDS];
+	int count;
+	int skip; // records at the front the collector already had
+	uint64_t next; // what to ask for once it's written
+	int pending; // workers still to write their share
+	bool failed; // a worker couldn't write some of it
+	struct batch *done; // next on the finished list
+};
+
+struct job {
+	struct batch *batch;
+	struct job *next;
+};
+
+struct worker {
+	pthread_t thread;
+	struct archive archive; // just the devices this worker looks after
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	struct job *head;
+	struct job *tail;
+	int index;
+	const struct forwardrecord *share[BATCHRECORDS]; // its part of the batch, by device
+	struct archiverecord run[BATCHRECORDS]; // one device's readings from it
+};
+
+struct edge {
+	int fd;
+	char name[MAXEDGENAME];
+	bool hello; // has said who it is
+	uint64_t next; // sequence number wanted next
+	int statefd; // where next is kept
+	uint8_t *in; // the frame being read
+	size_t have;
+	struct forwardheader out[OUTFRAMES]; // acknowledgements waiting to go
+	size_t outlength; // bytes in out
+	size_t outsent;
+	bool writing; // waiting for EPOLLOUT
+	struct batch *inflight;
+	bool closed; // gone, freed once no batch of its is in flight
+	uint64_t readings;
+	uint64_t reported; // readings at the last report
+	int64_t newest; // time of the newest reading, microseconds since the epoch
+	struct edge *nextedge;
+};
+
+struct worker *workers;
+int workercount = 4;
+struct edge *edges = NULL;
+int epollfd;
+int donefd; // eventfd the workers poke when a batch is finished
+pthread_mutex_t donelock = PTHREAD_MUTEX_INITIALIZER;
+struct batch *donelist = NULL;
+char archivedir[PATH_MAX];
+
+#define INBUFFER (sizeof(struct forwardheader) + PACKEDMAX)
+
+int64_t realtimeMicros() {
+	struct timespec t;
+	clock_gettime(CLOCK_REALTIME, &t);
+	return (int64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+/* Which worker looks after a device */
+int shardOf(const uint8_t *rom) {
+	uint32_t hash = 2166136261u; // FNV-1a
+	int i;
+	for(i = 0; i < 8; i++) hash = (hash ^ rom[i]) * 16777619u;
+	return hash % workercount;
+}
+
+/* By device, then by where they were in the batch so each device's
+ * readings stay in order.
+ */
+int compareShare(const void *a, const void *b) {
+	const struct forwardrecord *x = *(const struct forwardrecord **)a;
+	const struct forwardrecord *y = *(const struct forwardrecord **)b;
+	int result = memcmp(x->rom, y->rom, 8);
+	if(result != 0) return result;
+	return x < y ? -1 : x > y;
+}
+
+/* Writes this worker's share of a batch, a device at a time */
+bool writeShare(struct worker *w, const struct batch *b) {
+	int count = 0;
+	int i, j;
+	for(i = b->skip; i < b->count; i++) {
+		if(shardOf(b->records[i].rom) == w->index) w->share[count++] = &b->records[i];
+	}
+	qsort(w->share, count, sizeof(w->share[0]), compareShare);
+	bool ok = true;
+	for(i = 0; i < count; i = j) {
+		int n = 0;
+		for(j = i; j < count && memcmp(w->share[j]->rom, w->share[i]->rom, 8) == 0; j++) {
+			memset(&w->run[n], 0, sizeof(w->run[n]));
+			w->run[n].time = w->share[j]->time;
+			w->run[n].temperature = w->share[j]->temperature;
+			n++;
+		}
+		/* Readings the archive already has are refused, and that's fine,
+		 * but ones that couldn't be written mustn't be ACKed.
+		 */
+		if(archiveAppendMany(&w->archive, w->share[i]->rom, w->run, n) == ARCHIVEFAILED) ok = false;
+	}
+	return ok;
+}
+
+void *workerMain(void *arg) {
+	struct worker *w = (struct worker *)arg;
+	while(true) {
+		pthread_mutex_lock(&w->lock);
+		while(w->head == NULL) pthread_cond_wait(&w->ready, &w->lock);
+		struct job *j = w->head;
+		w->head = j->next;
+		if(w->head == NULL) w->tail = NULL;
+		pthread_mutex_unlock(&w->lock);
+
+		struct batch *b = j->batch;
+		if(!writeShare(w, b)) __atomic_store_n(&b->failed, true, __ATOMIC_RELAXED);
+		free(j);
+		if(__atomic_sub_fetch(&b->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+			pthread_mutex_lock(&donelock);
+			b->done = donelist;
+			donelist = b;
+			pthread_mutex_unlock(&donelock);
+			uint64_t one = 1;
+			if(write(donefd, &one, sizeof(one)) < 0) {}
+		}
+	}
+	return NULL;
+}
+
+void queueBatch(struct batch *b) {
+	b->pending = workercount;
+	int i;
+	for(i = 0; i < workercount; i++) {
+		struct worker *w = &workers[i];
+		struct job *j = (struct job *)malloc(sizeof(struct job));
+		j->batch = b;
+		j->next = NULL;
+		pthread_mutex_lock(&w->lock);
+		if(w->tail != NULL) w->tail->next = j;
+		else w->head = j;
+		w->tail = j;
+		pthread_cond_signal(&w->ready);
+		pthread_mutex_unlock(&w->lock);
+	}
+}
+
+/* Edges are only freed between rounds of events, since a later event in
+ * the same round can still point at one that's just been closed.
+ */
+void closeEdge(struct edge *e) {
+	if(e->fd >= 0) {
+		if(e->hello) fprintf(stderr, "%s: disconnected\n", e->name);
+		epoll_ctl(epollfd, EPOLL_CTL_DEL, e->fd, NULL);
+		close(e->fd);
+		e->fd = -1;
+	}
+	e->closed = true;
+}
+
+/* Sends what's queued for the edge. Whatever the socket won't take now
+ * waits for EPOLLOUT, and the edge isn't read from until it has gone.
+ */
+void edgeWrite(struct edge *e) {
+	if(e->closed) return;
+	while(e->outsent < e->outlength) {
+		ssize_t n = send(e->fd, (uint8_t *)e->out + e->outsent, e->outlength - e->outsent, MSG_NOSIGNAL);
+		if(n < 0 && errno == EINTR) continue;
+		if(n < 0 && errno == EAGAIN) {
+			if(!e->writing) {
+				struct epoll_event event;
+				event.events = EPOLLOUT;
+				event.data.ptr = e;
+				epoll_ctl(epollfd, EPOLL_CTL_MOD, e->fd, &event);
+				e->writing = true;
+			}
+			return;
+		}
+		if(n <= 0) {
+			closeEdge(e);
+			return;
+		}
+		e->outsent += n;
+	}
+	e->outlength = 0;
+	e->outsent = 0;
+	if(e->writing) {
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.ptr = e;
+		epoll_ctl(epollfd, EPOLL_CTL_MOD, e->fd, &event);
+		e->writing = false;
+	}
+}
+
+/* Queues an acknowledgement and sends what it can. Only fails when the Pi
+ * has left OUTFRAMES of them unread, which reading stopping while they're
+ * queued should make impossible.
+ */
+bool sendAck(struct edge *e, uint64_t sequence) {
+	if(e->outlength == sizeof(e->out)) return false;
+	struct forwardheader *header = &e->out[e->outlength / sizeof(struct forwardheader)];
+	memset(header, 0, sizeof(*header));
+	header->magic = FORWARDMAGIC;
+	header->type = FORWARDACK;
+	header->sequence = sequence;
+	e->outlength += sizeof(*header);
+	edgeWrite(e);
+	return true;
+}
+
+/* Frees the closed edges the workers have finished with */
+void reapEdges() {
+	struct edge **p = &edges;
+	while(*p != NULL) {
+		struct edge *e = *p;
+		if(!e->closed || e->inflight != NULL) {
+			p = &e->nextedge;
+			continue;
+		}
+		*p = e->nextedge;
+		if(e->statefd >= 0) close(e->statefd);
+		free(e->in);
+		free(e);
+	}
+}
+
+/* Names end up in file names, so only the harmless characters are kept */
+void cleanName(char *name) {
+	char *p;
+	for(p = name; *p != 0; p++) {
+		if(!(*p >= 'a' && *p <= 'z') && !(*p >= 'A' && *p <= 'Z') && !(*p >= '0' && *p <= '9') && *p != '-' && *p != '.') *p = '_';
+	}
+	if(name[0] == '.') name[0] = '_';
+}
+
+bool hello(struct edge *e, const struct forwardheader *header, const uint8_t *payload) {
+	if(header->length == 0 || header->length >= MAXEDGENAME) return false;
+	memcpy(e->name, payload, header->length);
+	e->name[header->length] = 0;
+	cleanName(e->name);
+	char path[PATH_MAX + MAXEDGENAME + 16];
+	snprintf(path, sizeof(path), "%s/edges/%s", archivedir, e->name);
+	e->statefd = open(path, O_RDWR | O_CREAT, 0644);
+	if(e->statefd < 0) return false;
+	if(pread(e->statefd, &e->next, sizeof(e->next), 0) != sizeof(e->next)) e->next = 0;
+	e->hello = true;
+	fprintf(stderr, "%s: connected, wants %llu\n", e->name, (unsigned long long)e->next);
+	return sendAck(e, e->next);
+}
+
+bool batchFrame(struct edge *e, const struct forwardheader *header, const uint8_t *payload) {
+	if(!e->hello || e->inflight != NULL || header->count == 0 || header->count > BATCHRECORDS) return false;
+	if(header->sequence > e->next || header->sequence + header->count <= e->next) {
+		/* A gap, or all stuff we have: ask again from where we are */
+		return sendAck(e, e->next);
+	}
+	struct batch *b = (struct batch *)malloc(sizeof(struct batch));
+	if(b == NULL) return false;
+	if(!unpackBatch(payload, header->length, b->records, header->count)) {
+		free(b);
+		return false;
+	}
+	b->edge = e;
+	b->failed = false;
+	b->count = header->count;
+	b->skip = e->next - header->sequence;
+	b->next = header->sequence + header->count;
+	e->inflight = b;
+	queueBatch(b);
+	return true;
+}
+
+/* Reads whatever the edge has sent, handling each whole frame, until an
+ * acknowledgement has to wait for room
+ */
+void edgeRead(struct edge *e) {
+	if(e->closed) return; // earlier in this round
+	while(e->outlength == 0) {
+		size_t want = sizeof(struct forwardheader);
+		if(e->have >= want) {
+			const struct forwardheader *header = (const struct forwardheader *)e->in;
+			if(header->magic != FORWARDMAGIC || header->length > PACKEDMAX) {
+				closeEdge(e);
+				return;
+			}
+			want += header->length;
+		}
+		if(e->have < want) {
+			ssize_t n = recv(e->fd, &e->in[e->have], want - e->have, 0);
+			if(n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+			if(n <= 0) {
+				closeEdge(e);
+				return;
+			}
+			e->have += n;
+			continue;
+		}
+		const struct forwardheader *header = (const struct forwardheader *)e->in;
+		bool ok;
+		if(header->type == FORWARDHELLO && !e->hello) ok = hello(e, header, e->in + sizeof(*header));
+		else if(header->type == FORWARDBATCH) ok = batchFrame(e, header, e->in + sizeof(*header));
+		else ok = false;
+		e->have = 0;
+		if(!ok) {
+			closeEdge(e);
+			return;
+		}
+	}
+}
+
+/* Acknowledges every batch the workers have finished */
+void finishBatches() {
+	uint64_t count;
+	if(read(donefd, &count, sizeof(count)) < 0) {}
+	pthread_mutex_lock(&donelock);
+	struct batch *b = donelist;
+	donelist = NULL;
+	pthread_mutex_unlock(&donelock);
+	while(b != NULL) {
+		struct batch *next = b->done;
+		struct edge *e = b->edge;
+		e->inflight = NULL;
+		if(b->failed) {
+			/* Not ACKed, so the Pi keeps it and sends it again once it
+			 * reconnects.
+			 */
+			fprintf(stderr, "%s: can't write a batch to the archive, dropping the connection\n", e->name);
+			closeEdge(e);
+			free(b);
+			b = next;
+			continue;
+		}
+		e->next = b->next;
+		e->readings += b->count - b->skip;
+		if(b->records[b->count - 1].time > e->newest) e->newest = b->records[b->count - 1].time;
+		if(e->closed) {
+			/* Still counts, it's in the archive */
+			if(pwrite(e->statefd, &e->next, sizeof(e->next), 0) < 0) {}
+		} else if(pwrite(e->statefd, &e->next, sizeof(e->next), 0) != sizeof(e->next) || !sendAck(e, e->next)) {
+			closeEdge(e);
+		}
+		free(b);
+		b = next;
+	}
+}
+
+void acceptEdges(int listenfd) {
+	while(true) {
+		int fd = accept(listenfd, NULL, NULL);
+		if(fd < 0) return;
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		struct edge *e = (struct edge *)calloc(1, sizeof(struct edge));
+		if(e != NULL) e->in = (uint8_t *)malloc(INBUFFER);
+		if(e == NULL || e->in == NULL) {
+			free(e);
+			close(fd);
+			return;
+		}
+		e->fd = fd;
+		e->statefd = -1;
+		strcpy(e->name, "?");
+		e->nextedge = edges;
+		edges = e;
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.ptr = e;
+		epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
+	}
+}
+
+void report(double seconds) {
+	int64_t now = realtimeMicros();
+	uint64_t total = 0;
+	struct edge *e;
+	for(e = edges; e != NULL; e = e->nextedge) {
+		if(!e->hello) continue;
+		uint64_t readings = e->readings - e->reported;
+		e->reported = e->readings;
+		total += readings;
+		printf("%s, %.1f readings/s, %.1f s behind, %llu readings\n", e->name, readings / seconds, e->newest ? (now - e->newest) / 1000000.0 : 0.0, (unsigned long long)e->readings);
+	}
+	printf("total, %.1f readings/s\n", total / seconds);
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	int port = 4891;
+	int interval = 10;
+	const char *dir = "collector-archive";
+	while((opt = getopt(argc, argv, "p:o:w:i:")) != -1) {
+		switch(opt) {
+		case 'p': port = atoi(optarg); break;
+		case 'o': dir = optarg; break;
+		case 'w': workercount = atoi(optarg); break;
+		case 'i': interval = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-p port] [-o archive] [-w workers] [-i seconds]\n", argv[0]);
+			return 1;
+		}
+	}
+	if(workercount < 1 || workercount > MAXWORKERS) {
+		fprintf(stderr, "-w wants 1 to %d\n", MAXWORKERS);
+		return 1;
+	}
+	/* Every device has a handful of files open */
+	struct rlimit files;
+	if(getrlimit(RLIMIT_NOFILE, &files) == 0) {
+		files.rlim_cur = files.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &files);
+	}
+	snprintf(archivedir, sizeof(archivedir), "%s", dir);
+	workers = (struct worker *)calloc(workercount, sizeof(struct worker));
+	if(workers == NULL) return 1;
+	int i;
+	for(i = 0; i < workercount; i++) {
+		struct worker *w = &workers[i];
+		if(!archiveOpen(&w->archive, dir)) {
+			fprintf(stderr, "Can't open the archive in %s\n", dir);
+			return 1;
+		}
+		w->index = i;
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->ready, NULL);
+	}
+	char path[PATH_MAX + 16];
+	snprintf(path, sizeof(path), "%s/edges", dir);
+	mkdir(path, 0755);
+
+	int listenfd = socket(AF_INET6, SOCK_STREAM, 0);
+	int one = 1;
+	int zero = 0;
+	setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	setsockopt(listenfd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+	struct sockaddr_in6 address;
+	memset(&address, 0, sizeof(address));
+	address.sin6_family = AF_INET6;
+	address.sin6_port = htons(port);
+	address.sin6_addr = in6addr_any;
+	if(bind(listenfd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listenfd, 128) != 0) {
+		fprintf(stderr, "Can't listen on port %d\n", port);
+		return 1;
+	}
+	fcntl(listenfd, F_SETFL, O_NONBLOCK);
+	epollfd = epoll_create1(0);
+	donefd = eventfd(0, EFD_NONBLOCK);
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = NULL; // the listening socket
+	epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfd, &event);
+	event.data.ptr = &donefd;
+	epoll_ctl(epollfd, EPOLL_CTL_ADD, donefd, &event);
+	for(i = 0; i < workercount; i++) {
+		if(pthread_create(&workers[i].thread, NULL, workerMain, &workers[i]) != 0) return 1;
+	}
+	fprintf(stderr, "Listening on port %d with %d workers\n", port, workercount);
+
+	struct epoll_event events[MAXEVENTS];
+	int64_t lastreport = realtimeMicros();
+	while(true) {
+		int n = epoll_wait(epollfd, events, MAXEVENTS, 1000);
+		for(i = 0; i < n; i++) {
+			if(events[i].data.ptr == NULL) acceptEdges(listenfd);
+			else if(events[i].data.ptr == &donefd) finishBatches();
+			else {
+				struct edge *e = (struct edge *)events[i].data.ptr;
+				if(e->writing && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) edgeWrite(e);
+				if(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) edgeRead(e);
+			}
+		}
+		reapEdges();
+		int64_t now = realtimeMicros();
+		if(now - lastreport >= (int64_t)interval * 1000000) {
+			report((now - lastreport) / 1000000.0);
+			lastreport = now;
+		}
+	}
+	return 0;
+}
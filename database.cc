@@ -0,0 +1,126 @@
+/* SQLite output for the DS1921L logger
+ *
+ * 2021 Angular Fish
+ *
+ * See database.h.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "archive.h"
+#include "database.h"
+
+uint64_t databaseMicros() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+bool databaseOpen(struct database *d, const char *path, int interval) {
+	memset(d, 0, sizeof(*d));
+	d->interval = interval;
+	if(sqlite3_open(path, &d->db) != SQLITE_OK) {
+		fprintf(stderr, "sqlite: %s\n", sqlite3_errmsg(d->db));
+		return false;
+	}
+	/* NORMAL is enough with WAL: the database can't be corrupted, a power
+	 * cut can only lose the last commits.
+	 */
+	const char *setup =
+		"PRAGMA journal_mode=WAL;"
+		"PRAGMA synchronous=NORMAL;"
+		"CREATE TABLE IF NOT EXISTS readings("
+			"device TEXT NOT NULL,"
+			"time INTEGER NOT NULL,"
+			"temperature REAL NOT NULL,"
+			"PRIMARY KEY(device, time)) WITHOUT ROWID;";
+	char *error = NULL;
+	if(sqlite3_exec(d->db, setup, NULL, NULL, &error) != SQLITE_OK) {
+		fprintf(stderr, "sqlite: %s\n", error);
+		sqlite3_free(error);
+		return false;
+	}
+	sqlite3_busy_timeout(d->db, 5000);
+	if(sqlite3_prepare_v2(d->db, "INSERT OR IGNORE INTO readings VALUES(?, ?, ?)", -1, &d->insert, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(d->db, "BEGIN", -1, &d->begin, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(d->db, "COMMIT", -1, &d->commit, NULL) != SQLITE_OK) {
+		fprintf(stderr, "sqlite: %s\n", sqlite3_errmsg(d->db));
+		return false;
+	}
+	return true;
+}
+
+void databaseClose(struct database *d) {
+	databaseCommit(d, true);
+	sqlite3_finalize(d->insert);
+	sqlite3_finalize(d->begin);
+	sqlite3_finalize(d->commit);
+	sqlite3_close(d->db);
+	memset(d, 0, sizeof(*d));
+}
+
+bool databaseStep(sqlite3 *db, sqlite3_stmt *statement) {
+	int result = sqlite3_step(statement);
+	sqlite3_reset(statement);
+	if(result == SQLITE_DONE) return true;
+	fprintf(stderr, "sqlite: %s\n", sqlite3_errmsg(db));
+	return false;
+}
+
+bool databaseInsert(struct database *d, const uint8_t *rom, int64_t time, float temperature) {
+	if(d->pending == 0) {
+		if(!databaseStep(d->db, d->begin)) return false;
+		d->opened = databaseMicros();
+	}
+	char hex[17];
+	romToHex(rom, hex);
+	sqlite3_bind_text(d->insert, 1, hex, 16, SQLITE_TRANSIENT);
+	sqlite3_bind_int64(d->insert, 2, time);
+	sqlite3_bind_double(d->insert, 3, temperature);
+	bool ok = databaseStep(d->db, d->insert);
+	d->pending++;
+	if(d->pending >= DATABASEBATCH) return databaseCommit(d, true) && ok;
+	return ok;
+}
+
+bool databaseCommit(struct database *d, bool force) {
+	if(d->pending == 0) return true;
+	if(!force && databaseMicros() - d->opened < (uint64_t)d->interval * 1000) return false;
+	/* If the commit fails (the disk is full, say) the transaction stays
+	 * open and it's tried again next time.
+	 */
+	if(!databaseStep(d->db, d->commit)) return false;
+	d->pending = 0;
+	return true;
+}
+
+bool databaseBenchmark(const char *path, int count) {
+	struct database d;
+	if(!databaseOpen(&d, path, 1000)) return false;
+	uint8_t rom[8] = {0x21, 0, 0, 0, 0, 0, 0, 0};
+	int64_t base = (int64_t)time(NULL) * 1000000;
+	int i;
+	uint64_t start = databaseMicros();
+	for(i = 0; i < count; i++) {
+		rom[1] = i % 16; // 16 devices, each sampled every second
+		if(!databaseInsert(&d, rom, base + (int64_t)(i / 16) * 1000000, 4.0 + (i % 100) / 100.0)) return false;
+		databaseCommit(&d, false);
+	}
+	databaseCommit(&d, true);
+	double batched = count / ((databaseMicros() - start) / 1e6);
+	/* The same with a transaction each, for comparison. Far slower, so
+	 * only a sample.
+	 */
+	int single = count / 100 > 0 ? count / 100 : 1;
+	start = databaseMicros();
+	for(i = 0; i < single; i++) {
+		rom[1] = 16 + i % 16;
+		if(!databaseInsert(&d, rom, base + (int64_t)(i / 16) * 1000000, 4.0) || !databaseCommit(&d, true)) return false;
+	}
+	double each = single / ((databaseMicros() - start) / 1e6);
+	databaseClose(&d);
+	printf("batched: %d readings, %.0f a second\n", count, batched);
+	printf("a transaction each: %d readings, %.0f a second\n", single, each);
+	return true;
+}
@@ -0,0 +1,54 @@
+/* SQLite output for the DS1921L logger
+ *
+ * 2021 Angular Fish
+ *
+ * Readings go into one table:
+ * readings(device TEXT, time INTEGER, temperature REAL)
+ * with the device's ROM ID in hex and the time in microseconds since the
+ * epoch, keyed on device and time so a reading added twice is only kept
+ * once.
+ *
+ * A transaction for every reading would mean a sync to the SD card for
+ * every reading, so readings are added to one transaction with a prepared
+ * statement and it's committed when it's interval milliseconds old or has
+ * DATABASEBATCH readings in it, whichever comes first. The database is in
+ * WAL mode so anyone querying it doesn't hold up the writes and doesn't see
+ * a transaction until it's committed. A crash loses at most the readings in
+ * the open transaction.
+ */
+
+#ifndef DATABASE_H
+#define DATABASE_H
+
+#include <stdint.h>
+#include <sqlite3.h>
+
+#define DATABASEBATCH 10000
+
+struct database {
+	sqlite3 *db;
+	sqlite3_stmt *insert;
+	sqlite3_stmt *begin;
+	sqlite3_stmt *commit;
+	int interval; // milliseconds a transaction can stay open
+	int pending; // readings in the open transaction
+	uint64_t opened; // when it was begun, monotonic microseconds
+};
+
+bool databaseOpen(struct database *d, const char *path, int interval);
+void databaseClose(struct database *d);
+
+bool databaseInsert(struct database *d, const uint8_t *rom, int64_t time, float temperature);
+
+/* Commits the open transaction if it's due, or whatever its age if force is
+ * set. Returns true if nothing is left uncommitted.
+ */
+bool databaseCommit(struct database *d, bool force);
+
+/* Adds count made up readings to the database at path, batched the way the
+ * sink does it and then one transaction each for a sample of them, and
+ * prints how many a second each way managed.
+ */
+bool databaseBenchmark(const char *path, int count);
+
+#endif
@@ -0,0 +1,291 @@
+/* Store and forward for the DS1921L logger
+ *
+ * 2021 Angular Fish
+ *
+ * See forward.h for the spool and the protocol.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <zlib.h>
+#include "forward.h"
+
+#define SPOOLMAGIC 0x4C4F4F5053424931ULL // "1IBSPOOL"
+
+struct spoolheader {
+	uint64_t magic;
+	uint64_t base;
+};
+
+/* How long to wait for an ACK before giving up on the connection */
+#define ACKTIMEOUT 30
+#define MAXBACKOFF 60
+
+bool spoolOpen(struct spool *sp, const char *dir) {
+	memset(sp, 0, sizeof(*sp));
+	snprintf(sp->dir, sizeof(sp->dir), "%s", dir);
+	mkdir(dir, 0755);
+	pthread_mutex_init(&sp->lock, NULL);
+	pthread_cond_init(&sp->appended, NULL);
+	char path[PATH_MAX + 16];
+	snprintf(path, sizeof(path), "%s/queue", dir);
+	sp->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if(sp->fd < 0) return false;
+	struct spoolheader header;
+	if(pread(sp->fd, &header, sizeof(header), 0) != sizeof(header)) {
+		header.magic = SPOOLMAGIC;
+		header.base = 0;
+		if(pwrite(sp->fd, &header, sizeof(header), 0) != sizeof(header)) return false;
+	}
+	if(header.magic != SPOOLMAGIC) return false;
+	sp->base = header.base;
+	off_t size = lseek(sp->fd, 0, SEEK_END);
+	sp->end = sp->base + (size - sizeof(header)) / sizeof(struct forwardrecord); // a record cut short by a crash gets written over
+
+	snprintf(path, sizeof(path), "%s/acked", dir);
+	sp->ackedfd = open(path, O_RDWR | O_CREAT, 0644);
+	if(sp->ackedfd < 0) return false;
+	if(pread(sp->ackedfd, &sp->acked, sizeof(sp->acked), 0) != sizeof(sp->acked)) sp->acked = sp->base;
+	return true;
+}
+
+bool spoolAppend(struct spool *sp, const struct forwardrecord *r) {
+	pthread_mutex_lock(&sp->lock);
+	off_t at = sizeof(struct spoolheader) + (sp->end - sp->base) * sizeof(*r);
+	bool ok = pwrite(sp->fd, r, sizeof(*r), at) == sizeof(*r);
+	if(ok) {
+		sp->end++;
+		pthread_cond_broadcast(&sp->appended);
+	}
+	pthread_mutex_unlock(&sp->lock);
+	return ok;
+}
+
+void spoolSync(struct spool *sp) {
+	pthread_mutex_lock(&sp->lock);
+	fdatasync(sp->fd);
+	pthread_mutex_unlock(&sp->lock);
+}
+
+int spoolRead(struct spool *sp, uint64_t from, struct forwardrecord *out, int max) {
+	pthread_mutex_lock(&sp->lock);
+	int count = 0;
+	if(from >= sp->base && from < sp->end) {
+		count = sp->end - from < (uint64_t)max ? sp->end - from : max;
+		off_t at = sizeof(struct spoolheader) + (from - sp->base) * sizeof(*out);
+		ssize_t n = pread(sp->fd, out, count * sizeof(*out), at);
+		count = n < 0 ? 0 : n / sizeof(*out);
+	}
+	pthread_mutex_unlock(&sp->lock);
+	return count;
+}
+
+bool spoolWait(struct spool *sp, uint64_t from, int ms) {
+	struct timespec until;
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += ms / 1000;
+	until.tv_nsec += (ms % 1000) * 1000000L;
+	if(until.tv_nsec >= 1000000000L) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000L;
+	}
+	pthread_mutex_lock(&sp->lock);
+	while(sp->end <= from) {
+		if(pthread_cond_timedwait(&sp->appended, &sp->lock, &until) == ETIMEDOUT) break;
+	}
+	bool ready = sp->end > from;
+	pthread_mutex_unlock(&sp->lock);
+	return ready;
+}
+
+/* Starts the queue again empty from sequence base. The new file is swapped
+ * in whole so a crash leaves either the old queue or the new one.
+ */
+bool restartQueue(struct spool *sp, uint64_t base) {
+	char path[PATH_MAX + 16];
+	char temporary[PATH_MAX + 16];
+	snprintf(path, sizeof(path), "%s/queue", sp->dir);
+	snprintf(temporary, sizeof(temporary), "%s/queue.new", sp->dir);
+	int fd = open(temporary, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0) return false;
+	struct spoolheader header = {SPOOLMAGIC, base};
+	if(pwrite(fd, &header, sizeof(header), 0) != sizeof(header) || fsync(fd) != 0 || rename(temporary, path) != 0) {
+		close(fd);
+		unlink(temporary);
+		return false;
+	}
+	close(sp->fd);
+	sp->fd = fd;
+	sp->base = base;
+	sp->end = base;
+	return true;
+}
+
+bool spoolAck(struct spool *sp, uint64_t next) {
+	pthread_mutex_lock(&sp->lock);
+	bool ok = true;
+	if(next > sp->acked && next <= sp->end) {
+		sp->acked = next;
+		ok = pwrite(sp->ackedfd, &sp->acked, sizeof(sp->acked), 0) == sizeof(sp->acked) && fdatasync(sp->ackedfd) == 0;
+		if(ok && sp->acked == sp->end && (sp->end - sp->base) * sizeof(struct forwardrecord) > SPOOLTRIM) {
+			ok = restartQueue(sp, sp->end);
+		}
+	}
+	pthread_mutex_unlock(&sp->lock);
+	return ok;
+}
+
+void spoolSkip(struct spool *sp, uint64_t next) {
+	pthread_mutex_lock(&sp->lock);
+	if(next > sp->end && restartQueue(sp, next)) {
+		sp->acked = next;
+		if(pwrite(sp->ackedfd, &sp->acked, sizeof(sp->acked), 0) == sizeof(sp->acked)) fdatasync(sp->ackedfd);
+	}
+	pthread_mutex_unlock(&sp->lock);
+}
+
+bool sendAll(int fd, const void *buffer, size_t length) {
+	const uint8_t *p = (const uint8_t *)buffer;
+	while(length > 0) {
+		ssize_t n = send(fd, p, length, MSG_NOSIGNAL);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) return false;
+		p += n;
+		length -= n;
+	}
+	return true;
+}
+
+bool recvAll(int fd, void *buffer, size_t length) {
+	uint8_t *p = (uint8_t *)buffer;
+	while(length > 0) {
+		ssize_t n = recv(fd, p, length, 0);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) return false;
+		p += n;
+		length -= n;
+	}
+	return true;
+}
+
+bool sendFrame(int fd, uint32_t type, uint64_t sequence, uint32_t count, const void *payload, uint32_t length) {
+	struct forwardheader header;
+	header.magic = FORWARDMAGIC;
+	header.type = type;
+	header.length = length;
+	header.count = count;
+	header.sequence = sequence;
+	return sendAll(fd, &header, sizeof(header)) && (length == 0 || sendAll(fd, payload, length));
+}
+
+bool recvFrame(int fd, struct forwardheader *header, void *payload, uint32_t max) {
+	if(!recvAll(fd, header, sizeof(*header))) return false;
+	if(header->magic != FORWARDMAGIC || header->length > max) return false;
+	return header->length == 0 || recvAll(fd, payload, header->length);
+}
+
+int packBatch(const struct forwardrecord *records, int count, uint8_t *out, size_t max) {
+	uLongf length = max;
+	if(compress2(out, &length, (const Bytef *)records, count * sizeof(*records), 6) != Z_OK) return -1;
+	return length;
+}
+
+bool unpackBatch(const uint8_t *in, uint32_t length, struct forwardrecord *records, int count) {
+	uLongf size = count * sizeof(*records);
+	return uncompress((Bytef *)records, &size, in, length) == Z_OK && size == count * sizeof(*records);
+}
+
+int connectTo(const char *host, const char *port) {
+	struct addrinfo hints;
+	struct addrinfo *addresses;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(host, port, &hints, &addresses) != 0) return -1;
+	int fd = -1;
+	struct addrinfo *a;
+	for(a = addresses; a != NULL; a = a->ai_next) {
+		fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if(fd < 0) continue;
+		if(connect(fd, a->ai_addr, a->ai_addrlen) == 0) break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(addresses);
+	if(fd < 0) return -1;
+	struct timeval timeout = {ACKTIMEOUT, 0};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+/* Sends batches until something goes wrong with the connection. One batch
+ * is in flight at a time, and the next starts from wherever the ACK says.
+ */
+void forwardSession(struct spool *sp, int fd, const char *edge) {
+	struct forwardheader header;
+	uint64_t next;
+	if(!sendFrame(fd, FORWARDHELLO, 0, 0, edge, strlen(edge))) return;
+	if(!recvFrame(fd, &header, NULL, 0) || header.type != FORWARDACK) return;
+	next = header.sequence;
+	pthread_mutex_lock(&sp->lock);
+	uint64_t base = sp->base;
+	uint64_t end = sp->end;
+	pthread_mutex_unlock(&sp->lock);
+	if(next > end) {
+		fprintf(stderr, "forward: collector wants %llu but the spool ends at %llu, skipping ahead\n", (unsigned long long)next, (unsigned long long)end);
+		spoolSkip(sp, next);
+	} else if(next < base) {
+		fprintf(stderr, "forward: collector wants %llu but the spool starts at %llu\n", (unsigned long long)next, (unsigned long long)base);
+		next = base;
+	}
+	spoolAck(sp, next);
+	struct forwardrecord *records = (struct forwardrecord *)malloc(BATCHRECORDS * sizeof(struct forwardrecord));
+	uint8_t *packed = (uint8_t *)malloc(PACKEDMAX);
+	while(records != NULL && packed != NULL) {
+		if(!spoolWait(sp, next, 1000)) continue;
+		int count = spoolRead(sp, next, records, BATCHRECORDS);
+		if(count == 0) {
+			/* Trimmed from under us, can only happen after a skip */
+			pthread_mutex_lock(&sp->lock);
+			next = sp->base;
+			pthread_mutex_unlock(&sp->lock);
+			continue;
+		}
+		int length = packBatch(records, count, packed, PACKEDMAX);
+		if(length < 0 || !sendFrame(fd, FORWARDBATCH, next, count, packed, length)) break;
+		if(!recvFrame(fd, &header, NULL, 0) || header.type != FORWARDACK) break;
+		next = header.sequence;
+		spoolAck(sp, next);
+	}
+	free(records);
+	free(packed);
+}
+
+void forwardRun(struct spool *sp, const char *host, const char *port, const char *edge) {
+	int backoff = 1;
+	while(true) {
+		int fd = connectTo(host, port);
+		if(fd >= 0) {
+			fprintf(stderr, "forward: connected to %s:%s\n", host, port);
+			backoff = 1;
+			forwardSession(sp, fd, edge);
+			close(fd);
+			fprintf(stderr, "forward: lost %s:%s\n", host, port);
+		}
+		sleep(backoff);
+		if(backoff < MAXBACKOFF) backoff *= 2;
+	}
+}
@@ -0,0 +1,118 @@
+/* Store and forward for the DS1921L logger
+ *
+ * 2021 Angular Fish
+ *
+ * Readings are appended to a spool on the Pi's own disk first and sent to a
+ * collector from there, so the network going away costs nothing but a
+ * delay. Every reading in the spool has a sequence number, counting up from
+ * the first one the Pi ever spooled. The collector keeps track of the next
+ * one it wants from each Pi and says so when a Pi connects, so sending picks
+ * up where it left off however either end was stopped.
+ *
+ * The spool is a directory with two files:
+ * queue  a header giving the sequence number of the first record, then the
+ *        records
+ * acked  the sequence number the collector last asked for, everything
+ *        before it is safe to throw away
+ * Once everything has been acknowledged and the queue has grown past
+ * SPOOLTRIM it is started again empty.
+ *
+ * On the wire everything is a forwardheader followed by length bytes:
+ * HELLO  the Pi's name (edge -> collector)
+ * ACK    sequence is the next reading wanted (collector -> edge), sent in
+ *        reply to HELLO and after every batch
+ * BATCH  count readings from sequence on, compressed with zlib
+ * in the byte order of the Pi, which is the same as a PC's.
+ */
+
+#ifndef FORWARD_H
+#define FORWARD_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define FORWARDMAGIC 0x50524249 // "IBRP"
+#define FORWARDHELLO 1
+#define FORWARDACK 2
+#define FORWARDBATCH 3
+
+#define BATCHRECORDS 1024 // most readings in one batch
+#define MAXEDGENAME 64
+#define SPOOLTRIM (1 << 20)
+
+struct forwardheader {
+	uint32_t magic;
+	uint32_t type;
+	uint32_t length; // of what follows
+	uint32_t count;
+	uint64_t sequence;
+};
+
+/* One reading. Times are microseconds since the epoch. */
+struct forwardrecord {
+	int64_t time;
+	uint8_t rom[8];
+	float temperature;
+	uint32_t reserved;
+};
+
+struct spool {
+	char dir[PATH_MAX];
+	int fd;
+	int ackedfd;
+	uint64_t base; // sequence number of the first record in the queue file
+	uint64_t end; // of the next record to be added
+	uint64_t acked;
+	pthread_mutex_t lock;
+	pthread_cond_t appended;
+};
+
+bool spoolOpen(struct spool *sp, const char *dir);
+bool spoolAppend(struct spool *sp, const struct forwardrecord *r);
+void spoolSync(struct spool *sp);
+
+/* Reads up to max records starting at sequence from, returns how many */
+int spoolRead(struct spool *sp, uint64_t from, struct forwardrecord *out, int max);
+
+/* Waits up to ms milliseconds for there to be a record at sequence from.
+ * Returns true if there is one.
+ */
+bool spoolWait(struct spool *sp, uint64_t from, int ms);
+
+/* Notes that the collector has everything before next, trimming the queue
+ * if it can.
+ */
+bool spoolAck(struct spool *sp, uint64_t next);
+
+/* The collector wants readings from a sequence number past the end of the
+ * spool (the spool was lost): number the next ones from there.
+ */
+void spoolSkip(struct spool *sp, uint64_t next);
+
+/* Connects to host:port with a timeout on reads, returns the socket or -1 */
+int connectTo(const char *host, const char *port);
+
+bool sendAll(int fd, const void *buffer, size_t length);
+bool recvAll(int fd, void *buffer, size_t length);
+bool sendFrame(int fd, uint32_t type, uint64_t sequence, uint32_t count, const void *payload, uint32_t length);
+
+/* Reads a frame's header and up to max bytes of payload. Returns false on
+ * a bad magic number, a payload that won't fit or the connection going.
+ */
+bool recvFrame(int fd, struct forwardheader *header, void *payload, uint32_t max);
+
+/* Room needed to pack a full batch */
+#define PACKEDMAX (BATCHRECORDS * sizeof(struct forwardrecord) + BATCHRECORDS * sizeof(struct forwardrecord) / 1000 + 64)
+
+/* Compresses count records into out, returning the length or -1 */
+int packBatch(const struct forwardrecord *records, int count, uint8_t *out, size_t max);
+bool unpackBatch(const uint8_t *in, uint32_t length, struct forwardrecord *records, int count);
+
+/* Sends the spool to the collector at host:port for ever, reconnecting
+ * with backoff whenever it can't.
+ */
+void forwardRun(struct spool *sp, const char *host, const char *port, const char *edge);
+
+#endif
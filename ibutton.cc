@@ -120,7 +120,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#ifdef GPIOD
+#include <gpiod.h>
+#endif
+#include "archive.h"
+#include "samplelog.h"
+#include "forward.h"
+#include "mission.h"
+#include "pagestore.h"
+#include "database.h"
+#include "influx.h"
 
 /* ROM Functions are the first functions to run
  * after reset
@@ -146,15 +168,7 @@
  */
 #define CONVERTTEMP 0x44
 
-/* Memory mapping for the chip */
-#define SRAMSTART 0x0000
-#define REGISTERSTART 0x0200
-#define ALARMSTART 0x0220
-#define RESERVED1 0x0280
-#define HISTSTART 0x0800
-#define RESERVED2 0x0880
-#define DATALOGSTART 0x1000
-#define RESERVED3 0x1800
+/* The memory map is in mission.h */
 
 /* Special addresses */
 #define TEMPADDR 0x0211
@@ -172,6 +186,31 @@
 #define CONTROLREG 0x020E
 #define MISDELAY 0x0212
 
+/* Memory is read and written in 32 byte pages */
+#define PAGESIZE 32
+
+/* Bytes a READMEMCRC from TEMPADDR gets back: the rest of its page, then the
+ * CRC16
+ */
+#define TEMPREADLEN (PAGESIZE - (TEMPADDR & 0x1F) + 2)
+
+/* Most bytes written in one reset cycle */
+#define MAXTXBYTES 16
+
+/* Bit banging delays in microseconds: how long the line is held low, how
+ * long after letting go it's sampled, and how long is left of the slot.
+ */
+#define RESETLOW 480
+#define RESETSAMPLE 70
+#define RESETREST 410
+#define WRITE1LOW 10
+#define WRITE1REST 55
+#define WRITE0LOW 65
+#define WRITE0REST 5
+#define READLOW 5
+#define READSAMPLE 10
+#define READREST 53
+
 /* Control register bits */
 #define ENABLEOSC 0b00000000
 #define ENABLECLR 0b01000000
@@ -186,6 +225,110 @@
  */
 uint8_t targetpin = RPI_GPIO_P1_16;
 
+/* Every bus that gets sampled, each on its own pin. The first one is
+ * targetpin, more can be added with -p.
+ */
+#define MAXBUSES 8
+uint8_t buspins[MAXBUSES];
+int buscount = 0;
+
+/* Seconds between single-shot conversions */
+int sampleinterval = 300;
+
+/* How the bus is driven: bit banged on the GPIO with the bcm2835 library
+ * or through a UART.
+ */
+#define GPIOTRANSPORT 0
+#define UARTTRANSPORT 1
+#define CDEVTRANSPORT 2
+int transport = GPIOTRANSPORT;
+
+/* GPIO character device transport, further down */
+int cdevReset(uint8_t pin);
+void cdevWriteBit(uint8_t pin, int b);
+uint8_t cdevReadBit(uint8_t pin);
+
+/* UART transport
+ * A UART with its TX and RX tied to the bus (through a diode or an open
+ * drain buffer) can make the 1-wire slots itself. At 115200 baud one UART
+ * byte is one slot: the start bit is the low pulse, 0xFF releases the line
+ * straight after it (a 1 or a read slot) and 0x00 holds it low for the whole
+ * byte (a 0). Every byte sent comes straight back on RX, and a device
+ * sending a 0 pulls some of the bits low, so anything but 0xFF read back is
+ * a 0. Resets are a 0xF0 at 9600 baud, which comes back as something other
+ * than 0xF0 if a device answers with a presence pulse. The timing all comes
+ * from the UART so a busy CPU doesn't matter, and all the slots of a byte or
+ * a whole transaction go out in a single write.
+ */
+int uartfd = -1;
+
+bool uartSetBaud(speed_t speed) {
+	struct termios tio;
+	if(tcgetattr(uartfd, &tio) != 0) return false;
+	cfsetispeed(&tio, speed);
+	cfsetospeed(&tio, speed);
+	return tcsetattr(uartfd, TCSADRAIN, &tio) == 0;
+}
+
+bool uartOpen(const char *path) {
+	uartfd = open(path, O_RDWR | O_NOCTTY);
+	if(uartfd < 0) return false;
+	struct termios tio;
+	if(tcgetattr(uartfd, &tio) != 0) return false;
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~(CSTOPB | PARENB);
+	if(tcsetattr(uartfd, TCSANOW, &tio) != 0) return false;
+	return uartSetBaud(B115200);
+}
+
+/* Reads exactly len bytes, giving up after 100ms without any */
+bool uartRead(uint8_t *buffer, int len) {
+	int got = 0;
+	while(got < len) {
+		struct pollfd pfd = {uartfd, POLLIN, 0};
+		if(poll(&pfd, 1, 100) <= 0) return false;
+		ssize_t n = read(uartfd, buffer + got, len - got);
+		if(n <= 0) return false;
+		got += n;
+	}
+	return true;
+}
+
+/* Sends len slots in one write and reads back what the line did in each */
+bool uartSlots(const uint8_t *out, uint8_t *in, int len) {
+	if(write(uartfd, out, len) != len) return false;
+	return uartRead(in, len);
+}
+
+/* Returns LOW if a device answered, like reset() */
+int uartReset() {
+	uint8_t b = 0xF0;
+	tcflush(uartfd, TCIFLUSH);
+	if(!uartSetBaud(B9600)) return HIGH;
+	bool answered = write(uartfd, &b, 1) == 1 && uartRead(&b, 1) && b != 0xF0;
+	uartSetBaud(B115200);
+	return answered ? LOW : HIGH;
+}
+
+/* Runs the slots of a whole transaction after the reset in a single write:
+ * txlen bytes written then rxlen bytes read.
+ */
+bool uartTransfer(const uint8_t *tx, int txlen, uint8_t *rx, int rxlen) {
+	uint8_t slots[8 * (MAXTXBYTES + PAGESIZE)];
+	int len = (txlen + rxlen) * 8;
+	int i;
+	if(len > (int)sizeof(slots)) return false;
+	for(i = 0; i < txlen * 8; i++) slots[i] = (tx[i / 8] >> (i % 8)) & 1 ? 0xFF : 0x00;
+	for(; i < len; i++) slots[i] = 0xFF;
+	if(!uartSlots(slots, slots, len)) return false;
+	if(rxlen > 0) memset(rx, 0, rxlen);
+	for(i = 0; i < rxlen * 8; i++) {
+		if(slots[txlen * 8 + i] == 0xFF) rx[i / 8] |= 1 << (i % 8);
+	}
+	return true;
+}
+
 /* 1-wire bit banging functions cobbled together
  * from the arduino 1-wire library:
  * https://www.pjrc.com/teensy/td_libs_OneWire.html
@@ -193,13 +336,22 @@ uint8_t targetpin = RPI_GPIO_P1_16;
  * https://www.iot-programmer.com/index.php/books/22-raspberry-pi-and-the-iot-in-c/chapters-raspberry-pi-and-the-iot-in-c/36-raspberry-pi-and-the-iot-in-c-one-wire-basics
  */
 void writeBit(uint8_t pin, int b) {
+	if(transport == CDEVTRANSPORT) {
+		cdevWriteBit(pin, b);
+		return;
+	}
+	if(transport == UARTTRANSPORT) {
+		uint8_t slot = b ? 0xFF : 0x00;
+		uartSlots(&slot, &slot, 1);
+		return;
+	}
 	int delay1, delay2;
 	if(b==1) {
-		delay1 = 10;
-		delay2 = 55;
+		delay1 = WRITE1LOW;
+		delay2 = WRITE1REST;
 	} else {
-		delay1 = 65;
-		delay2 = 5;
+		delay1 = WRITE0LOW;
+		delay2 = WRITE0REST;
 	}
 	bcm2835_gpio_fsel(pin, BCM2835_GPIO_FSEL_OUTP);
 	bcm2835_gpio_write(pin, LOW);
@@ -210,6 +362,11 @@ void writeBit(uint8_t pin, int b) {
 }
 
 void writeByte(uint8_t pin, int byte) {
+	if(transport == UARTTRANSPORT) {
+		uint8_t b = byte;
+		uartTransfer(&b, 1, NULL, 0);
+		return;
+	}
 	int i;
 	for(i = 0; i < 8; i++) {
 		if(byte & 1) {
@@ -222,17 +379,28 @@ void writeByte(uint8_t pin, int byte) {
 }
 
 uint8_t readBit(uint8_t pin) {
+	if(transport == CDEVTRANSPORT) return cdevReadBit(pin);
+	if(transport == UARTTRANSPORT) {
+		uint8_t slot = 0xFF;
+		if(!uartSlots(&slot, &slot, 1)) return HIGH;
+		return slot == 0xFF ? HIGH : LOW;
+	}
 	bcm2835_gpio_fsel(pin, BCM2835_GPIO_FSEL_OUTP);
 	bcm2835_gpio_write(pin, LOW);
-	bcm2835_delayMicroseconds(5);
+	bcm2835_delayMicroseconds(READLOW);
 	bcm2835_gpio_fsel(pin, BCM2835_GPIO_FSEL_INPT);
-	bcm2835_delayMicroseconds(10);
+	bcm2835_delayMicroseconds(READSAMPLE);
 	uint8_t b = bcm2835_gpio_lev(pin);
-	bcm2835_delayMicroseconds(53);
+	bcm2835_delayMicroseconds(READREST);
 	return b;
 }
 
 int readByte(uint8_t pin) {
+	if(transport == UARTTRANSPORT) {
+		uint8_t b = 0xFF;
+		uartTransfer(NULL, 0, &b, 1);
+		return b;
+	}
 	int byte = 0;
 	int i;
 	for(i = 0; i < 8; i++) {
@@ -242,16 +410,37 @@ int readByte(uint8_t pin) {
 }
 
 int reset(uint8_t pin) {
+	if(transport == CDEVTRANSPORT) return cdevReset(pin);
+	if(transport == UARTTRANSPORT) return uartReset();
 	bcm2835_gpio_fsel(pin, BCM2835_GPIO_FSEL_OUTP);
 	bcm2835_gpio_write(pin, LOW);
-	bcm2835_delayMicroseconds(480);
+	bcm2835_delayMicroseconds(RESETLOW);
 	bcm2835_gpio_fsel(pin, BCM2835_GPIO_FSEL_INPT);
-	bcm2835_delayMicroseconds(70);
+	bcm2835_delayMicroseconds(RESETSAMPLE);
 	uint8_t b = bcm2835_gpio_lev(pin);
-	bcm2835_delayMicroseconds(410);
+	bcm2835_delayMicroseconds(RESETREST);
 	return b;
 }
 
+/* Microseconds from a clock that doesn't jump when the system time is set,
+ * used for scheduling samples and background work.
+ */
+uint64_t monotonicMicros() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* bcm2835_delayMicroseconds can't do long waits unless the library has been
+ * set up, which it isn't for the UART transport.
+ */
+void sleepMicros(uint64_t micros) {
+	struct timespec ts;
+	ts.tv_sec = micros / 1000000;
+	ts.tv_nsec = (micros % 1000000) * 1000;
+	nanosleep(&ts, NULL);
+}
+
 void delay(int seconds) {
 	/* clock_t starttime = clock();
 	uint32_t endtime = starttime + seconds * CLOCKS_PER_SEC;
@@ -400,42 +589,3490 @@ void missionStart(uint8_t pin, uint16_t delay, uint8_t creg) {
 	reset(pin);
 }
 
-int main(int argc, char *argv[]) {
-	if(!bcm2835_init()) return 1;
-	printf("time, id, temperature\n");
-	time_t rawtime;
+/* Several devices on one bus
+ * SKIPROM talks to every device at once, which is fine for writes but
+ * useless for reads, since the devices all answer on top of each other. To
+ * set up a fleet the scratchpad is written to all of them in one go with
+ * SKIPROM, each device's copy is read back by MATCHROM to check it, and the
+ * copy to memory is done for all of them in one go again. Any device that
+ * didn't get it right is then done on its own. That's one write plus a short
+ * read per device instead of a full write, read and copy for every one.
+ */
+#define MAXDEVICES 16
+
+/* Every device found on every bus. Devices keep their place in the table
+ * for as long as the program runs, so per-device state can be kept in
+ * arrays indexed the same way.
+ */
+struct device {
+	uint8_t pin;
+	uint8_t rom[8];
+};
+
+struct device devices[MAXBUSES * MAXDEVICES];
+int devicecount = 0;
+
+/* Finds the ROM IDs of every device on the bus with the SEARCHROM binary
+ * tree walk from Maxim's application note 187. Returns how many were found.
+ */
+int searchROM(uint8_t pin, uint8_t roms[][8], int max) {
+	uint8_t rom[8] = {0};
+	int lastdiscrepancy = 0;
+	int count = 0;
+	while(count < max) {
+		if(reset(pin) == HIGH) break;
+		writeByte(pin, SEARCHROM);
+		int lastzero = 0;
+		int bit;
+		for(bit = 1; bit <= 64; bit++) {
+			uint8_t idbit = readBit(pin);
+			uint8_t complement = readBit(pin);
+			if(idbit == HIGH && complement == HIGH) return count; // nobody answered
+			uint8_t direction;
+			if(idbit != complement) {
+				direction = idbit == HIGH;
+			} else if(bit < lastdiscrepancy) {
+				direction = (rom[(bit - 1) / 8] >> ((bit - 1) % 8)) & 1;
+			} else {
+				direction = bit == lastdiscrepancy;
+			}
+			if(idbit == LOW && complement == LOW && direction == 0) lastzero = bit;
+			if(direction) rom[(bit - 1) / 8] |= 1 << ((bit - 1) % 8);
+			else rom[(bit - 1) / 8] &= ~(1 << ((bit - 1) % 8));
+			writeBit(pin, direction);
+		}
+		if(crc8(rom, 7) == rom[7]) memcpy(roms[count++], rom, 8);
+		lastdiscrepancy = lastzero;
+		if(lastdiscrepancy == 0) break;
+	}
+	return count;
+}
+
+/* Sends the ROM command after a reset: MATCHROM and the ID, or SKIPROM for
+ * everyone if rom is NULL.
+ */
+void selectROM(uint8_t pin, const uint8_t *rom) {
+	int i;
+	if(rom == NULL) {
+		writeByte(pin, SKIPROM);
+		return;
+	}
+	writeByte(pin, MATCHROM);
+	for(i = 0; i < 8; i++) writeByte(pin, rom[i]);
+}
+
+void writeScratchROM(uint8_t pin, const uint8_t *rom, uint16_t address, const uint8_t *data, uint8_t length) {
+	int i;
+	reset(pin);
+	selectROM(pin, rom);
+	writeByte(pin, WRITESCRATCH);
+	writeAddr(pin, address);
+	for(i = 0; i < length; i++) writeByte(pin, data[i]);
+}
+
+/* Like verifyScratch, but for one device and checking the data too */
+bool verifyScratchROM(uint8_t pin, const uint8_t *rom, uint16_t address, const uint8_t *data, uint8_t length) {
+	int i;
+	if(reset(pin) == HIGH) return false;
+	selectROM(pin, rom);
+	writeByte(pin, READSCRATCH);
+	uint16_t returnaddress = (uint16_t)readByte(pin);
+	returnaddress |= (uint16_t)readByte(pin) << 8;
+	uint8_t returnlen = readByte(pin);
+	uint8_t endoffset = (address & 0x1F) + length - 1;
+	if(returnaddress != address || (returnlen & 0x1F) != endoffset) return false;
+	for(i = 0; i < length; i++) {
+		if(readByte(pin) != data[i]) return false;
+	}
+	return true;
+}
+
+void commitScratchROM(uint8_t pin, const uint8_t *rom, uint16_t address, uint8_t length) {
+	uint8_t endoffset = (address & 0x1F) + length - 1;
+	reset(pin);
+	selectROM(pin, rom);
+	writeByte(pin, COPYSCRATCH);
+	writeAddr(pin, address);
+	writeByte(pin, endoffset);
+	bcm2835_delayMicroseconds(100);
+}
+
+/* Writes length bytes at address to every device on the bus. Returns the
+ * number of devices that ended up configured.
+ */
+int configureAll(uint8_t pin, uint16_t address, const uint8_t *data, uint8_t length) {
+	uint8_t roms[MAXDEVICES][8];
+	bool ok[MAXDEVICES];
+	int count = searchROM(pin, roms, MAXDEVICES);
+	int i;
+	if(count == 0) return 0;
+	writeScratchROM(pin, NULL, address, data, length);
+	for(i = 0; i < count; i++) ok[i] = verifyScratchROM(pin, roms[i], address, data, length);
+	commitScratchROM(pin, NULL, address, length);
+	int configured = 0;
+	for(i = 0; i < count; i++) {
+		if(!ok[i]) {
+			writeScratchROM(pin, roms[i], address, data, length);
+			if(!verifyScratchROM(pin, roms[i], address, data, length)) {
+				fprintf(stderr, "Failed to configure device %d at %04X\n", i, address);
+				continue;
+			}
+			commitScratchROM(pin, roms[i], address, length);
+		}
+		configured++;
+	}
+	return configured;
+}
+
+/* Adds any devices on pin that aren't in the table yet */
+void discoverDevices(uint8_t pin) {
+	uint8_t roms[MAXDEVICES][8];
+	int count = searchROM(pin, roms, MAXDEVICES);
+	int i, j;
+	for(i = 0; i < count; i++) {
+		for(j = 0; j < devicecount; j++) {
+			if(devices[j].pin == pin && memcmp(devices[j].rom, roms[i], 8) == 0) break;
+		}
+		if(j < devicecount || devicecount == MAXBUSES * MAXDEVICES) continue;
+		devices[devicecount].pin = pin;
+		memcpy(devices[devicecount].rom, roms[i], 8);
+		__atomic_store_n(&devicecount, devicecount + 1, __ATOMIC_RELEASE); // the socket server reads the table
+	}
+}
+
+/* The first device found on pin from devices[from] on, -1 if there aren't
+ * any more.
+ */
+int nextDevice(uint8_t pin, int from) {
+	int i;
+	for(i = from; i < devicecount; i++) {
+		if(devices[i].pin == pin) return i;
+	}
+	return -1;
+}
+
+/* The ROM ID to read the registers of pin's device by, NULL to SKIPROM
+ * when nothing's been found there
+ */
+const uint8_t *firstROM(uint8_t pin) {
+	int i = nextDevice(pin, 0);
+	return i < 0 ? NULL : devices[i].rom;
+}
+
+uint8_t toBCD(int value) {
+	return (uint8_t)(((value / 10) << 4) | (value % 10));
+}
+
+/* setRTC for every device on the bus, in 24 hour mode */
+int setRTCAll(uint8_t pin) {
+	time_t currtime;
+	time(&currtime);
+	struct tm *timestruct = localtime(&currtime);
+	uint8_t rtc[7];
+	rtc[0] = toBCD(timestruct->tm_sec);
+	rtc[1] = toBCD(timestruct->tm_min);
+	rtc[2] = toBCD(timestruct->tm_hour);
+	rtc[3] = timestruct->tm_wday + 1;
+	rtc[4] = toBCD(timestruct->tm_mday);
+	rtc[5] = 1 << 7 | toBCD(timestruct->tm_mon + 1);
+	rtc[6] = toBCD(timestruct->tm_year - 100);
+	return configureAll(pin, RTCSECONDS, rtc, 7);
+}
+
+/* clearMem for every device on the bus */
+int clearMemAll(uint8_t pin) {
+	uint8_t creg = ENABLECLR;
+	int configured = configureAll(pin, CONTROLREG, &creg, 1);
+	reset(pin);
+	writeByte(pin, SKIPROM);
+	writeByte(pin, CLEARMEM);
+	reset(pin);
+	return configured;
+}
+
+/* missionStart for every device on the bus */
+int missionStartAll(uint8_t pin, uint16_t delay, uint8_t creg) {
+	uint8_t data[6] = {creg, 0x00, 0x00, 0x00, (uint8_t)(delay & 0xFF), (uint8_t)(delay >> 8)};
+	return configureAll(pin, CONTROLREG, data, 6);
+}
+
+/* Reads the 32 byte page at address (which has to start a page) from the
+ * device with ROM ID rom, or whatever's on the bus if it's NULL. The page
+ * comes with the device's CRC16, which goes in crc if it isn't NULL, and
+ * it's false if the page doesn't match it. Each page is its own reset cycle
+ * so long reads can be broken up between pages.
+ */
+bool readPage(uint8_t pin, const uint8_t *rom, uint16_t address, uint8_t *buffer, uint16_t *crc) {
+	if(reset(pin) == HIGH) return false;
+	selectROM(pin, rom);
+	writeByte(pin, READMEMCRC);
+	writeAddr(pin, address);
+	int i;
+	for(i = 0; i < PAGESIZE; i++) {
+		buffer[i] = readByte(pin);
+	}
+	uint16_t sent = readByte(pin);
+	sent |= readByte(pin) << 8;
+	if(crc != NULL) *crc = sent;
+	return readCRC(address, buffer, PAGESIZE) == sent;
+}
+
+/* Interleaved buses
+ * Most of every slot is spent waiting for the line to do something (55us of
+ * the 65us in a written 1, for example). Rather than driving several buses
+ * one after the other, runInterleaved drives one transaction per bus from a
+ * single thread: every slot is broken into its edges (pull low, release,
+ * sample, end of slot) and the next edge due on any bus is done when its time
+ * comes, so slots on different pins overlap in time. Each transaction is a
+ * reset followed by some bytes written and some bytes read, which covers
+ * everything the DS1921L needs in a reset cycle.
+ */
+struct wiretransaction {
+	uint8_t pin;
+	uint8_t tx[MAXTXBYTES];
+	int txlen;
+	uint8_t *rx;
+	int rxlen;
+	bool present; // got a presence pulse after the reset
+	bool done;
+	int slot; // 0 is the reset, then a slot per bit written then read
+	int edge; // 0 pull low, 1 release, 2 sample, 3 end of slot
+	uint64_t slotstart;
+};
+
+/* Edge times in microseconds from the start of the slot, matching reset,
+ * writeBit and readBit. A sample time of 0 means the slot has no sample.
+ */
+struct slottiming {
+	uint16_t release;
+	uint16_t sample;
+	uint16_t end;
+};
+
+const struct slottiming resetslot = {480, 550, 960};
+const struct slottiming write1slot = {10, 0, 65};
+const struct slottiming write0slot = {65, 0, 70};
+const struct slottiming readslot = {5, 15, 68};
+
+void setupTransaction(struct wiretransaction *t, uint8_t pin, const uint8_t *tx, int txlen, uint8_t *rx, int rxlen) {
+	memset(t, 0, sizeof(*t));
+	t->pin = pin;
+	memcpy(t->tx, tx, txlen);
+	t->txlen = txlen;
+	t->rx = rx;
+	t->rxlen = rxlen;
+	if(rxlen > 0) memset(rx, 0, rxlen);
+}
+
+const struct slottiming *slotTiming(struct wiretransaction *t) {
+	if(t->slot == 0) return &resetslot;
+	int bit = t->slot - 1;
+	if(bit < t->txlen * 8) {
+		if((t->tx[bit / 8] >> (bit % 8)) & 1) return &write1slot;
+		return &write0slot;
+	}
+	return &readslot;
+}
+
+uint64_t nextEdge(struct wiretransaction *t) {
+	const struct slottiming *timing = slotTiming(t);
+	switch(t->edge) {
+	case 0: return t->slotstart;
+	case 1: return t->slotstart + timing->release;
+	case 2: return t->slotstart + timing->sample;
+	default: return t->slotstart + timing->end;
+	}
+}
+
+void doEdge(struct wiretransaction *t) {
+	const struct slottiming *timing = slotTiming(t);
+	switch(t->edge) {
+	case 0:
+		bcm2835_gpio_fsel(t->pin, BCM2835_GPIO_FSEL_OUTP);
+		bcm2835_gpio_write(t->pin, LOW);
+		t->slotstart = monotonicMicros(); // time the rest of the slot from the real edge
+		t->edge = 1;
+		return;
+	case 1:
+		bcm2835_gpio_fsel(t->pin, BCM2835_GPIO_FSEL_INPT);
+		t->edge = timing->sample ? 2 : 3;
+		return;
+	case 2: {
+		uint8_t b = bcm2835_gpio_lev(t->pin);
+		if(t->slot == 0) {
+			t->present = (b == LOW);
+		} else {
+			int bit = t->slot - 1 - t->txlen * 8;
+			t->rx[bit / 8] |= b << (bit % 8);
+		}
+		t->edge = 3;
+		return;
+	}
+	default:
+		if(t->slot == 0 && !t->present) {
+			t->done = true;
+			return;
+		}
+		t->slot++;
+		t->edge = 0;
+		t->slotstart += timing->end;
+		if(t->slot > (t->txlen + t->rxlen) * 8) t->done = true;
+		return;
+	}
+}
+
+/* Runs a transaction start to finish on its own. The UART transport does
+ * all of its slots in one go this way.
+ */
+void runTransaction(struct wiretransaction *t) {
+	int i;
+	t->done = true;
+	t->present = reset(t->pin) == LOW;
+	if(!t->present) return;
+	if(transport == UARTTRANSPORT) {
+		uartTransfer(t->tx, t->txlen, t->rx, t->rxlen);
+		return;
+	}
+	for(i = 0; i < t->txlen; i++) writeByte(t->pin, t->tx[i]);
+	for(i = 0; i < t->rxlen; i++) t->rx[i] = readByte(t->pin);
+}
+
+void runInterleaved(struct wiretransaction *t, int count) {
+	int i;
+	if(transport != GPIOTRANSPORT) {
+		for(i = 0; i < count; i++) runTransaction(&t[i]);
+		return;
+	}
+	uint64_t now = monotonicMicros();
+	for(i = 0; i < count; i++) t[i].slotstart = now;
 	while(true) {
-		time(&rawtime);
-		char* str1 = ctime(&rawtime);
-		str1[strcspn(str1,"\n")] = 0;
-		printf("%20s, ", str1);
-		int check = 0;
-		int ret = 0;
-		float temp = 0;
-		check = reset(targetpin);
-		if(check == HIGH) printf("failed to connect.\n");
-		writeByte(targetpin, 0x33);
-		int i = 0;
-		for(i = 0; i < 8; i++) {
-			ret = readByte(targetpin);
-			printf("%X",ret);
-		}
-		printf(", ");
-		temp = oneShotConvert(targetpin); 
-		/* writeByte(targetpin, 0x44);
-		bcm2835_delayMicroseconds(300000);
-		check = reset(targetpin);
-		if(check == HIGH) printf("failed to reconnect.\n");
-		writeByte(targetpin, 0xCC);
-		writeByte(targetpin, 0xF0);
-		writeByte(targetpin, 0x11);
-		writeByte(targetpin, 0x02);
-		ret = readByte(targetpin);
-		temp = ((float)ret / 2) - 40;*/
-
-		printf("%.1f\n",temp);
-		fflush(stdout);
-		delay(300);
+		int next = -1;
+		uint64_t nexttime = 0;
+		for(i = 0; i < count; i++) {
+			if(t[i].done) continue;
+			uint64_t edgetime = nextEdge(&t[i]);
+			if(next < 0 || edgetime < nexttime) {
+				next = i;
+				nexttime = edgetime;
+			}
+		}
+		if(next < 0) return;
+		while(monotonicMicros() < nexttime) { }
+		doEdge(&t[next]);
+	}
+}
+
+/* Simulated DS1921L
+ * A model of the device as seen from the line, used to check waveforms and
+ * to stand in for real hardware. The master only ever does three things to
+ * the line: a long reset pulse, a short low pulse (a 1 written or a read
+ * slot, the device can't tell the difference) or a long low pulse (a 0
+ * written). The device answers a reset with a presence pulse and answers a
+ * short pulse with its next output bit when it has something to say.
+ */
+#define SIMIDLE 0
+#define SIMROMCMD 1
+#define SIMMATCHROM 2
+#define SIMSEARCHROM 3
+#define SIMFUNCCMD 4
+#define SIMADDRESS 5
+#define SIMWRITESCRATCH 6
+#define SIMCOPYSCRATCH 7
+#define SIMOUTPUT 8
+
+struct simdevice {
+	uint8_t rom[8];
+	uint8_t mem[MEMSIZE];
+	uint8_t scratch[PAGESIZE];
+	uint16_t scratchaddr;
+	uint8_t scratchend; // E/S byte
+	float temperature; // what the next conversion reads
+	int state;
+	int command; // function command waiting on its address
+	uint8_t params[8];
+	int paramcount;
+	uint8_t inbyte;
+	int inbits;
+	const uint8_t *out;
+	int outlen;
+	int outbit;
+	uint8_t outbuf[3 + PAGESIZE];
+	int searchbit; // bit of the ROM being searched
+	int searchstep; // 0 send bit, 1 send complement, 2 read direction
+};
+
+void simInit(struct simdevice *dev, const uint8_t *rom, float temperature) {
+	memset(dev, 0, sizeof(*dev));
+	memcpy(dev->rom, rom, 7);
+	dev->rom[7] = crc8(rom, 7);
+	dev->temperature = temperature;
+}
+
+bool simReset(struct simdevice *dev) {
+	dev->state = SIMROMCMD;
+	dev->inbits = 0;
+	dev->inbyte = 0;
+	dev->paramcount = 0;
+	return true;
+}
+
+void simOutput(struct simdevice *dev, const uint8_t *out, int len) {
+	dev->state = SIMOUTPUT;
+	dev->out = out;
+	dev->outlen = len;
+	dev->outbit = 0;
+}
+
+/* Acts on a whole byte received from the master */
+void simByte(struct simdevice *dev, uint8_t byte) {
+	switch(dev->state) {
+	case SIMROMCMD:
+		if(byte == READROM) simOutput(dev, dev->rom, 8);
+		else if(byte == SKIPROM) dev->state = SIMFUNCCMD;
+		else if(byte == MATCHROM) dev->state = SIMMATCHROM;
+		else if(byte == SEARCHROM || (byte == CONDITIONALSEARCH && (dev->mem[0x0214] & 0x07))) {
+			dev->state = SIMSEARCHROM;
+			dev->searchbit = 0;
+			dev->searchstep = 0;
+		} else dev->state = SIMIDLE;
+		break;
+	case SIMMATCHROM:
+		if(byte != dev->rom[dev->paramcount]) {
+			dev->state = SIMIDLE;
+			break;
+		}
+		if(++dev->paramcount == 8) {
+			dev->paramcount = 0;
+			dev->state = SIMFUNCCMD;
+		}
+		break;
+	case SIMFUNCCMD:
+		dev->command = byte;
+		dev->paramcount = 0;
+		if(byte == CONVERTTEMP) {
+			dev->mem[TEMPADDR] = (uint8_t)((dev->temperature + 40.0) * 2);
+			dev->state = SIMIDLE;
+		} else if(byte == CLEARMEM) {
+			if(dev->mem[CONTROLREG] & ENABLECLR) {
+				memset(&dev->mem[ALARMSTART], 0, RESERVED1 - ALARMSTART);
+				memset(&dev->mem[HISTSTART], 0, RESERVED2 - HISTSTART);
+				memset(&dev->mem[DATALOGSTART], 0, RESERVED3 - DATALOGSTART);
+				memset(&dev->mem[0x0214], 0, REGISTERSTART + PAGESIZE - 0x0214);
+				dev->mem[CONTROLREG] &= ~ENABLECLR;
+			}
+			dev->state = SIMIDLE;
+		} else if(byte == READSCRATCH) {
+			dev->outbuf[0] = dev->scratchaddr & 0xFF;
+			dev->outbuf[1] = dev->scratchaddr >> 8;
+			dev->outbuf[2] = dev->scratchend;
+			int offset = dev->scratchaddr & 0x1F;
+			memcpy(&dev->outbuf[3], &dev->scratch[offset], PAGESIZE - offset);
+			simOutput(dev, dev->outbuf, 3 + PAGESIZE - offset);
+		} else if(byte == COPYSCRATCH) {
+			dev->state = SIMCOPYSCRATCH;
+		} else if(byte == WRITESCRATCH || byte == READMEM || byte == READMEMCRC) {
+			dev->state = SIMADDRESS;
+		} else dev->state = SIMIDLE;
+		break;
+	case SIMADDRESS:
+		dev->params[dev->paramcount++] = byte;
+		if(dev->paramcount < 2) break;
+		{
+			uint16_t address = dev->params[0] | dev->params[1] << 8;
+			if(address >= MEMSIZE) {
+				dev->state = SIMIDLE;
+			} else if(dev->command == WRITESCRATCH) {
+				dev->scratchaddr = address;
+				dev->scratchend = address & 0x1F;
+				dev->paramcount = 0;
+				dev->state = SIMWRITESCRATCH;
+			} else if(dev->command == READMEMCRC) {
+				/* Only the first page and its CRC, which is all
+				 * that's ever read
+				 */
+				int length = PAGESIZE - (address & 0x1F);
+				uint16_t crc = readCRC(address, &dev->mem[address], length);
+				memcpy(dev->outbuf, &dev->mem[address], length);
+				dev->outbuf[length] = crc & 0xFF;
+				dev->outbuf[length + 1] = crc >> 8;
+				simOutput(dev, dev->outbuf, length + 2);
+			} else {
+				simOutput(dev, &dev->mem[address], MEMSIZE - address);
+			}
+		}
+		break;
+	case SIMWRITESCRATCH: {
+		int offset = (dev->scratchaddr & 0x1F) + dev->paramcount;
+		if(offset >= PAGESIZE) break;
+		dev->scratch[offset] = byte;
+		dev->scratchend = offset;
+		dev->paramcount++;
+		break;
+	}
+	case SIMCOPYSCRATCH:
+		dev->params[dev->paramcount++] = byte;
+		if(dev->paramcount < 3) break;
+		if((dev->params[0] | dev->params[1] << 8) == dev->scratchaddr && dev->params[2] == dev->scratchend) {
+			int offset = dev->scratchaddr & 0x1F;
+			memcpy(&dev->mem[dev->scratchaddr], &dev->scratch[offset], dev->scratchend - offset + 1);
+			dev->scratchend |= 0x80; // AA flag
+		}
+		dev->state = SIMIDLE;
+		break;
+	}
+}
+
+/* One slot that isn't a reset. Returns the level the device holds the line
+ * at when the master samples: LOW to send a 0, HIGH otherwise.
+ */
+uint8_t simSlot(struct simdevice *dev, bool longlow) {
+	uint8_t bit = longlow ? 0 : 1;
+	if(dev->state == SIMOUTPUT) {
+		if(dev->outbit >= dev->outlen * 8) return HIGH;
+		uint8_t b = (dev->out[dev->outbit / 8] >> (dev->outbit % 8)) & 1;
+		dev->outbit++;
+		return b ? HIGH : LOW;
+	}
+	if(dev->state == SIMSEARCHROM) {
+		uint8_t rombit = (dev->rom[dev->searchbit / 8] >> (dev->searchbit % 8)) & 1;
+		switch(dev->searchstep) {
+		case 0:
+			dev->searchstep = 1;
+			return rombit ? HIGH : LOW;
+		case 1:
+			dev->searchstep = 2;
+			return rombit ? LOW : HIGH;
+		default:
+			dev->searchstep = 0;
+			if(bit != rombit) dev->state = SIMIDLE;
+			else if(++dev->searchbit == 64) dev->state = SIMFUNCCMD;
+			return HIGH;
+		}
+	}
+	if(dev->state == SIMIDLE) return HIGH;
+	dev->inbyte |= bit << dev->inbits;
+	if(++dev->inbits == 8) {
+		uint8_t byte = dev->inbyte;
+		dev->inbyte = 0;
+		dev->inbits = 0;
+		simByte(dev, byte);
+	}
+	return HIGH;
+}
+
+/* Waveforms
+ * Instead of working out each bit as it goes, a transaction can be compiled
+ * ahead of time into a list of timed edges (pull low, release, sample) using
+ * the same slot timings as runInterleaved. Playback then has nothing to do
+ * but wait for each edge on the BCM system timer and poke the GPIO, and the
+ * same list can be run against the simulated device to check the timing and
+ * the result without any hardware.
+ */
+#define EDGELOW 0
+#define EDGERELEASE 1
+#define EDGESAMPLE 2
+
+struct waveedge {
+	uint32_t at; // microseconds from the start of the transaction
+	uint8_t action;
+};
+
+/* Longest transaction is a page read: a reset, MATCHROM with the ID, the
+ * command and address out and 32 bytes and the CRC in
+ */
+#define MAXEDGES (3 * (1 + (12 + PAGESIZE + 2) * 8))
+
+/* Compiles a reset, txlen bytes written and rxlen bytes read into edges.
+ * Returns the number of edges or -1 if they don't fit.
+ */
+int compileWaveform(const uint8_t *tx, int txlen, int rxlen, struct waveedge *edges, int maxedges) {
+	struct wiretransaction t;
+	setupTransaction(&t, 0, tx, txlen, NULL, 0);
+	t.rxlen = rxlen;
+	int slots = 1 + (txlen + rxlen) * 8;
+	int count = 0;
+	uint32_t start = 0;
+	for(t.slot = 0; t.slot < slots; t.slot++) {
+		const struct slottiming *timing = slotTiming(&t);
+		if(count + 3 > maxedges) return -1;
+		edges[count].at = start;
+		edges[count++].action = EDGELOW;
+		edges[count].at = start + timing->release;
+		edges[count++].action = EDGERELEASE;
+		if(timing->sample) {
+			edges[count].at = start + timing->sample;
+			edges[count++].action = EDGESAMPLE;
+		}
+		start += timing->end;
+	}
+	return count;
+}
+
+/* Turns the samples from a compiled transaction back into the presence pulse
+ * and the bytes read. Slots that only write aren't sampled, so the read
+ * slots' samples follow straight on from the presence pulse.
+ */
+bool decodeSamples(const uint8_t *samples, uint8_t *rx, int rxlen) {
+	int i;
+	memset(rx, 0, rxlen);
+	for(i = 0; i < rxlen * 8; i++) {
+		rx[i / 8] |= (samples[1 + i] ? 1 : 0) << (i % 8);
+	}
+	return samples[0] == LOW;
+}
+
+/* Plays edges on the pin, timed from the BCM system timer. samples gets the
+ * line level at every sample edge (the first is the presence pulse). Gives up
+ * after the reset if nothing answers.
+ */
+bool playWaveform(uint8_t pin, const struct waveedge *edges, int count, uint8_t *samples) {
+	int i;
+	int sampled = 0;
+	uint64_t start = bcm2835_st_read();
+	for(i = 0; i < count; i++) {
+		uint64_t at = start + edges[i].at;
+		while(bcm2835_st_read() < at) { }
+		switch(edges[i].action) {
+		case EDGELOW:
+			bcm2835_gpio_fsel(pin, BCM2835_GPIO_FSEL_OUTP);
+			bcm2835_gpio_write(pin, LOW);
+			break;
+		case EDGERELEASE:
+			bcm2835_gpio_fsel(pin, BCM2835_GPIO_FSEL_INPT);
+			break;
+		case EDGESAMPLE:
+			samples[sampled] = bcm2835_gpio_lev(pin);
+			if(sampled == 0 && samples[0] == HIGH) return false;
+			sampled++;
+			break;
+		}
+	}
+	return true;
+}
+
+/* readPage from a compiled waveform, used for mission downloads. The
+ * address is part of the waveform, so it's compiled again for every page,
+ * which takes microseconds next to the milliseconds the read itself takes.
+ */
+bool readPageWaveform(uint8_t pin, const uint8_t *rom, uint16_t address, uint8_t *buffer, uint16_t *crc) {
+	if(transport != GPIOTRANSPORT) return readPage(pin, rom, address, buffer, crc);
+	static struct waveedge edges[MAXEDGES];
+	static uint8_t samples[MAXEDGES];
+	uint8_t rx[PAGESIZE + 2];
+	uint8_t tx[] = {MATCHROM, 0, 0, 0, 0, 0, 0, 0, 0, READMEMCRC, (uint8_t)(address & 0xFF), (uint8_t)(address >> 8)};
+	memcpy(&tx[1], rom, 8);
+	int count = compileWaveform(tx, sizeof(tx), PAGESIZE + 2, edges, MAXEDGES);
+	if(!playWaveform(pin, edges, count, samples) || !decodeSamples(samples, rx, PAGESIZE + 2)) return false;
+	memcpy(buffer, rx, PAGESIZE);
+	uint16_t sent = rx[PAGESIZE] | rx[PAGESIZE + 1] << 8;
+	if(crc != NULL) *crc = sent;
+	return readCRC(address, buffer, PAGESIZE) == sent;
+}
+
+/* The edges reset, writeByte and readByte make for the same transaction
+ * when bit banging, laid end to end with no time lost in between. Built
+ * from their delays rather than the slot table, so checkWaveforms can tell
+ * if the two drift apart.
+ */
+int referenceWaveform(const uint8_t *tx, int txlen, int rxlen, struct waveedge *edges, int maxedges) {
+	int count = 0;
+	uint32_t at = 0;
+	int i;
+	if(3 * (1 + (txlen + rxlen) * 8) > maxedges) return -1;
+	edges[count].at = at;
+	edges[count++].action = EDGELOW;
+	edges[count].at = at + RESETLOW;
+	edges[count++].action = EDGERELEASE;
+	edges[count].at = at + RESETLOW + RESETSAMPLE;
+	edges[count++].action = EDGESAMPLE;
+	at += RESETLOW + RESETSAMPLE + RESETREST;
+	for(i = 0; i < txlen * 8; i++) {
+		bool one = (tx[i / 8] >> (i % 8)) & 1;
+		edges[count].at = at;
+		edges[count++].action = EDGELOW;
+		edges[count].at = at + (one ? WRITE1LOW : WRITE0LOW);
+		edges[count++].action = EDGERELEASE;
+		at += one ? WRITE1LOW + WRITE1REST : WRITE0LOW + WRITE0REST;
+	}
+	for(i = 0; i < rxlen * 8; i++) {
+		edges[count].at = at;
+		edges[count++].action = EDGELOW;
+		edges[count].at = at + READLOW;
+		edges[count++].action = EDGERELEASE;
+		edges[count].at = at + READLOW + READSAMPLE;
+		edges[count++].action = EDGESAMPLE;
+		at += READLOW + READSAMPLE + READREST;
+	}
+	return count;
+}
+
+/* Runs edges against a simulated device, filling samples the way
+ * playWaveform would, and checks every slot against the datasheet timing.
+ * Returns the number of timing violations.
+ */
+int simulateWaveform(struct simdevice *dev, const struct waveedge *edges, int count, uint8_t *samples) {
+	int i;
+	int violations = 0;
+	int sampled = 0;
+	uint32_t lowat = 0;
+	uint32_t releaseat = 0;
+	bool reset = false;
+	bool present = false;
+	bool slotstarted = false;
+	uint8_t answer = HIGH;
+	for(i = 0; i < count; i++) {
+		uint32_t at = edges[i].at;
+		switch(edges[i].action) {
+		case EDGELOW:
+			if(slotstarted && !reset && at - lowat < 60) {
+				fprintf(stderr, "Edge %d: slot only %uus long\n", i, at - lowat);
+				violations++;
+			}
+			if(slotstarted && at <= releaseat) {
+				fprintf(stderr, "Edge %d: no recovery time\n", i);
+				violations++;
+			}
+			lowat = at;
+			slotstarted = true;
+			break;
+		case EDGERELEASE: {
+			uint32_t width = at - lowat;
+			releaseat = at;
+			reset = false;
+			answer = HIGH;
+			if(width >= 480) {
+				reset = true;
+				present = simReset(dev);
+			} else if(width >= 1 && width <= 15) {
+				answer = simSlot(dev, false);
+			} else if(width >= 60 && width <= 120) {
+				simSlot(dev, true);
+			} else {
+				fprintf(stderr, "Edge %d: %uus low pulse is neither a 1, a 0 nor a reset\n", i, width);
+				violations++;
+			}
+			break;
+		}
+		case EDGESAMPLE:
+			if(reset) {
+				/* The device waits 15-60us then holds the line low for
+				 * at least 60us, so it's only sure to be low from 60 to 75us.
+				 */
+				uint32_t after = at - releaseat;
+				if(after < 60 || after > 75) {
+					fprintf(stderr, "Edge %d: presence sampled %uus after reset\n", i, after);
+					violations++;
+				}
+				samples[sampled++] = present ? LOW : HIGH;
+			} else {
+				if(at - lowat > 15) {
+					fprintf(stderr, "Edge %d: read sampled %uus into the slot\n", i, at - lowat);
+					violations++;
+				}
+				samples[sampled++] = answer;
+			}
+			break;
+		}
+	}
+	return violations;
+}
+
+/* The temperature from the bytes a READMEMCRC at TEMPADDR got back, or -100
+ * (the same impossible temperature as oneShotConvert) if they don't match
+ * their CRC. A device that didn't answer leaves the line high, and the 0xFF
+ * that reads as would otherwise be 87.5C.
+ */
+float temperatureRead(const uint8_t *rx) {
+	uint16_t crc = rx[TEMPREADLEN - 2] | rx[TEMPREADLEN - 1] << 8;
+	if(readCRC(TEMPADDR, rx, TEMPREADLEN - 2) != crc) return -100;
+	return rx[0] / 2.0 - 40.0;
+}
+
+/* Compiles the transactions used for sampling and downloading, runs them
+ * against a simulated device and checks what comes back. Returns true if
+ * everything checks out.
+ */
+bool checkWaveforms() {
+	uint8_t rom[8] = {0x21, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x00};
+	struct simdevice dev;
+	simInit(&dev, rom, 4.5);
+	dev.mem[DATALOGSTART + 5] = 0x5A;
+	struct waveedge edges[MAXEDGES];
+	uint8_t samples[MAXEDGES];
+	uint8_t rx[PAGESIZE + 2];
+	int violations = 0;
+	bool ok = true;
+
+	uint8_t readrom[] = {READROM};
+	int count = compileWaveform(readrom, 1, 8, edges, MAXEDGES);
+	violations += simulateWaveform(&dev, edges, count, samples);
+	ok = ok && decodeSamples(samples, rx, 8) && memcmp(rx, dev.rom, 8) == 0;
+
+	uint8_t convert[] = {SKIPROM, CONVERTTEMP};
+	count = compileWaveform(convert, 2, 0, edges, MAXEDGES);
+	violations += simulateWaveform(&dev, edges, count, samples);
+
+	uint8_t readtemp[] = {MATCHROM, 0, 0, 0, 0, 0, 0, 0, 0, READMEMCRC, TEMPADDR & 0xFF, TEMPADDR >> 8};
+	memcpy(&readtemp[1], dev.rom, 8);
+	count = compileWaveform(readtemp, sizeof(readtemp), TEMPREADLEN, edges, MAXEDGES);
+	violations += simulateWaveform(&dev, edges, count, samples);
+	ok = ok && decodeSamples(samples, rx, TEMPREADLEN) && temperatureRead(rx) == 4.5;
+
+	readtemp[1] ^= 1; // nobody has that ROM ID
+	count = compileWaveform(readtemp, sizeof(readtemp), TEMPREADLEN, edges, MAXEDGES);
+	violations += simulateWaveform(&dev, edges, count, samples);
+	ok = ok && decodeSamples(samples, rx, TEMPREADLEN) && temperatureRead(rx) == -100;
+
+	uint8_t readpage[] = {MATCHROM, 0, 0, 0, 0, 0, 0, 0, 0, READMEMCRC, DATALOGSTART & 0xFF, DATALOGSTART >> 8};
+	memcpy(&readpage[1], dev.rom, 8);
+	count = compileWaveform(readpage, sizeof(readpage), PAGESIZE + 2, edges, MAXEDGES);
+	violations += simulateWaveform(&dev, edges, count, samples);
+	ok = ok && decodeSamples(samples, rx, PAGESIZE + 2) && memcmp(rx, &dev.mem[DATALOGSTART], PAGESIZE) == 0 && rx[5] == 0x5A;
+	ok = ok && readCRC(DATALOGSTART, rx, PAGESIZE) == (rx[PAGESIZE] | rx[PAGESIZE + 1] << 8);
+
+	/* A whole page read compiled has to come out edge for edge the same as
+	 * bit banging it, and read the same bytes off the simulated device.
+	 */
+	struct waveedge reference[MAXEDGES];
+	uint8_t referencerx[PAGESIZE + 2];
+	int referencecount = referenceWaveform(readpage, sizeof(readpage), PAGESIZE + 2, reference, MAXEDGES);
+	int mismatches = referencecount == count ? 0 : 1;
+	int i;
+	for(i = 0; i < count && i < referencecount; i++) {
+		if(edges[i].at != reference[i].at || edges[i].action != reference[i].action) {
+			if(mismatches == 0) fprintf(stderr, "Edge %d: compiled %u at %uus, bit banging %u at %uus\n", i, edges[i].action, edges[i].at, reference[i].action, reference[i].at);
+			mismatches++;
+		}
+	}
+	violations += simulateWaveform(&dev, reference, referencecount, samples);
+	ok = ok && decodeSamples(samples, referencerx, PAGESIZE + 2) && memcmp(referencerx, rx, PAGESIZE + 2) == 0;
+	fprintf(stderr, "Page read: %d edges over %uus, %d differ from bit banging\n", count, count > 0 ? edges[count - 1].at : 0, mismatches);
+	ok = ok && mismatches == 0;
+
+	fprintf(stderr, "Waveform check: %d timing violations, results %s\n", violations, ok ? "match" : "don't match");
+	return ok && violations == 0;
+}
+
+/* Stands in for a UART wired to a bus with one DS1921L on it, on the master
+ * side of a pseudo-terminal. The UART transport opens the other side as if
+ * it were /dev/serial0. Baud rate changes made on the terminal show up here,
+ * which is how resets are told apart from slots.
+ */
+void uartEmulate(int masterfd) {
+	uint8_t rom[8] = {0x21, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x00};
+	struct simdevice dev;
+	simInit(&dev, rom, 4.0);
+	uint8_t buffer[256];
+	while(true) {
+		ssize_t n = read(masterfd, buffer, sizeof(buffer));
+		if(n <= 0) return;
+		struct termios tio;
+		tcgetattr(masterfd, &tio);
+		bool resetting = cfgetospeed(&tio) == B9600;
+		int i;
+		for(i = 0; i < n; i++) {
+			if(resetting) {
+				if(buffer[i] == 0xF0 && simReset(&dev)) buffer[i] = 0xE0;
+			} else if(buffer[i] == 0xFF) {
+				if(simSlot(&dev, false) == LOW) buffer[i] = 0xF8;
+			} else {
+				simSlot(&dev, true);
+			}
+		}
+		if(write(masterfd, buffer, n) != n) return;
+	}
+}
+
+bool uartsimulated = false; // -U, nothing real on the far end
+
+/* Opens a pseudo-terminal with uartEmulate on the far end and returns the
+ * path of the near end.
+ */
+const char *uartEmulator() {
+	int masterfd = posix_openpt(O_RDWR | O_NOCTTY);
+	if(masterfd < 0 || grantpt(masterfd) != 0 || unlockpt(masterfd) != 0) return NULL;
+	const char *path = ptsname(masterfd);
+	if(path == NULL) return NULL;
+	pid_t pid = fork();
+	if(pid < 0) return NULL;
+	if(pid == 0) {
+		uartEmulate(masterfd);
+		_exit(0);
+	}
+	return path;
+}
+
+/* GPIO character device transport
+ * The bcm2835 library needs root for /dev/mem. The Linux GPIO character
+ * device (libgpiod v2, build with -DGPIOD -lgpiod) doesn't, but every change
+ * to a line is a system call so slot timing is looser. To make up for it the
+ * line is switched to an input with edge detection whenever it's released and
+ * the kernel's timestamps on the edges are used to tell what the device did:
+ * a falling edge after a reset is a presence pulse, and a rising edge after
+ * the line was released in a read slot means the device was holding it low
+ * to send a 0. A mock chip with a simulated DS1921L on it produces the same
+ * edges without any hardware (-G).
+ */
+struct cdevedge {
+	uint64_t ns; // CLOCK_MONOTONIC, same as monotonicMicros
+	bool rising;
+};
+
+#define MAXCDEVEDGES 8
+
+bool cdevmock = false;
+
+uint64_t monotonicNanos() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The mock chip: one simulated device shared by every pin. Releasing the
+ * line works out what the device does from how long the caller meant to
+ * hold it low rather than how long it really was, so the answers don't
+ * depend on how busy the machine is. The edges the device would make are
+ * queued as times after the release and only given real timestamps when
+ * they're read, which is always after the caller has noted when it let go.
+ */
+struct simdevice mockdevice;
+int mocklowus = 0;
+struct cdevedge mockedges[MAXCDEVEDGES]; // ns counts from the release until read
+int mockedgecount = 0;
+
+void mockDriveLow(uint8_t pin, int lowus) {
+	mocklowus = lowus;
+	mockedgecount = 0;
+}
+
+void mockRelease(uint8_t pin) {
+	mockedgecount = 0;
+	if(mocklowus >= 480) {
+		if(simReset(&mockdevice)) {
+			mockedges[0].ns = 30000;
+			mockedges[0].rising = false;
+			mockedges[1].ns = 150000;
+			mockedges[1].rising = true;
+			mockedgecount = 2;
+		}
+	} else if(mocklowus <= 15) {
+		if(simSlot(&mockdevice, false) == LOW) {
+			/* Holding a 0 until 30us into the slot */
+			mockedges[0].ns = (30 - mocklowus) * 1000;
+			mockedges[0].rising = true;
+			mockedgecount = 1;
+		}
+	} else {
+		simSlot(&mockdevice, true);
+	}
+}
+
+int mockReadEdges(uint8_t pin, struct cdevedge *edges, int max, uint64_t timeoutns) {
+	uint64_t start = monotonicNanos();
+	int i;
+	int count = 0;
+	for(i = 0; i < mockedgecount && count < max; i++) {
+		if(mockedges[i].ns > timeoutns) break;
+		edges[count].ns = start + mockedges[i].ns;
+		edges[count].rising = mockedges[i].rising;
+		count++;
+	}
+	while(monotonicNanos() < start + timeoutns) { }
+	mockedgecount = 0;
+	return count;
+}
+
+#ifdef GPIOD
+/* The real chip. Each pin gets its own line request, switched between two
+ * configurations: an open drain output held low, and an input with edge
+ * detection on both edges.
+ */
+struct gpiod_chip *cdevchip = NULL;
+struct gpiod_line_request *cdevrequests[MAXBUSES];
+uint8_t cdevpins[MAXBUSES];
+int cdevcount = 0;
+struct gpiod_line_config *cdevlowconfig[MAXBUSES];
+struct gpiod_line_config *cdevreleaseconfig[MAXBUSES];
+struct gpiod_edge_event_buffer *cdevevents = NULL;
+
+struct gpiod_line_config *cdevConfig(unsigned int offset, bool low) {
+	struct gpiod_line_settings *settings = gpiod_line_settings_new();
+	struct gpiod_line_config *config = gpiod_line_config_new();
+	if(settings == NULL || config == NULL) return NULL;
+	if(low) {
+		gpiod_line_settings_set_direction(settings, GPIOD_LINE_DIRECTION_OUTPUT);
+		gpiod_line_settings_set_drive(settings, GPIOD_LINE_DRIVE_OPEN_DRAIN);
+		gpiod_line_settings_set_output_value(settings, GPIOD_LINE_VALUE_INACTIVE);
+	} else {
+		gpiod_line_settings_set_direction(settings, GPIOD_LINE_DIRECTION_INPUT);
+		gpiod_line_settings_set_edge_detection(settings, GPIOD_LINE_EDGE_BOTH);
+		gpiod_line_settings_set_event_clock(settings, GPIOD_LINE_CLOCK_MONOTONIC);
+	}
+	int ret = gpiod_line_config_add_line_settings(config, &offset, 1, settings);
+	gpiod_line_settings_free(settings);
+	if(ret != 0) {
+		gpiod_line_config_free(config);
+		return NULL;
+	}
+	return config;
+}
+
+bool cdevOpen(const char *path, const uint8_t *pins, int count) {
+	cdevchip = gpiod_chip_open(path);
+	if(cdevchip == NULL) return false;
+	cdevevents = gpiod_edge_event_buffer_new(MAXCDEVEDGES);
+	struct gpiod_request_config *request = gpiod_request_config_new();
+	if(cdevevents == NULL || request == NULL) return false;
+	gpiod_request_config_set_consumer(request, "ibutton");
+	int i;
+	for(i = 0; i < count; i++) {
+		cdevpins[i] = pins[i];
+		cdevlowconfig[i] = cdevConfig(pins[i], true);
+		cdevreleaseconfig[i] = cdevConfig(pins[i], false);
+		if(cdevlowconfig[i] == NULL || cdevreleaseconfig[i] == NULL) return false;
+		cdevrequests[i] = gpiod_chip_request_lines(cdevchip, request, cdevreleaseconfig[i]);
+		if(cdevrequests[i] == NULL) return false;
+	}
+	cdevcount = count;
+	gpiod_request_config_free(request);
+	return true;
+}
+
+/* Which of the requested lines is pin, -1 if it wasn't requested */
+int cdevIndex(uint8_t pin) {
+	int i;
+	for(i = 0; i < cdevcount; i++) {
+		if(cdevpins[i] == pin) return i;
+	}
+	return -1;
+}
+#endif
+
+/* lowus is how long the caller means to hold the line low, for the mock */
+void cdevDriveLow(uint8_t pin, int lowus) {
+	if(cdevmock) {
+		mockDriveLow(pin, lowus);
+		return;
+	}
+#ifdef GPIOD
+	int i = cdevIndex(pin);
+	if(i >= 0) gpiod_line_request_reconfigure_lines(cdevrequests[i], cdevlowconfig[i]);
+#endif
+}
+
+void cdevRelease(uint8_t pin) {
+	if(cdevmock) {
+		mockRelease(pin);
+		return;
+	}
+#ifdef GPIOD
+	int i = cdevIndex(pin);
+	if(i >= 0) gpiod_line_request_reconfigure_lines(cdevrequests[i], cdevreleaseconfig[i]);
+#endif
+}
+
+/* Collects the edges seen on pin in the next timeoutns nanoseconds */
+int cdevReadEdges(uint8_t pin, struct cdevedge *edges, int max, uint64_t timeoutns) {
+	if(cdevmock) return mockReadEdges(pin, edges, max, timeoutns);
+	int count = 0;
+#ifdef GPIOD
+	int index = cdevIndex(pin);
+	if(index < 0) return 0;
+	struct gpiod_line_request *request = cdevrequests[index];
+	uint64_t until = monotonicNanos() + timeoutns;
+	while(count < max) {
+		uint64_t now = monotonicNanos();
+		if(now >= until) break;
+		if(gpiod_line_request_wait_edge_events(request, until - now) <= 0) break;
+		int n = gpiod_line_request_read_edge_events(request, cdevevents, max - count);
+		int i;
+		for(i = 0; i < n; i++) {
+			struct gpiod_edge_event *event = gpiod_edge_event_buffer_get_event(cdevevents, i);
+			edges[count].ns = gpiod_edge_event_get_timestamp_ns(event);
+			edges[count].rising = gpiod_edge_event_get_event_type(event) == GPIOD_EDGE_EVENT_RISING_EDGE;
+			count++;
+		}
+	}
+#endif
+	return count;
+}
+
+/* Throws away the edges already seen on pin */
+void cdevDrainEdges(uint8_t pin) {
+	if(cdevmock) {
+		mockedgecount = 0;
+		return;
+	}
+#ifdef GPIOD
+	int i = cdevIndex(pin);
+	if(i < 0) return;
+	while(gpiod_line_request_wait_edge_events(cdevrequests[i], 0) > 0) {
+		if(gpiod_line_request_read_edge_events(cdevrequests[i], cdevevents, MAXCDEVEDGES) <= 0) break;
+	}
+#endif
+}
+
+void spinUntil(uint64_t ns) {
+	while(monotonicNanos() < ns) { }
+}
+
+/* Returns LOW if a device answered, like reset(). The presence pulse is
+ * timed from its edges and has to be 60-240us long to count.
+ */
+int cdevReset(uint8_t pin) {
+	struct cdevedge edges[MAXCDEVEDGES];
+	cdevDriveLow(pin, 480);
+	uint64_t start = monotonicNanos(); // the line is only sure to be low once the call returns
+	spinUntil(start + 480000);
+	uint64_t released = monotonicNanos();
+	cdevRelease(pin);
+	int count = cdevReadEdges(pin, edges, MAXCDEVEDGES, 300000);
+	bool present = false;
+	int i;
+	for(i = 0; i + 1 < count; i++) {
+		if(edges[i].rising || !edges[i + 1].rising || edges[i].ns < released) continue;
+		uint64_t width = (edges[i + 1].ns - edges[i].ns) / 1000;
+		if(width >= 60 && width <= 240) present = true;
+	}
+	spinUntil(released + 480000);
+	return present ? LOW : HIGH;
+}
+
+void cdevWriteBit(uint8_t pin, int b) {
+	uint64_t start = monotonicNanos();
+	cdevDriveLow(pin, b ? 10 : 65);
+	spinUntil(start + (b ? 10000 : 65000));
+	cdevRelease(pin);
+	spinUntil(start + (b ? 65000 : 70000));
+	cdevDrainEdges(pin); // our own edge, by now certainly queued
+}
+
+/* A rising edge stamped after the line was released can only be the device
+ * letting go of a 0.
+ */
+uint8_t cdevReadBit(uint8_t pin) {
+	struct cdevedge edges[MAXCDEVEDGES];
+	uint64_t start = monotonicNanos();
+	cdevDriveLow(pin, 5);
+	spinUntil(start + 5000);
+	cdevRelease(pin);
+	uint64_t released = monotonicNanos();
+	int count = cdevReadEdges(pin, edges, MAXCDEVEDGES, 60000);
+	uint8_t b = HIGH;
+	int i;
+	for(i = 0; i < count; i++) {
+		if(edges[i].rising && edges[i].ns > released) b = LOW;
+	}
+	spinUntil(start + 68000);
+	return b;
+}
+
+/* Accumulators
+ * Running totals for each device of the time spent inside the -b band,
+ * above and below it, and growing degree-days above the -D base, so
+ * questions like "has this been at 4 degrees for 60 days yet" don't need the
+ * whole history. Every reading counts for the time until the next one, up to
+ * MAXGAPS sample intervals so a gap in the data isn't counted as whatever
+ * came just before it. Readings taken live and readings from downloaded
+ * missions are kept apart so they don't count the same time twice. The
+ * totals are saved to the -A file after every round of samples and read
+ * back at startup, and -Q prints them.
+ */
+#define ACCMAGIC 0x31434341 // "ACC1"
+#define MAXGAPS 3
+
+struct totals {
+	double inband; // seconds
+	double above;
+	double below;
+	double degreedays;
+	int64_t last; // time of the last reading, microseconds since the epoch
+	float lasttemperature;
+	float padding;
+};
+
+struct accumulator {
+	uint8_t rom[8];
+	struct totals live;
+	struct totals mission;
+};
+
+float bandlow = 3.5;
+float bandhigh = 4.5;
+float degreebase = 10.0;
+const char *accumulatorfile = NULL;
+struct accumulator accumulators[MAXBUSES * MAXDEVICES];
+int accumulatorcount = 0;
+bool accumulatorsdirty = false;
+
+struct accumulator *findAccumulator(const uint8_t *rom) {
+	int i;
+	for(i = 0; i < accumulatorcount; i++) {
+		if(memcmp(accumulators[i].rom, rom, 8) == 0) return &accumulators[i];
+	}
+	if(accumulatorcount == MAXBUSES * MAXDEVICES) return NULL;
+	struct accumulator *a = &accumulators[accumulatorcount++];
+	memset(a, 0, sizeof(*a));
+	memcpy(a->rom, rom, 8);
+	return a;
+}
+
+void accumulate(struct totals *t, int64_t time, float temperature, int64_t maxgap) {
+	if(t->last != 0 && time > t->last && time - t->last <= maxgap) {
+		double seconds = (time - t->last) / 1000000.0;
+		if(t->lasttemperature < bandlow) t->below += seconds;
+		else if(t->lasttemperature > bandhigh) t->above += seconds;
+		else t->inband += seconds;
+		if(t->lasttemperature > degreebase) t->degreedays += (t->lasttemperature - degreebase) * seconds / 86400;
+	}
+	if(time > t->last) {
+		t->last = time;
+		t->lasttemperature = temperature;
+	}
+	accumulatorsdirty = true;
+}
+
+void accumulateSample(int device, int64_t time, float temperature) {
+	if(device < 0 || temperature == -100) return;
+	struct accumulator *a = findAccumulator(devices[device].rom);
+	if(a != NULL) accumulate(&a->live, time, temperature, (int64_t)MAXGAPS * sampleinterval * 1000000);
+}
+
+struct missionaccumulation {
+	struct totals *totals;
+	int64_t maxgap;
+	int64_t since; // readings up to here were counted by an earlier download
+};
+
+void accumulateMissionSample(int64_t time, float temperature, void *arg) {
+	struct missionaccumulation *m = (struct missionaccumulation *)arg;
+	if(time > m->since) accumulate(m->totals, time, temperature, m->maxgap);
+}
+
+void accumulateMission(const uint8_t *rom, const uint8_t *image) {
+	struct accumulator *a = findAccumulator(rom);
+	if(a == NULL) return;
+	struct missionaccumulation m;
+	m.totals = &a->mission;
+	m.maxgap = (int64_t)MAXGAPS * image[SAMPLERATE] * 60 * 1000000;
+	m.since = a->mission.last;
+	decodeMission(image, accumulateMissionSample, &m);
+}
+
+bool loadAccumulators() {
+	FILE *f = fopen(accumulatorfile, "rb");
+	if(f == NULL) return false;
+	uint32_t magic = 0;
+	int32_t count = 0;
+	bool ok = fread(&magic, 4, 1, f) == 1 && magic == ACCMAGIC && fread(&count, 4, 1, f) == 1;
+	if(ok && count >= 0 && count <= MAXBUSES * MAXDEVICES) {
+		accumulatorcount = fread(accumulators, sizeof(struct accumulator), count, f);
+	}
+	fclose(f);
+	return ok;
+}
+
+/* Written to a temporary file and renamed, so a power cut can't leave half
+ * a file behind.
+ */
+void saveAccumulators() {
+	if(accumulatorfile == NULL || !accumulatorsdirty) return;
+	char temporary[4096];
+	snprintf(temporary, sizeof(temporary), "%s.tmp", accumulatorfile);
+	FILE *f = fopen(temporary, "wb");
+	if(f == NULL) return;
+	uint32_t magic = ACCMAGIC;
+	int32_t count = accumulatorcount;
+	fwrite(&magic, 4, 1, f);
+	fwrite(&count, 4, 1, f);
+	fwrite(accumulators, sizeof(struct accumulator), accumulatorcount, f);
+	if(fclose(f) == 0) rename(temporary, accumulatorfile);
+	accumulatorsdirty = false;
+}
+
+void printTotals(const char *kind, const struct totals *t) {
+	printf(", %s, %.3f, %.3f, %.3f, %.3f", kind, t->inband / 86400, t->above / 86400, t->below / 86400, t->degreedays);
+}
+
+void printAccumulators() {
+	int i, j;
+	printf("id, source, days in band, days above, days below, degree-days\n");
+	for(i = 0; i < accumulatorcount; i++) {
+		for(j = 0; j < 8; j++) printf("%X", accumulators[i].rom[j]);
+		printTotals("live", &accumulators[i].live);
+		printf("\n");
+		for(j = 0; j < 8; j++) printf("%X", accumulators[i].rom[j]);
+		printTotals("mission", &accumulators[i].mission);
+		printf("\n");
+	}
+}
+
+/* Bus scheduling
+ * Everything that talks to the bus is a job that runs one step at a time,
+ * where a step is a single reset cycle (or a single page for long reads).
+ * Jobs wait in one of two lanes. Samples go in the urgent lane and
+ * maintenance (health probes, register refreshes, RTC checks and mission
+ * downloads) goes in the bulk lane. The urgent lane is always served first,
+ * so a sample that comes due during a download waits at most one page.
+ *
+ * With a sample every five minutes the bus sits idle almost all of the time,
+ * so the bulk lane gets plenty of time between samples.
+ */
+#define MAXJOBS 8
+#define SAMPLEGUARD 50000 // microseconds before a sample that bulk work stops
+#define HOURMICROS (3600ULL * 1000000) // for the hourly and daily bus jobs
+#define RETRYMICROS 100000 // first wait after a failed page read, doubles each time
+#define MAXRETRIES 8 // failed reads of a page in a row before a download gives up
+#define URGENT 0
+#define BULK 1
+#define LANES 2
+
+struct busjob {
+	const char *name;
+	bool (*step)(struct busjob *job); // returns true when the job is done
+	uint8_t pin;
+	uint16_t address; // next address to read for paged jobs
+	uint16_t end;
+	int stage; // next reset cycle for multi-step jobs
+	uint64_t due; // when the job was wanted, for measuring latency
+	uint64_t notbefore; // when a job that's backing off can run again
+	int failures; // failed steps in a row
+	unsigned tick; // point on the sampling grid a sample job is for
+	bool converted[MAXBUSES * MAXDEVICES]; // a sample job's conversions that got started
+};
+
+struct joblane {
+	struct busjob jobs[MAXJOBS];
+	int head;
+	int count;
+};
+
+struct joblane lanes[LANES];
+
+/* Results of the background jobs */
+uint8_t memimage[MEMSIZE]; // mirror of the device memory from the last download
+uint16_t memcrcs[MISSIONPAGES]; // the CRC16 each page of it came with
+uint8_t regcache[PAGESIZE]; // register page, refreshed periodically
+bool regcachevalid = false;
+long rtcdrift = 0; // device RTC minus Pi time in seconds
+int missedprobes = 0;
+const char *missionfile = NULL; // where to save a downloaded mission
+const char *pagestoredir = NULL; // where to keep downloaded pages, see pagestore.h
+struct pagestore pagestore;
+
+/* Sample latency (due time to conversion command) in microseconds, overall
+ * and for samples that came due while bulk work was queued.
+ */
+uint64_t worstlatency = 0;
+uint64_t worstbulklatency = 0;
+
+struct busjob *queueJob(int lane, const char *name, bool (*step)(struct busjob *), uint8_t pin, uint16_t address, uint16_t end) {
+	struct joblane *l = &lanes[lane];
+	if(l->count == MAXJOBS) return NULL;
+	struct busjob *job = &l->jobs[(l->head + l->count) % MAXJOBS];
+	memset(job, 0, sizeof(*job));
+	job->name = name;
+	job->step = step;
+	job->pin = pin;
+	job->address = address;
+	job->end = end;
+	job->due = monotonicMicros();
+	l->count++;
+	return job;
+}
+
+/* Runs a single step of the first job in the highest priority lane that has
+ * one, or only from the urgent lane if urgentonly is set. Returns false if
+ * there was nothing to do.
+ */
+bool runBusStep(bool urgentonly) {
+	int lane;
+	for(lane = 0; lane < (urgentonly ? 1 : LANES); lane++) {
+		struct joblane *l = &lanes[lane];
+		if(l->count == 0) continue;
+		struct busjob *job = &l->jobs[l->head];
+		if(job->notbefore > monotonicMicros()) continue;
+		if(job->step(job)) {
+			l->head = (l->head + 1) % MAXJOBS;
+			l->count--;
+		}
+		return true;
+	}
+	return false;
+}
+
+/* Adds the pages a download reads to the page store, only the ones it
+ * hasn't seen before take any room.
+ */
+void storeMission(const uint8_t *rom) {
+	uint16_t addresses[MAXMANIFESTPAGES];
+	uint16_t crcs[MAXMANIFESTPAGES];
+	int count = 0;
+	uint16_t address;
+	for(address = 0; address < MEMSIZE; address += PAGESIZE) {
+		if(!missionPage(address)) continue;
+		addresses[count] = address;
+		crcs[count++] = memcrcs[address / PAGESIZE];
+	}
+	int added = storeDownload(&pagestore, rom, time(NULL), memimage, addresses, crcs, count);
+	if(added < 0) fprintf(stderr, "Mission download: can't add it to the page store in %s\n", pagestoredir);
+	else fprintf(stderr, "Mission download: %d of %d pages new to the page store\n", added, count);
+}
+
+/* Puts a download back together from the page store as a mission file */
+bool restoreMission(const char *path) {
+	static struct manifest m;
+	if(missionfile == NULL || !manifestRead(path, &m)) {
+		fprintf(stderr, "Can't read %s, or no -m to write it to\n", path);
+		return false;
+	}
+	memset(memimage, 0, MEMSIZE);
+	memset(memcrcs, 0, sizeof(memcrcs));
+	if(!manifestRestore(&pagestore, &m, memimage)) {
+		fprintf(stderr, "The page store is missing pages from %s\n", path);
+		return false;
+	}
+	uint32_t i;
+	for(i = 0; i < m.count; i++) memcrcs[m.entries[i].address / PAGESIZE] = m.entries[i].crc;
+	FILE *f = fopen(missionfile, "wb");
+	if(f == NULL) return false;
+	struct missiontrailer trailer;
+	missionTrailer(m.rom, memcrcs, &trailer);
+	bool ok = fwrite(memimage, 1, MEMSIZE, f) == MEMSIZE && fwrite(&trailer, 1, sizeof(trailer), f) == sizeof(trailer);
+	return fclose(f) == 0 && ok;
+}
+
+/* Prints the pages that differ between two downloads. A page that's in only
+ * one of them (a manifest from a different kind of download) counts as
+ * changed.
+ */
+bool diffManifests(const char *paths) {
+	char first[PATH_MAX];
+	const char *comma = strchr(paths, ',');
+	if(comma == NULL) return restoreMission(paths);
+	if(comma - paths >= PATH_MAX) return false;
+	memcpy(first, paths, comma - paths);
+	first[comma - paths] = 0;
+	static struct manifest a, b;
+	if(!manifestRead(first, &a) || !manifestRead(comma + 1, &b)) {
+		fprintf(stderr, "Can't read %s\n", paths);
+		return false;
+	}
+	if(memcmp(a.rom, b.rom, 8) != 0) fprintf(stderr, "Warning: the downloads are from different devices\n");
+	printf("page, change, bytes\n");
+	int changed = 0;
+	uint32_t i, j;
+	for(i = 0; i < a.count; i++) {
+		for(j = 0; j < b.count && b.entries[j].address != a.entries[i].address; j++);
+		if(j == b.count) {
+			printf("%04X, removed, %d\n", a.entries[i].address, STOREPAGESIZE);
+			changed++;
+			continue;
+		}
+		if(a.entries[i].hash == b.entries[j].hash) continue;
+		/* How much of the page changed, if the store has both */
+		uint8_t pa[STOREPAGESIZE], pb[STOREPAGESIZE];
+		int bytes = STOREPAGESIZE;
+		if(storeGet(&pagestore, a.entries[i].hash, pa) && storeGet(&pagestore, b.entries[j].hash, pb)) {
+			int k;
+			for(k = 0, bytes = 0; k < STOREPAGESIZE; k++) bytes += pa[k] != pb[k];
+		}
+		printf("%04X, changed, %d\n", a.entries[i].address, bytes);
+		changed++;
+	}
+	for(j = 0; j < b.count; j++) {
+		for(i = 0; i < a.count && a.entries[i].address != b.entries[j].address; i++);
+		if(i < a.count) continue;
+		printf("%04X, added, %d\n", b.entries[j].address, STOREPAGESIZE);
+		changed++;
+	}
+	fprintf(stderr, "%d of %u pages changed\n", changed, b.count);
+	return true;
+}
+
+/* Where a device's download goes: the -m path itself when it's the only
+ * device on its bus, or the path with the ROM ID on the end when there are
+ * more.
+ */
+void missionPath(int device, char *path, size_t size) {
+	uint8_t pin = devices[device].pin;
+	if(nextDevice(pin, nextDevice(pin, 0) + 1) < 0) {
+		snprintf(path, size, "%s", missionfile);
+		return;
+	}
+	char hex[17];
+	romToHex(devices[device].rom, hex);
+	snprintf(path, size, "%s.%s", missionfile, hex);
+}
+
+/* Downloads every device on the bus in turn, each picked out by MATCHROM so
+ * the others stay quiet. job->stage is the device being downloaded. Steps
+ * through its register, alarm, histogram and datalog areas a page at a time
+ * and saves the whole memory image once the last page is in. Pages are read
+ * with the device's CRC, which goes in the file. A page that won't read or
+ * doesn't match its CRC is tried again after a wait that doubles each time,
+ * and after MAXRETRIES goes that device is given up on rather than holding
+ * the bulk lane forever.
+ */
+bool missionDownloadStep(struct busjob *job) {
+	int d = nextDevice(job->pin, job->stage);
+	if(d < 0) {
+		if(job->stage == 0) fprintf(stderr, "Mission download: no devices to download\n");
+		return true;
+	}
+	struct device *device = &devices[d];
+	if(job->stage != d || job->address == REGISTERSTART) {
+		job->stage = d;
+		job->address = REGISTERSTART;
+		memset(memimage, 0, MEMSIZE);
+		memset(memcrcs, 0, sizeof(memcrcs));
+	}
+	char hex[17];
+	romToHex(device->rom, hex);
+	if(!readPageWaveform(job->pin, device->rom, job->address, &memimage[job->address], &memcrcs[job->address / PAGESIZE])) {
+		if(++job->failures < MAXRETRIES) {
+			uint64_t wait = (uint64_t)RETRYMICROS << (job->failures - 1);
+			fprintf(stderr, "Mission download: %s page %04X didn't read or failed its CRC, retrying in %llums\n", hex, job->address, (unsigned long long)(wait / 1000));
+			job->notbefore = monotonicMicros() + wait;
+			return false;
+		}
+		fprintf(stderr, "Mission download: %s page %04X didn't read or failed its CRC, giving up on it\n", hex, job->address);
+	} else {
+		job->failures = 0;
+		job->address += PAGESIZE;
+		if(job->address == RESERVED1) job->address = HISTSTART;
+		if(job->address == RESERVED2) job->address = DATALOGSTART;
+		if(job->address < job->end) return false;
+		if(missionfile != NULL) {
+			char path[PATH_MAX];
+			missionPath(d, path, sizeof(path));
+			FILE *f = fopen(path, "wb");
+			if(f != NULL) {
+				struct missiontrailer trailer;
+				missionTrailer(device->rom, memcrcs, &trailer);
+				fwrite(memimage, 1, MEMSIZE, f);
+				fwrite(&trailer, 1, sizeof(trailer), f);
+				fclose(f);
+			} else fprintf(stderr, "Mission download: can't open %s\n", path);
+		}
+		if(pagestoredir != NULL) storeMission(device->rom);
+		accumulateMission(device->rom, memimage);
+		fprintf(stderr, "Mission download of %s complete, worst sample latency %lluus during download (%lluus overall)\n",
+			hex, (unsigned long long)worstbulklatency, (unsigned long long)worstlatency);
+	}
+	/* On to the next device */
+	job->failures = 0;
+	job->stage = d + 1;
+	job->address = REGISTERSTART;
+	return nextDevice(job->pin, job->stage) < 0;
+}
+
+bool healthProbeStep(struct busjob *job) {
+	if(reset(job->pin) == HIGH) {
+		missedprobes++;
+		fprintf(stderr, "Health probe: no presence pulse (%d missed)\n", missedprobes);
+	} else {
+		missedprobes = 0;
+	}
+	return true;
+}
+
+/* Looks for devices that have been added to any of the buses */
+bool discoverStep(struct busjob *job) {
+	discoverDevices(buspins[job->stage]);
+	return ++job->stage == buscount;
+}
+
+bool registerRefreshStep(struct busjob *job) {
+	regcachevalid = readPage(job->pin, firstROM(job->pin), REGISTERSTART, regcache, NULL);
+	return true;
+}
+
+/* Reads the RTC registers and compares them to the Pi's clock. */
+bool rtcDriftStep(struct busjob *job) {
+	uint8_t page[PAGESIZE];
+	if(!readPage(job->pin, firstROM(job->pin), RTCSECONDS, page, NULL)) return true;
+	time_t currtime;
+	time(&currtime);
+	struct tm devtime;
+	memset(&devtime, 0, sizeof(devtime));
+	devtime.tm_sec = fromBCD(page[0] & 0x7F);
+	devtime.tm_min = fromBCD(page[1] & 0x7F);
+	devtime.tm_hour = fromBCD(page[2] & 0x3F);
+	devtime.tm_mday = fromBCD(page[4] & 0x3F);
+	devtime.tm_mon = fromBCD(page[5] & 0x1F) - 1;
+	devtime.tm_year = fromBCD(page[6]) + 100;
+	devtime.tm_isdst = -1;
+	rtcdrift = (long)(mktime(&devtime) - currtime);
+	if(rtcdrift > 2 || rtcdrift < -2) fprintf(stderr, "RTC drift: %lds\n", rtcdrift);
+	return true;
+}
+
+/* Microseconds since the epoch */
+int64_t realtimeMicros() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* One temperature reading. Every reading from the same round of conversions
+ * has the same time, the moment the conversions were started.
+ */
+struct sample {
+	int device; // index into devices
+	int64_t time; // microseconds since the epoch
+	float temperature; // -100 if it couldn't be read
+};
+
+/* Prints a line of CSV, for the csv sink further down */
+void printSample(const struct sample *s) {
+	time_t seconds = s->time / 1000000;
+	char* str1 = ctime(&seconds);
+	str1[strcspn(str1,"\n")] = 0;
+	printf("%20s, ", str1);
+	int i;
+	for(i = 0; i < 8; i++) printf("%X", s->device < 0 ? 0 : devices[s->device].rom[i]);
+	printf(", %.1f\n", s->temperature);
+}
+
+/* Adaptive sampling
+ * A fixed interval misses most of a door being opened and wastes
+ * conversions (and the logger's battery) when nothing is happening. With -a
+ * each device samples at sampleinterval, sampleinterval / 2, / 4 and so on
+ * down to the -a minimum, one level faster whenever its last few readings
+ * are moving or noisy and one level slower whenever they're steady. The
+ * intervals all divide sampleinterval so every device's samples land on the
+ * same grid and devices that are due together are still converted together.
+ */
+#define ADAPTHISTORY 4
+#define ADAPTSLOPE 0.1 // degrees per minute
+#define ADAPTVARIANCE 0.25 // degrees squared
+
+struct adaptive {
+	int level; // samples every sampleinterval >> level
+	float temperature[ADAPTHISTORY];
+	int64_t time[ADAPTHISTORY];
+	int count;
+};
+
+int adaptmin = 0; // shortest interval in seconds, 0 for no adapting
+int maxlevel = 0;
+struct adaptive adapt[MAXBUSES * MAXDEVICES];
+
+/* Is the device due on the tick'th point of the sampling grid? */
+bool deviceDue(int device, unsigned tick) {
+	return tick % (1u << (maxlevel - adapt[device].level)) == 0;
+}
+
+void updateAdaptive(const struct sample *s) {
+	if(s->device < 0 || s->temperature == -100 || maxlevel == 0) return;
+	struct adaptive *a = &adapt[s->device];
+	a->temperature[a->count % ADAPTHISTORY] = s->temperature;
+	a->time[a->count % ADAPTHISTORY] = s->time;
+	a->count++;
+	if(a->count < 2) return;
+	int n = a->count < ADAPTHISTORY ? a->count : ADAPTHISTORY;
+	int last = (a->count - 1) % ADAPTHISTORY;
+	int previous = (a->count - 2) % ADAPTHISTORY;
+	float minutes = (a->time[last] - a->time[previous]) / 60000000.0;
+	float slope = minutes > 0 ? (a->temperature[last] - a->temperature[previous]) / minutes : 0;
+	float mean = 0, variance = 0;
+	int i;
+	for(i = 0; i < n; i++) mean += a->temperature[i];
+	mean /= n;
+	for(i = 0; i < n; i++) variance += (a->temperature[i] - mean) * (a->temperature[i] - mean);
+	variance /= n;
+	if(slope > ADAPTSLOPE || slope < -ADAPTSLOPE || variance > ADAPTVARIANCE) {
+		if(a->level < maxlevel) a->level++;
+	} else if(a->level > 0) {
+		a->level--;
+	}
+}
+
+/* Anomaly detection
+ * Every reading goes through a few cheap checks as it comes in, so a
+ * compressor dying or a logger falling off its shelf shows up within a
+ * sample rather than whenever someone next looks at the CSV. Each device
+ * keeps an exponentially weighted mean and variance of its readings and
+ * raises an event when:
+ * - a reading is more than ANOMALYZ standard deviations from the mean
+ * - it jumps by STEPCHANGE degrees or more from the last reading
+ * - it hasn't changed at all for STUCKSECONDS (a stuck sensor)
+ * - it can't be read FAILEDSAMPLES times in a row
+ * Events go to stderr as a line of CSV.
+ */
+#define EWMAALPHA 0.1
+#define ANOMALYZ 4.0
+/* The variance never counts as less than that of the DS1921L's 0.5 °C
+ * steps, otherwise it decays to nothing while readings are steady and the
+ * first step either way looks like an outlier.
+ */
+#define MINVARIANCE (0.5 * 0.5 / 12)
+#define WARMUPSAMPLES 10
+#define STEPCHANGE 2.0
+#define STUCKSECONDS (6 * 3600)
+#define FAILEDSAMPLES 3
+
+#define EVENTOUTLIER 0
+#define EVENTSTEP 1
+#define EVENTSTUCK 2
+#define EVENTFAILED 3
+
+const char *eventnames[] = {"outlier", "step", "stuck", "failed"};
+
+struct event {
+	int device;
+	int64_t time; // microseconds since the epoch, from the sample
+	int type;
+	float value; // the reading, or the size of the step
+};
+
+struct detector {
+	int count;
+	float mean;
+	float variance;
+	float last;
+	int64_t changed; // when the reading last changed
+	bool stuck;
+	int failed;
+};
+
+struct detector detectors[MAXBUSES * MAXDEVICES];
+
+/* Subscribers on the -l socket, further down */
+#define FRAMESAMPLE 0
+#define FRAMEEVENT 1
+#define FRAMEDROPPED 2
+void publish(int type, int device, int64_t time, float value, int event);
+
+void recordEvent(const struct event *e) {
+	int i;
+	fprintf(stderr, "event, %lld, ", (long long)e->time);
+	for(i = 0; i < 8; i++) fprintf(stderr, "%X", devices[e->device].rom[i]);
+	fprintf(stderr, ", %s, %.1f\n", eventnames[e->type], e->value);
+	publish(FRAMEEVENT, e->device, e->time, e->value, e->type);
+}
+
+void raiseEvent(const struct sample *s, int type, float value) {
+	struct event e;
+	e.device = s->device;
+	e.time = s->time;
+	e.type = type;
+	e.value = value;
+	recordEvent(&e);
+}
+
+void detectAnomalies(const struct sample *s) {
+	if(s->device < 0) return;
+	struct detector *d = &detectors[s->device];
+	if(s->temperature == -100) {
+		if(++d->failed == FAILEDSAMPLES) raiseEvent(s, EVENTFAILED, s->temperature);
+		return;
+	}
+	d->failed = 0;
+	float x = s->temperature;
+	if(d->count == 0) {
+		d->mean = x;
+		d->variance = 0;
+		d->last = x;
+		d->changed = s->time;
+		d->count = 1;
+		return;
+	}
+	float diff = x - d->mean;
+	float variance = d->variance > MINVARIANCE ? d->variance : MINVARIANCE;
+	if(d->count >= WARMUPSAMPLES && diff * diff > ANOMALYZ * ANOMALYZ * variance) {
+		raiseEvent(s, EVENTOUTLIER, x);
+	}
+	if(x - d->last >= STEPCHANGE || d->last - x >= STEPCHANGE) raiseEvent(s, EVENTSTEP, x - d->last);
+	if(x != d->last) {
+		d->changed = s->time;
+		d->stuck = false;
+	} else if(!d->stuck && s->time - d->changed >= (int64_t)STUCKSECONDS * 1000000) {
+		d->stuck = true;
+		raiseEvent(s, EVENTSTUCK, x);
+	}
+	float increment = EWMAALPHA * diff;
+	d->mean += increment;
+	d->variance = (1 - EWMAALPHA) * (d->variance + diff * increment);
+	d->last = x;
+	d->count++;
+}
+
+/* Thermostat
+ * With -t the readings from one device (the first found, or -T id) also
+ * drive a relay on another GPIO (-r) to switch a fridge's compressor. The
+ * default is plain hysteresis around the setpoint. With -P a PID loop works
+ * out what fraction of each CONTROLWINDOW the compressor should run for
+ * instead, which holds the temperature closer once it's tuned. Either way the
+ * compressor is never switched on for less than MINONSECONDS or back on
+ * sooner than MINOFFSECONDS after it stopped, and if the readings stop
+ * coming for STALESECONDS the relay is switched off and left off until they
+ * come back. The time from the conversion to the relay switching is
+ * reported every time it switches.
+ */
+#define HYSTERESIS 1.0 // degrees, the whole band
+#define MINONSECONDS 180
+#define MINOFFSECONDS 300
+#define STALESECONDS 900
+#define CONTROLWINDOW 600 // seconds
+#define PIDKP 0.5 // duty per degree
+#define PIDKI 0.0005 // duty per degree second
+#define PIDKD 0.0
+
+bool controlling = false;
+bool pidcontrol = false;
+float setpoint = 4.0;
+uint8_t relaypin = RPI_GPIO_P1_18;
+bool relaygpio = false; // driven through bcm2835
+int controldevice = -1;
+const char *controlid = NULL; // hex ROM ID from -T
+bool relayon = false;
+uint64_t relaychanged = 0; // monotonic
+int64_t lastreading = 0; // realtime of the last good reading
+uint64_t lastreadingmono = 0;
+float lasttemperature = 0;
+float pidintegral = 0;
+float piderror = 0;
+float duty = 0;
+uint64_t windowstart = 0;
+uint64_t controlstart = 0;
+bool stale = false;
+int64_t worstcontrollatency = 0;
+
+#ifdef GPIOD
+struct gpiod_line_request *relayrequest = NULL;
+#endif
+
+bool relayOpen() {
+	controlstart = monotonicMicros();
+	if(transport == GPIOTRANSPORT || (transport == UARTTRANSPORT && !uartsimulated)) {
+		/* A real UART doesn't need the GPIO for the bus, but the relay
+		 * is still on one.
+		 */
+		if(transport == UARTTRANSPORT && !bcm2835_init()) return false;
+		bcm2835_gpio_fsel(relaypin, BCM2835_GPIO_FSEL_OUTP);
+		bcm2835_gpio_write(relaypin, LOW);
+		relaygpio = true;
+	}
+#ifdef GPIOD
+	if(transport == CDEVTRANSPORT && !cdevmock) {
+		unsigned int offset = relaypin;
+		struct gpiod_line_settings *settings = gpiod_line_settings_new();
+		struct gpiod_line_config *config = gpiod_line_config_new();
+		struct gpiod_request_config *request = gpiod_request_config_new();
+		if(settings == NULL || config == NULL || request == NULL) return false;
+		gpiod_line_settings_set_direction(settings, GPIOD_LINE_DIRECTION_OUTPUT);
+		gpiod_line_settings_set_output_value(settings, GPIOD_LINE_VALUE_INACTIVE);
+		gpiod_line_config_add_line_settings(config, &offset, 1, settings);
+		gpiod_request_config_set_consumer(request, "ibutton relay");
+		relayrequest = gpiod_chip_request_lines(cdevchip, request, config);
+		gpiod_line_settings_free(settings);
+		gpiod_line_config_free(config);
+		gpiod_request_config_free(request);
+		if(relayrequest == NULL) return false;
+	}
+#endif
+	return true;
+}
+
+/* Switches the relay if the compressor timers allow it. trigger is when the
+ * conversion behind the decision was started, 0 if there wasn't one.
+ */
+void setRelay(bool on, int64_t trigger) {
+	if(on == relayon) return;
+	uint64_t now = monotonicMicros();
+	uint64_t since = now - relaychanged;
+	if(relaychanged != 0 && !stale) {
+		if(relayon && since < (uint64_t)MINONSECONDS * 1000000) return;
+		if(!relayon && since < (uint64_t)MINOFFSECONDS * 1000000) return;
+	}
+	if(relaygpio) bcm2835_gpio_write(relaypin, on ? HIGH : LOW);
+#ifdef GPIOD
+	if(relayrequest != NULL) gpiod_line_request_set_value(relayrequest, relaypin, on ? GPIOD_LINE_VALUE_ACTIVE : GPIOD_LINE_VALUE_INACTIVE);
+#endif
+	relayon = on;
+	relaychanged = now;
+	int64_t actuated = realtimeMicros();
+	fprintf(stderr, "relay, %lld, %s", (long long)actuated, on ? "on" : "off");
+	if(trigger != 0) {
+		int64_t latency = actuated - trigger;
+		if(latency > worstcontrollatency) worstcontrollatency = latency;
+		fprintf(stderr, ", %lldus from conversion (worst %lldus)", (long long)latency, (long long)worstcontrollatency);
+	}
+	fprintf(stderr, "\n");
+}
+
+/* Picks the control device once devices have been found */
+bool findControlDevice() {
+	int i, j;
+	if(controldevice >= 0) return true;
+	for(i = 0; i < devicecount; i++) {
+		if(controlid == NULL) break;
+		char id[17];
+		for(j = 0; j < 8; j++) sprintf(&id[j * 2], "%02X", devices[i].rom[j]);
+		if(strcasecmp(id, controlid) == 0) break;
+	}
+	if(i == devicecount) return false;
+	controldevice = i;
+	return true;
+}
+
+/* Runs the controller on a new reading from the control device */
+void controlSample(const struct sample *s) {
+	if(!controlling || !findControlDevice() || s->device != controldevice) return;
+	if(s->temperature == -100) return;
+	uint64_t now = monotonicMicros();
+	float error = s->temperature - setpoint; // positive means too warm
+	if(lastreadingmono != 0 && pidcontrol) {
+		float dt = (now - lastreadingmono) / 1000000.0;
+		pidintegral += error * dt;
+		if(pidintegral * PIDKI > 1) pidintegral = 1 / PIDKI;
+		if(pidintegral * PIDKI < 0) pidintegral = 0;
+		float derivative = dt > 0 ? (error - piderror) / dt : 0;
+		duty = PIDKP * error + PIDKI * pidintegral + PIDKD * derivative;
+		if(duty < 0) duty = 0;
+		if(duty > 1) duty = 1;
+	}
+	piderror = error;
+	lastreading = s->time;
+	lastreadingmono = now;
+	lasttemperature = s->temperature;
+	stale = false;
+	if(!pidcontrol) {
+		if(error > HYSTERESIS / 2) setRelay(true, s->time);
+		else if(error < -HYSTERESIS / 2) setRelay(false, s->time);
+	} else {
+		if(windowstart == 0) windowstart = now;
+		bool on = now - windowstart < duty * CONTROLWINDOW * 1000000;
+		setRelay(on, s->time);
+	}
+}
+
+/* Called from the main loop between samples, for the PID duty cycle, the
+ * compressor timers and the fail safe.
+ */
+void controlTick() {
+	if(!controlling) return;
+	uint64_t now = monotonicMicros();
+	uint64_t heard = lastreadingmono != 0 ? lastreadingmono : controlstart;
+	if(!stale && now - heard > (uint64_t)STALESECONDS * 1000000) {
+		stale = true;
+		fprintf(stderr, "relay: no readings for %ds, switching off\n", STALESECONDS);
+		setRelay(false, 0);
+		return;
+	}
+	if(stale) return;
+	if(pidcontrol && windowstart != 0) {
+		while(now - windowstart >= (uint64_t)CONTROLWINDOW * 1000000) windowstart += (uint64_t)CONTROLWINDOW * 1000000;
+		setRelay(now - windowstart < duty * CONTROLWINDOW * 1000000, 0);
+	} else if(!pidcontrol && relayon != (piderror > 0) && (piderror > HYSTERESIS / 2 || piderror < -HYSTERESIS / 2)) {
+		setRelay(piderror > 0, 0); // held back by a compressor timer last time
+	}
+}
+
+/* Readings are also kept in an archive (-o), see archive.h */
+struct archive samplearchive;
+bool archiving = false;
+struct retention retention = defaultretention;
+pthread_mutex_t archivelock = PTHREAD_MUTEX_INITIALIZER; // between the archive sink and compaction
+bool compactwanted = false;
+pthread_mutex_t compactlock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t compactready = PTHREAD_COND_INITIALIZER;
+pthread_t compactthread;
+
+/* Compressed live log (-z), one file per device, see samplelog.h */
+const char *livelogdir = NULL;
+struct samplelog livelogs[MAXBUSES * MAXDEVICES];
+bool livelogopen[MAXBUSES * MAXDEVICES];
+
+void livelogPath(const uint8_t *rom, char *path, size_t size) {
+	char hex[17];
+	romToHex(rom, hex);
+	snprintf(path, size, "%s/%s.gor", livelogdir, hex);
+}
+
+void logSample(int device, int64_t time, float temperature) {
+	if(livelogdir == NULL || device < 0 || temperature == -100) return;
+	if(!livelogopen[device]) {
+		char path[PATH_MAX];
+		livelogPath(devices[device].rom, path, sizeof(path));
+		if(!logOpen(&livelogs[device], path)) return;
+		livelogopen[device] = true;
+	}
+	logAppend(&livelogs[device], time, temperature);
+}
+
+/* Prints readings from a device's live log between two times (seconds
+ * since the epoch) as CSV.
+ */
+bool printLivelog(const char *query) {
+	char id[17];
+	long long from, to;
+	uint8_t rom[8];
+	if(sscanf(query, "%16[0-9A-Fa-f],%lld,%lld", id, &from, &to) != 3 || !hexToROM(id, rom)) return false;
+	char path[PATH_MAX];
+	livelogPath(rom, path, sizeof(path));
+	struct samplelog log;
+	if(!logOpen(&log, path)) return false;
+	int64_t times[LOGBLOCKSAMPLES];
+	float temperatures[LOGBLOCKSAMPLES];
+	int64_t start = from * 1000000;
+	printf("time, temperature\n");
+	while(true) {
+		int count = logRead(&log, start, to * 1000000, times, temperatures, LOGBLOCKSAMPLES);
+		int i;
+		for(i = 0; i < count; i++) printf("%.3f, %.1f\n", times[i] / 1000000.0, temperatures[i]);
+		if(count < LOGBLOCKSAMPLES) break;
+		start = times[count - 1] + 1;
+	}
+	logClose(&log);
+	return true;
+}
+
+/* Trims the archive to the -k retention on a thread of its own, so a slow
+ * SD card holds up the archive sink at most, never sampling. The lock is
+ * only held for a chunk at a time so readings keep going in meanwhile.
+ */
+void *compactMain(void *arg) {
+	while(true) {
+		pthread_mutex_lock(&compactlock);
+		while(!compactwanted) pthread_cond_wait(&compactready, &compactlock);
+		compactwanted = false;
+		pthread_mutex_unlock(&compactlock);
+		struct compaction c;
+		compactionStart(&c);
+		bool done = false;
+		while(!done) {
+			pthread_mutex_lock(&archivelock);
+			done = archiveCompactStep(&samplearchive, &c, &retention, realtimeMicros());
+			pthread_mutex_unlock(&archivelock);
+		}
+		if(c.failed > 0) fprintf(stderr, "Archive: %d files couldn't be compacted\n", c.failed);
+	}
+	return NULL;
+}
+
+bool startCompaction() {
+	return pthread_create(&compactthread, NULL, compactMain, NULL) == 0;
+}
+
+/* Has the archive trimmed, unless it's being done already */
+void requestCompaction() {
+	pthread_mutex_lock(&compactlock);
+	compactwanted = true;
+	pthread_cond_signal(&compactready);
+	pthread_mutex_unlock(&compactlock);
+}
+
+/* -k raw,minutes,hours,days in days, 0 to keep forever */
+bool parseRetention(const char *arg) {
+	int days[4];
+	if(sscanf(arg, "%d,%d,%d,%d", &days[0], &days[1], &days[2], &days[3]) != 4) return false;
+	retention.raw = days[0] * 86400LL * 1000000;
+	int l;
+	for(l = 0; l < ARCHIVELEVELS; l++) retention.levels[l] = days[l + 1] * 86400LL * 1000000;
+	return true;
+}
+
+/* Prints what the archive has for a device between two times (seconds since
+ * the epoch) at about the given number of points, as CSV.
+ */
+bool printArchive(const char *query) {
+	char id[17];
+	long long from, to;
+	int pixels;
+	uint8_t rom[8];
+	if(sscanf(query, "%16[0-9A-Fa-f],%lld,%lld,%d", id, &from, &to, &pixels) != 4 || !hexToROM(id, rom)) return false;
+	struct rollup *points = (struct rollup *)malloc(sizeof(struct rollup) * (pixels * 2 + 2));
+	if(points == NULL) return false;
+	int count = archiveQuery(&samplearchive, rom, from * 1000000, to * 1000000, pixels, points, pixels * 2 + 2);
+	int i;
+	printf("time, min, max, mean, count\n");
+	for(i = 0; i < count; i++) {
+		printf("%lld, %.1f, %.1f, %.2f, %u\n", (long long)(points[i].start / 1000000), points[i].min, points[i].max, points[i].sum / points[i].count, points[i].count);
+	}
+	free(points);
+	return true;
+}
+
+/* Sinks
+ * Every reading is handed to each of the enabled sinks: the CSV on stdout,
+ * the archive (-o), the compressed log (-z), the spool for the collector
+ * (-F), an SQLite database (-d) and InfluxDB (-I). Each sink has its own
+ * thread and its own queue of SINKQUEUE readings, so a slow one (an archive
+ * on a struggling SD card, stdout piped somewhere that stopped reading) can
+ * fall behind without holding anything up until its queue is full. What
+ * happens then is up to its policy, set with -S name:policy:
+ * block      sampling waits up to SINKWAIT for the sink to make room, holding
+ *            up every other sink too, then drops the oldest reading like drop
+ * drop       the oldest queued reading is thrown away. The default for
+ *            stdout and InfluxDB (which has its own spool, and never fills
+ *            its queue unless the machine can't keep up)
+ * aggregate  the reading is averaged into the last one queued for the same
+ *            device, so the sink gets fewer readings covering the same time.
+ *            The default for the sinks that keep readings: the archive, the
+ *            log, the spool and SQLite
+ * None of them ever hold sampling up for longer than SINKWAIT. Subscribers
+ * on the -l socket already have their own queues and never hold anything
+ * up, so they aren't a sink.
+ */
+#define SINKQUEUE 256
+#define SINKWAIT 500 // milliseconds a block sink can hold sampling up for
+
+#define SINKBLOCK 0
+#define SINKDROP 1
+#define SINKAGGREGATE 2
+
+const char *policynames[] = {"block", "drop", "aggregate"};
+
+struct sink {
+	const char *name;
+	void (*write)(const struct sample *s);
+	bool (*flush)(); // when the queue has emptied, can be NULL. Returns false if it should be called again in a while
+	bool enabled;
+	int policy;
+	struct sample queue[SINKQUEUE];
+	int counts[SINKQUEUE]; // readings averaged into each
+	int start;
+	int count;
+	uint32_t dropped;
+	uint32_t aggregated;
+	pthread_mutex_t lock;
+	pthread_cond_t ready; // there's something queued
+	pthread_cond_t room; // there's space in the queue
+	pthread_t thread;
+};
+
+void archiveSample(const struct sample *s) {
+	if(s->device < 0 || s->temperature == -100) return;
+	pthread_mutex_lock(&archivelock);
+	int result = archiveAppend(&samplearchive, devices[s->device].rom, s->time, s->temperature);
+	pthread_mutex_unlock(&archivelock);
+	if(result == ARCHIVEFAILED) fprintf(stderr, "Can't write to the archive in %s\n", samplearchive.dir);
+}
+
+void livelogSample(const struct sample *s) {
+	logSample(s->device, s->time, s->temperature);
+}
+
+bool flushStdout() {
+	fflush(stdout);
+	return true;
+}
+
+/* Store and forward (-F), see forward.h. The sink only writes to the spool
+ * on the local disk. A thread of its own sends it on to the collector, so
+ * the network being slow or gone holds up nothing.
+ */
+const char *forwardto = NULL;
+char forwardhost[256];
+char forwardport[16];
+const char *spooldir = "ibutton-spool";
+char edgename[MAXEDGENAME];
+struct spool samplespool;
+pthread_t forwardthread;
+
+void spoolSample(const struct sample *s) {
+	if(s->device < 0 || s->temperature == -100) return;
+	struct forwardrecord r;
+	memset(&r, 0, sizeof(r));
+	r.time = s->time;
+	memcpy(r.rom, devices[s->device].rom, 8);
+	r.temperature = s->temperature;
+	if(!spoolAppend(&samplespool, &r)) fprintf(stderr, "forward: can't write to the spool in %s\n", spooldir);
+}
+
+bool syncSpool() {
+	spoolSync(&samplespool);
+	return true;
+}
+
+/* SQLite (-d), see database.h. Readings are committed in batches every
+ * -w milliseconds, so flushing only commits once the batch is old enough.
+ */
+const char *databasepath = NULL;
+int commitinterval = 1000;
+struct database sampledb;
+
+void databaseSample(const struct sample *s) {
+	if(s->device < 0 || s->temperature == -100) return;
+	databaseInsert(&sampledb, devices[s->device].rom, s->time, s->temperature);
+	databaseCommit(&sampledb, false);
+}
+
+bool commitDatabase() {
+	return databaseCommit(&sampledb, false);
+}
+
+/* InfluxDB (-I), see influx.h. Like forwarding, the sink only adds lines to
+ * a spool and a thread of its own sends them. The start of each device's
+ * lines is made the first time it's needed.
+ */
+const char *influxto = NULL;
+struct influx sampleinflux;
+char influxprefixes[MAXBUSES * MAXDEVICES][INFLUXPREFIX];
+int influxprefixlengths[MAXBUSES * MAXDEVICES];
+
+void influxSample(const struct sample *s) {
+	if(s->device < 0 || s->temperature == -100) return;
+	if(influxprefixlengths[s->device] == 0) {
+		influxprefixlengths[s->device] = influxPrefix(influxprefixes[s->device], devices[s->device].rom, edgename);
+	}
+	influxAdd(&sampleinflux, influxprefixes[s->device], influxprefixlengths[s->device], s->time, s->temperature);
+}
+
+bool startInflux() {
+	if(edgename[0] == 0 && gethostname(edgename, sizeof(edgename) - 1) != 0) strcpy(edgename, "ibutton");
+	return influxStart(&sampleinflux);
+}
+
+void *forwardMain(void *arg) {
+	forwardRun(&samplespool, forwardhost, forwardport, edgename);
+	return NULL;
+}
+
+/* -F host:port */
+bool parseForward(const char *arg) {
+	const char *colon = strrchr(arg, ':');
+	if(colon == NULL || colon == arg || colon - arg >= (int)sizeof(forwardhost) || strlen(colon + 1) >= sizeof(forwardport)) return false;
+	memcpy(forwardhost, arg, colon - arg);
+	forwardhost[colon - arg] = 0;
+	strcpy(forwardport, colon + 1);
+	forwardto = arg;
+	return true;
+}
+
+bool startForwarding() {
+	if(edgename[0] == 0 && gethostname(edgename, sizeof(edgename) - 1) != 0) strcpy(edgename, "ibutton");
+	if(!spoolOpen(&samplespool, spooldir)) return false;
+	return pthread_create(&forwardthread, NULL, forwardMain, NULL) == 0;
+}
+
+struct sink sinks[] = {
+	{"csv", printSample, flushStdout, false, SINKDROP},
+	{"archive", archiveSample, NULL, false, SINKAGGREGATE},
+	{"log", livelogSample, NULL, false, SINKAGGREGATE},
+	{"forward", spoolSample, syncSpool, false, SINKAGGREGATE},
+	{"sqlite", databaseSample, commitDatabase, false, SINKAGGREGATE},
+	{"influx", influxSample, NULL, false, SINKDROP},
+};
+
+#define SINKS (int)(sizeof(sinks) / sizeof(sinks[0]))
+
+struct sink *findSink(const char *name) {
+	int i;
+	for(i = 0; i < SINKS; i++) {
+		if(strcmp(sinks[i].name, name) == 0) return &sinks[i];
+	}
+	return NULL;
+}
+
+/* -S name:policy[,name:policy...] */
+bool parseSinkPolicies(const char *arg) {
+	char name[16], policy[16];
+	int length;
+	while(sscanf(arg, "%15[^:]:%15[^,]%n", name, policy, &length) == 2) {
+		struct sink *k = findSink(name);
+		int p;
+		for(p = 0; p < 3; p++) {
+			if(strcmp(policy, policynames[p]) == 0) break;
+		}
+		if(k == NULL || p == 3) return false;
+		k->policy = p;
+		arg += length;
+		if(*arg == 0) return true;
+		if(*arg++ != ',') return false;
+	}
+	return false;
+}
+
+/* Averages s into the last reading queued for the same device, returns
+ * false if there isn't one. Failed reads aren't averaged with anything.
+ */
+bool aggregateSample(struct sink *k, const struct sample *s) {
+	if(s->temperature == -100) return false;
+	int i;
+	for(i = k->count - 1; i >= 0; i--) {
+		int slot = (k->start + i) % SINKQUEUE;
+		struct sample *q = &k->queue[slot];
+		if(q->device != s->device) continue;
+		if(q->temperature == -100) return false;
+		q->temperature = (q->temperature * k->counts[slot] + s->temperature) / (k->counts[slot] + 1);
+		q->time = s->time;
+		k->counts[slot]++;
+		return true;
+	}
+	return false;
+}
+
+void sinkPut(struct sink *k, const struct sample *s) {
+	pthread_mutex_lock(&k->lock);
+	if(k->count == SINKQUEUE && k->policy == SINKBLOCK) {
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += SINKWAIT * 1000000L;
+		until.tv_sec += until.tv_nsec / 1000000000;
+		until.tv_nsec %= 1000000000;
+		while(k->count == SINKQUEUE && pthread_cond_timedwait(&k->room, &k->lock, &until) != ETIMEDOUT) { }
+	}
+	if(k->count == SINKQUEUE) {
+		if(k->policy == SINKAGGREGATE && aggregateSample(k, s)) {
+			k->aggregated++;
+			pthread_mutex_unlock(&k->lock);
+			return;
+		} else {
+			k->start = (k->start + 1) % SINKQUEUE;
+			k->count--;
+			k->dropped++;
+		}
+	}
+	int slot = (k->start + k->count) % SINKQUEUE;
+	k->queue[slot] = *s;
+	k->counts[slot] = 1;
+	k->count++;
+	pthread_cond_signal(&k->ready);
+	pthread_mutex_unlock(&k->lock);
+}
+
+void *sinkMain(void *arg) {
+	struct sink *k = (struct sink *)arg;
+	uint32_t dropped = 0;
+	uint32_t aggregated = 0;
+	bool written = false;
+	bool unflushed = false; // the last flush left something for later
+	pthread_mutex_lock(&k->lock);
+	while(true) {
+		if(k->count == 0) {
+			/* Caught up: flush, and say if anything has been lost since
+			 * last time.
+			 */
+			if(written || k->dropped != dropped || k->aggregated != aggregated) {
+				if(k->dropped != dropped || k->aggregated != aggregated) {
+					fprintf(stderr, "sink %s: %u readings dropped and %u aggregated so far\n", k->name, k->dropped, k->aggregated);
+					dropped = k->dropped;
+					aggregated = k->aggregated;
+				}
+				pthread_mutex_unlock(&k->lock);
+				if(written && k->flush != NULL) unflushed = !k->flush();
+				written = false;
+				pthread_mutex_lock(&k->lock);
+				continue;
+			}
+			if(unflushed) {
+				/* Flush again in a second if nothing comes in before */
+				struct timespec until;
+				clock_gettime(CLOCK_REALTIME, &until);
+				until.tv_sec++;
+				if(pthread_cond_timedwait(&k->ready, &k->lock, &until) == ETIMEDOUT) {
+					pthread_mutex_unlock(&k->lock);
+					unflushed = !k->flush();
+					pthread_mutex_lock(&k->lock);
+				}
+				continue;
+			}
+			pthread_cond_wait(&k->ready, &k->lock);
+			continue;
+		}
+		struct sample s = k->queue[k->start];
+		k->start = (k->start + 1) % SINKQUEUE;
+		k->count--;
+		pthread_cond_signal(&k->room);
+		pthread_mutex_unlock(&k->lock);
+		k->write(&s);
+		written = true;
+		pthread_mutex_lock(&k->lock);
+	}
+	return NULL;
+}
+
+bool startSinks() {
+	findSink("csv")->enabled = true;
+	findSink("archive")->enabled = archiving;
+	findSink("log")->enabled = livelogdir != NULL;
+	findSink("forward")->enabled = forwardto != NULL;
+	findSink("sqlite")->enabled = databasepath != NULL;
+	findSink("influx")->enabled = influxto != NULL;
+	int i;
+	for(i = 0; i < SINKS; i++) {
+		struct sink *k = &sinks[i];
+		if(!k->enabled) continue;
+		pthread_mutex_init(&k->lock, NULL);
+		pthread_cond_init(&k->ready, NULL);
+		pthread_cond_init(&k->room, NULL);
+		if(pthread_create(&k->thread, NULL, sinkMain, k) != 0) return false;
+	}
+	return true;
+}
+
+/* Where every sample ends up */
+void recordSample(const struct sample *s) {
+	int i;
+	for(i = 0; i < SINKS; i++) {
+		if(sinks[i].enabled) sinkPut(&sinks[i], s);
+	}
+}
+
+/* Recent history
+ * The last HISTORYSIZE readings from each device are kept in memory so
+ * questions like "the last day from this logger" can be answered straight
+ * away without reading back the output. Each device's ring is only written
+ * by the sampling thread and is read by the socket server with a sequence
+ * lock: the writer makes the sequence odd while it changes the ring and even
+ * again after, and a reader copies what it wants and tries again if the
+ * sequence was odd or has moved on. The writer never waits for a reader.
+ */
+#define HISTORYSIZE 1024 // three and a half days at the default interval
+
+struct historyentry {
+	int64_t time;
+	float temperature;
+};
+
+struct historyring {
+	uint32_t sequence;
+	uint32_t written; // readings ever added, the newest is at written - 1
+	int64_t times[HISTORYSIZE];
+	uint32_t temperatures[HISTORYSIZE]; // the float's bits, so they can be loaded atomically
+};
+
+struct historyring history[MAXBUSES * MAXDEVICES];
+
+void historyAdd(int device, int64_t time, float temperature) {
+	if(device < 0 || temperature == -100) return;
+	struct historyring *r = &history[device];
+	uint32_t sequence = r->sequence;
+	uint32_t slot = r->written % HISTORYSIZE;
+	uint32_t bits;
+	memcpy(&bits, &temperature, 4);
+	__atomic_store_n(&r->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&r->times[slot], time, __ATOMIC_RELAXED);
+	__atomic_store_n(&r->temperatures[slot], bits, __ATOMIC_RELAXED);
+	__atomic_store_n(&r->written, r->written + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&r->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/* Copies a device's readings since a time (microseconds since the epoch),
+ * oldest first, into out, which has room for HISTORYSIZE. Returns how many.
+ */
+int historyRead(int device, int64_t since, struct historyentry *out) {
+	struct historyring *r = &history[device];
+	while(true) {
+		uint32_t sequence = __atomic_load_n(&r->sequence, __ATOMIC_ACQUIRE);
+		if(sequence & 1) {
+			sched_yield();
+			continue;
+		}
+		uint32_t written = __atomic_load_n(&r->written, __ATOMIC_RELAXED);
+		uint32_t i = written > HISTORYSIZE ? written - HISTORYSIZE : 0;
+		int count = 0;
+		for(; i < written; i++) {
+			int64_t time = __atomic_load_n(&r->times[i % HISTORYSIZE], __ATOMIC_RELAXED);
+			if(time < since) continue;
+			uint32_t bits = __atomic_load_n(&r->temperatures[i % HISTORYSIZE], __ATOMIC_RELAXED);
+			out[count].time = time;
+			memcpy(&out[count].temperature, &bits, 4);
+			count++;
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&r->sequence, __ATOMIC_RELAXED) == sequence) return count;
+	}
+}
+
+/* Local clients
+ * With -l the program listens on a UNIX socket and answers from memory on a
+ * thread of its own, so a slow client can't hold up sampling. A client
+ * sends a line and gets lines back:
+ * devices                  the ID of every device
+ * history <id> <seconds>   CSV of the device's readings in the last seconds
+ * and the connection is closed once the answer has gone, except for
+ * subscribe <samples|events|all> <drop|coalesce> [id...]
+ * which answers "ok" and then keeps the connection open, sending a frame for every reading or event (from
+ * the listed devices, or all of them) as it happens.
+ *
+ * Frames are 32 bytes, in the Pi's byte order:
+ * 0  time, int64, microseconds since the epoch
+ * 8  device ROM ID, 8 bytes
+ * 16 value, float: the reading (-100 for a failed read) or the event's value
+ * 20 type, byte: 0 sample, 1 event, 2 frames were dropped
+ * 21 event type, byte: as in eventnames
+ * 22 reserved, 2 bytes
+ * 24 dropped, uint32: how many frames were lost, for type 2
+ * 28 reserved, 4 bytes
+ *
+ * Each subscriber has its own queue of SUBSCRIBERFRAMES. If a subscriber
+ * reads too slowly to keep up, new frames are dropped once its queue is full
+ * and it is sent a type 2 frame saying how many were lost before the next one
+ * that gets through. With coalesce, a new reading replaces a queued reading
+ * from the same device instead, so a slow subscriber still sees each
+ * device's latest reading. Events are never coalesced.
+ *
+ * The sampling thread hands frames to the server through a queue of its own
+ * and a pipe to wake it up. Neither of them can block, so subscribers can't
+ * hold up sampling however slow they are.
+ */
+#define MAXCLIENTS 16
+#define CLIENTBUFFER 65536
+#define SUBSCRIBERFRAMES 256
+#define MAXFILTER 16
+#define FEEDSIZE 256
+#define FRAMEBATCH 64 // frames taken off a subscriber's queue at a time
+
+struct frame {
+	int64_t time;
+	uint8_t rom[8];
+	float value;
+	uint8_t type;
+	uint8_t event;
+	uint16_t reserved;
+	uint32_t dropped;
+	uint32_t reserved2;
+};
+
+struct client {
+	int fd; // -1 for a free slot
+	char in[128];
+	int inlength;
+	char out[CLIENTBUFFER];
+	int outstart;
+	int outlength;
+	bool closing; // once out has been sent
+	bool subscribed;
+	bool wanted[FRAMEDROPPED]; // which frame types
+	bool coalesce;
+	uint8_t filter[MAXFILTER][8];
+	int filtercount; // 0 for every device
+	struct frame queue[SUBSCRIBERFRAMES];
+	int queuestart;
+	int queuecount;
+	uint32_t dropped; // not reported yet
+};
+
+const char *socketpath = NULL;
+int listenfd = -1;
+struct client clients[MAXCLIENTS];
+pthread_t serverthread;
+
+/* From the sampling thread to the server */
+struct frame feed[FEEDSIZE];
+uint32_t feedhead = 0; // written by the sampling thread
+uint32_t feedtail = 0; // written by the server
+uint32_t feeddropped = 0; // frames the server didn't take in time
+int wakefds[2] = {-1, -1};
+
+/* The device table only grows, and discoverDevices fills an entry in
+ * before counting it, so the server can read up to here safely.
+ */
+int knownDevices() {
+	return __atomic_load_n(&devicecount, __ATOMIC_ACQUIRE);
+}
+
+bool clientPrintf(struct client *c, const char *format, ...) {
+	int room = CLIENTBUFFER - c->outstart - c->outlength;
+	va_list args;
+	va_start(args, format);
+	int n = vsnprintf(&c->out[c->outstart + c->outlength], room, format, args);
+	va_end(args);
+	if(n < 0 || n >= room) return false;
+	c->outlength += n;
+	return true;
+}
+
+void clientClose(struct client *c) {
+	close(c->fd);
+	c->fd = -1;
+}
+
+/* subscribe <samples|events|all> <drop|coalesce> [id...] */
+void subscribe(struct client *c, const char *args) {
+	char types[8], policy[9];
+	int n;
+	if(sscanf(args, "%7s %8s%n", types, policy, &n) != 2) {
+		clientPrintf(c, "error: subscribe <samples|events|all> <drop|coalesce> [id...]\n");
+		return;
+	}
+	c->wanted[FRAMESAMPLE] = strcmp(types, "samples") == 0 || strcmp(types, "all") == 0;
+	c->wanted[FRAMEEVENT] = strcmp(types, "events") == 0 || strcmp(types, "all") == 0;
+	c->coalesce = strcmp(policy, "coalesce") == 0;
+	if((!c->wanted[FRAMESAMPLE] && !c->wanted[FRAMEEVENT]) || (!c->coalesce && strcmp(policy, "drop") != 0)) {
+		clientPrintf(c, "error: subscribe <samples|events|all> <drop|coalesce> [id...]\n");
+		return;
+	}
+	c->filtercount = 0;
+	const char *p = &args[n];
+	char id[17];
+	int length;
+	while(sscanf(p, " %16[0-9A-Fa-f]%n", id, &length) == 1) {
+		if(c->filtercount == MAXFILTER || !hexToROM(id, c->filter[c->filtercount])) {
+			clientPrintf(c, "error: bad device list\n");
+			return;
+		}
+		c->filtercount++;
+		p += length;
+	}
+	c->queuestart = 0;
+	c->queuecount = 0;
+	c->dropped = 0;
+	c->subscribed = true;
+	c->closing = false;
+	clientPrintf(c, "ok\n");
+}
+
+bool subscriberWants(const struct client *c, const struct frame *f) {
+	if(!c->subscribed || !c->wanted[f->type]) return false;
+	if(c->filtercount == 0) return true;
+	int i;
+	for(i = 0; i < c->filtercount; i++) {
+		if(memcmp(c->filter[i], f->rom, 8) == 0) return true;
+	}
+	return false;
+}
+
+void enqueueFrame(struct client *c, const struct frame *f) {
+	/* A drop notice goes in ahead of the next frame that makes it */
+	int needed = c->dropped > 0 ? 2 : 1;
+	if(c->queuecount + needed <= SUBSCRIBERFRAMES) {
+		if(c->dropped > 0) {
+			struct frame *d = &c->queue[(c->queuestart + c->queuecount++) % SUBSCRIBERFRAMES];
+			memset(d, 0, sizeof(*d));
+			d->time = f->time;
+			d->type = FRAMEDROPPED;
+			d->dropped = c->dropped;
+			c->dropped = 0;
+		}
+		c->queue[(c->queuestart + c->queuecount++) % SUBSCRIBERFRAMES] = *f;
+		return;
+	}
+	if(c->coalesce && f->type == FRAMESAMPLE) {
+		int i;
+		for(i = c->queuecount - 1; i >= 0; i--) {
+			struct frame *q = &c->queue[(c->queuestart + i) % SUBSCRIBERFRAMES];
+			if(q->type == FRAMESAMPLE && memcmp(q->rom, f->rom, 8) == 0) {
+				*q = *f;
+				return;
+			}
+		}
+	}
+	c->dropped++;
+}
+
+/* Called from the sampling thread. Never waits: if the server has fallen
+ * behind the frame is counted as dropped for every subscriber.
+ */
+void publish(int type, int device, int64_t time, float value, int event) {
+	if(wakefds[1] < 0 || device < 0) return;
+	uint32_t head = feedhead;
+	if(head - __atomic_load_n(&feedtail, __ATOMIC_ACQUIRE) == FEEDSIZE) {
+		__atomic_fetch_add(&feeddropped, 1, __ATOMIC_RELAXED);
+	} else {
+		struct frame *f = &feed[head % FEEDSIZE];
+		memset(f, 0, sizeof(*f));
+		f->time = time;
+		memcpy(f->rom, devices[device].rom, 8);
+		f->value = value;
+		f->type = type;
+		f->event = event;
+		__atomic_store_n(&feedhead, head + 1, __ATOMIC_RELEASE);
+	}
+	char wake = 0;
+	if(write(wakefds[1], &wake, 1) < 0) {} // full is fine, the server is awake already
+}
+
+/* Hands out everything the sampling thread has published */
+void drainFeed() {
+	char buffer[64];
+	while(read(wakefds[0], buffer, sizeof(buffer)) > 0) {}
+	uint32_t dropped = __atomic_exchange_n(&feeddropped, 0, __ATOMIC_RELAXED);
+	uint32_t head = __atomic_load_n(&feedhead, __ATOMIC_ACQUIRE);
+	uint32_t tail = feedtail;
+	int i;
+	for(i = 0; i < MAXCLIENTS; i++) {
+		if(clients[i].fd >= 0 && clients[i].subscribed) clients[i].dropped += dropped;
+	}
+	for(; tail != head; tail++) {
+		const struct frame *f = &feed[tail % FEEDSIZE];
+		for(i = 0; i < MAXCLIENTS; i++) {
+			if(clients[i].fd >= 0 && subscriberWants(&clients[i], f)) enqueueFrame(&clients[i], f);
+		}
+	}
+	__atomic_store_n(&feedtail, tail, __ATOMIC_RELEASE);
+}
+
+void clientCommand(struct client *c, const char *line) {
+	char id[17];
+	long long seconds;
+	uint8_t rom[8];
+	int i;
+	c->closing = true;
+	if(strncmp(line, "subscribe ", 10) == 0) {
+		subscribe(c, &line[10]);
+		return;
+	}
+	if(strcmp(line, "devices") == 0) {
+		int count = knownDevices();
+		for(i = 0; i < count; i++) {
+			romToHex(devices[i].rom, id);
+			clientPrintf(c, "%s\n", id);
+		}
+		return;
+	}
+	if(sscanf(line, "history %16[0-9A-Fa-f] %lld", id, &seconds) == 2 && hexToROM(id, rom)) {
+		int count = knownDevices();
+		for(i = 0; i < count; i++) {
+			if(memcmp(devices[i].rom, rom, 8) == 0) break;
+		}
+		if(i == count) {
+			clientPrintf(c, "error: no device %s\n", id);
+			return;
+		}
+		struct historyentry entries[HISTORYSIZE];
+		int n = historyRead(i, realtimeMicros() - seconds * 1000000, entries);
+		int j;
+		clientPrintf(c, "time, temperature\n");
+		for(j = 0; j < n; j++) clientPrintf(c, "%.3f, %.1f\n", entries[j].time / 1000000.0, entries[j].temperature);
+		return;
+	}
+	clientPrintf(c, "error: unknown command\n");
+}
+
+/* Reads what the client has sent, answering each whole line */
+void clientRead(struct client *c) {
+	ssize_t n = read(c->fd, &c->in[c->inlength], sizeof(c->in) - c->inlength - 1);
+	if(n <= 0) {
+		clientClose(c);
+		return;
+	}
+	c->inlength += n;
+	c->in[c->inlength] = 0;
+	char *end;
+	while(!c->closing && !c->subscribed && (end = strchr(c->in, '\n')) != NULL) {
+		*end = 0;
+		if(end > c->in && end[-1] == '\r') end[-1] = 0;
+		clientCommand(c, c->in);
+		c->inlength -= end + 1 - c->in;
+		memmove(c->in, end + 1, c->inlength + 1);
+	}
+	if(c->closing && c->outlength == 0) {
+		/* Answered with nothing at all, e.g. devices with none found */
+		clientClose(c);
+		return;
+	}
+	if(c->subscribed) c->inlength = 0; // nothing more to say
+	else if(c->inlength == (int)sizeof(c->in) - 1) clientClose(c); // no newline in sight
+}
+
+void clientWrite(struct client *c) {
+	/* Subscribers' frames are moved out of the queue a batch at a time, so
+	 * the ones still queued can be coalesced.
+	 */
+	if(c->outlength == 0) {
+		c->outstart = 0;
+		while(c->queuecount > 0 && c->outlength < FRAMEBATCH * (int)sizeof(struct frame)) {
+			memcpy(&c->out[c->outlength], &c->queue[c->queuestart], sizeof(struct frame));
+			c->outlength += sizeof(struct frame);
+			c->queuestart = (c->queuestart + 1) % SUBSCRIBERFRAMES;
+			c->queuecount--;
+		}
+		if(c->outlength == 0) return;
+	}
+	ssize_t n = send(c->fd, &c->out[c->outstart], c->outlength, MSG_NOSIGNAL);
+	if(n < 0) {
+		if(errno != EAGAIN) clientClose(c);
+		return;
+	}
+	c->outstart += n;
+	c->outlength -= n;
+	if(c->outlength == 0) {
+		c->outstart = 0;
+		if(c->closing) clientClose(c);
+	}
+}
+
+void clientAccept() {
+	int fd = accept(listenfd, NULL, NULL);
+	if(fd < 0) return;
+	int i;
+	for(i = 0; i < MAXCLIENTS; i++) {
+		if(clients[i].fd < 0) break;
+	}
+	if(i == MAXCLIENTS) {
+		close(fd);
+		return;
+	}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	struct client *c = &clients[i];
+	c->fd = fd;
+	c->inlength = 0;
+	c->outstart = 0;
+	c->outlength = 0;
+	c->closing = false;
+	/* Nothing from whoever had the slot before */
+	c->subscribed = false;
+	memset(c->wanted, 0, sizeof(c->wanted));
+	c->coalesce = false;
+	c->filtercount = 0;
+	c->queuestart = 0;
+	c->queuecount = 0;
+	c->dropped = 0;
+}
+
+void *serverMain(void *arg) {
+	struct pollfd fds[MAXCLIENTS + 2];
+	int i;
+	while(true) {
+		fds[0].fd = listenfd;
+		fds[0].events = POLLIN;
+		fds[1].fd = wakefds[0];
+		fds[1].events = POLLIN;
+		for(i = 0; i < MAXCLIENTS; i++) {
+			struct client *c = &clients[i];
+			bool pending = c->outlength > 0 || c->queuecount > 0;
+			fds[i + 2].fd = c->fd; // ignored by poll when -1
+			if(c->subscribed) fds[i + 2].events = POLLIN | (pending ? POLLOUT : 0); // still watching for it hanging up
+			else fds[i + 2].events = pending ? POLLOUT : POLLIN;
+		}
+		if(poll(fds, MAXCLIENTS + 2, -1) < 0) continue;
+		if(fds[1].revents & POLLIN) drainFeed();
+		for(i = 0; i < MAXCLIENTS; i++) {
+			struct client *c = &clients[i];
+			if(c->fd < 0 || fds[i + 2].revents == 0) continue;
+			if(fds[i + 2].revents & POLLOUT) clientWrite(c);
+			if(c->fd >= 0 && (fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR))) clientRead(c);
+		}
+		if(fds[0].revents & POLLIN) clientAccept();
+	}
+	return NULL;
+}
+
+bool serverStart() {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if(strlen(socketpath) >= sizeof(address.sun_path)) return false;
+	strcpy(address.sun_path, socketpath);
+	listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(listenfd < 0) return false;
+	unlink(socketpath); // left over from last time
+	if(bind(listenfd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listenfd, MAXCLIENTS) != 0) {
+		close(listenfd);
+		return false;
+	}
+	int i;
+	for(i = 0; i < MAXCLIENTS; i++) clients[i].fd = -1;
+	if(pipe(wakefds) != 0) return false;
+	fcntl(wakefds[0], F_SETFL, O_NONBLOCK);
+	fcntl(wakefds[1], F_SETFL, O_NONBLOCK);
+	return pthread_create(&serverthread, NULL, serverMain, NULL) == 0;
+}
+
+/* Prints a subscription's frames as CSV as they arrive */
+void printFrames(int fd) {
+	struct frame f;
+	int i;
+	while(true) {
+		int got = 0;
+		while(got < (int)sizeof(f)) {
+			ssize_t n = read(fd, (char *)&f + got, sizeof(f) - got);
+			if(n <= 0) return;
+			got += n;
+		}
+		if(f.type == FRAMEDROPPED) {
+			printf("dropped, %lld, %u\n", (long long)f.time, f.dropped);
+		} else {
+			printf("%s, %lld, ", f.type == FRAMESAMPLE ? "sample" : "event", (long long)f.time);
+			for(i = 0; i < 8; i++) printf("%X", f.rom[i]);
+			if(f.type == FRAMEEVENT && f.event < sizeof(eventnames) / sizeof(eventnames[0])) printf(", %s", eventnames[f.event]);
+			printf(", %.1f\n", f.value);
+		}
+		fflush(stdout);
+	}
+}
+
+/* -c: sends a command to a running program's -l socket and prints the
+ * answer.
+ */
+bool askServer(const char *command) {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if(strlen(socketpath) >= sizeof(address.sun_path)) return false;
+	strcpy(address.sun_path, socketpath);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0) return false;
+	if(connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+		close(fd);
+		return false;
+	}
+	char buffer[4096];
+	int length = snprintf(buffer, sizeof(buffer), "%s\n", command);
+	if(write(fd, buffer, length) != length) {
+		close(fd);
+		return false;
+	}
+	ssize_t n;
+	if(strncmp(command, "subscribe ", 10) == 0) {
+		/* Frames follow an ok, otherwise it's an error */
+		int length = 0;
+		while(length < (int)sizeof(buffer) - 1 && read(fd, &buffer[length], 1) == 1 && buffer[length] != '\n') length++;
+		buffer[length] = 0;
+		if(strcmp(buffer, "ok") == 0) printFrames(fd);
+		else printf("%s\n", buffer);
+		close(fd);
+		return true;
+	}
+	while((n = read(fd, buffer, sizeof(buffer))) > 0) fwrite(buffer, 1, n, stdout);
+	close(fd);
+	return true;
+}
+
+/* Samples every device that's due on every bus at the same moment. The
+ * first step starts the conversions, with SKIPROM on every bus where all of
+ * the devices are due and by MATCHROM for the ones that are due on the
+ * rest, all of the buses together. The rest of the steps read the results
+ * back by MATCHROM, one device from every bus at a time, with their CRC so
+ * a device that isn't there can't pass for one that is. Each device that
+ * couldn't be started or read gets a -100 of its own:
+ * 0. Start the conversions
+ * 1. Read the first due device on each bus
+ * 2. Read the second due device on each bus...
+ */
+int64_t triggertimes[MAXBUSES * MAXDEVICES];
+
+/* The n'th device on bus that's due this tick (n counts from 1), -1 if there
+ * aren't that many.
+ */
+int dueDevice(int bus, int n, unsigned tick) {
+	int j;
+	for(j = 0; j < devicecount; j++) {
+		if(devices[j].pin != buspins[bus] || !deviceDue(j, tick)) continue;
+		if(--n == 0) return j;
+	}
+	return -1;
+}
+
+/* Sets up round n of the conversions: a SKIPROM on every bus that has all
+ * its devices due (in the first round only) and a MATCHROM for the n'th due
+ * device on the rest. slot gets each bus's transaction in t, or -1 for a bus
+ * with nothing to do this round, and device the device it's for (-1 for a
+ * SKIPROM). Returns the number of transactions.
+ */
+int setupConverts(struct wiretransaction *t, int n, const bool *all, unsigned tick, int *device, int *slot) {
+	int i;
+	int count = 0;
+	for(i = 0; i < buscount; i++) {
+		device[i] = -1;
+		slot[i] = -1;
+		if(all[i]) {
+			if(n > 1) continue;
+			uint8_t convert[] = {SKIPROM, CONVERTTEMP};
+			slot[i] = count;
+			setupTransaction(&t[count++], buspins[i], convert, 2, NULL, 0);
+			continue;
+		}
+		device[i] = dueDevice(i, n, tick);
+		if(device[i] < 0) continue;
+		uint8_t convert[] = {MATCHROM, 0, 0, 0, 0, 0, 0, 0, 0, CONVERTTEMP};
+		memcpy(&convert[1], devices[device[i]].rom, 8);
+		slot[i] = count;
+		setupTransaction(&t[count++], buspins[i], convert, sizeof(convert), NULL, 0);
+	}
+	return count;
+}
+
+/* Which buses have every one of their devices due this tick */
+void allDue(bool *all, unsigned tick) {
+	int i, j;
+	for(i = 0; i < buscount; i++) {
+		all[i] = true;
+		for(j = 0; j < devicecount; j++) {
+			if(devices[j].pin == buspins[i] && !deviceDue(j, tick)) all[i] = false;
+		}
+	}
+}
+
+/* Notes which devices a round of setupConverts started, and when */
+void markConverted(const struct wiretransaction *t, const bool *all, const int *device, const int *slot, int64_t now, bool *converted) {
+	int i, j;
+	for(i = 0; i < buscount; i++) {
+		if(slot[i] < 0) continue;
+		bool present = t[slot[i]].present;
+		if(all[i]) {
+			for(j = 0; j < devicecount; j++) {
+				if(devices[j].pin != buspins[i]) continue;
+				triggertimes[j] = now;
+				converted[j] = present;
+			}
+		} else {
+			triggertimes[device[i]] = now;
+			converted[device[i]] = present;
+		}
+	}
+}
+
+/* Sets up the reads for step stage: the stage'th due device on every bus
+ * whose conversion started, into that bus's results. device and slot are
+ * as for setupConverts, with device set even when there's nothing to read.
+ * due gets how many buses had a device. Returns the number of transactions.
+ */
+int setupReads(struct wiretransaction *t, int stage, unsigned tick, const bool *converted, uint8_t results[][TEMPREADLEN], int *device, int *slot, int *due) {
+	int i;
+	int count = 0;
+	*due = 0;
+	for(i = 0; i < buscount; i++) {
+		device[i] = dueDevice(i, stage, tick);
+		slot[i] = -1;
+		if(device[i] < 0) continue;
+		(*due)++;
+		if(!converted[device[i]]) continue; // nothing to read, it's a -100
+		uint8_t readtemp[] = {MATCHROM, 0, 0, 0, 0, 0, 0, 0, 0, READMEMCRC, TEMPADDR & 0xFF, TEMPADDR >> 8};
+		memcpy(&readtemp[1], devices[device[i]].rom, 8);
+		slot[i] = count;
+		setupTransaction(&t[count++], buspins[i], readtemp, sizeof(readtemp), results[i], TEMPREADLEN);
+	}
+	return count;
+}
+
+/* The temperature bus i's device read, -100 if it wasn't read or failed */
+float busTemperature(const struct wiretransaction *t, const int *slot, uint8_t results[][TEMPREADLEN], int i) {
+	return slot[i] >= 0 && t[slot[i]].present ? temperatureRead(results[i]) : -100;
+}
+
+bool sampleStep(struct busjob *job) {
+	struct wiretransaction t[MAXBUSES];
+	uint8_t results[MAXBUSES][TEMPREADLEN];
+	int device[MAXBUSES];
+	int slot[MAXBUSES]; // each bus's transaction in t, -1 if it has none
+	int i, n;
+	struct sample s;
+	if(job->stage == 0) {
+		uint64_t latency = monotonicMicros() - job->due;
+		if(latency > worstlatency) worstlatency = latency;
+		if(lanes[BULK].count > 0 && latency > worstbulklatency) worstbulklatency = latency;
+		bool all[MAXBUSES];
+		allDue(all, job->tick);
+		for(n = 1; ; n++) {
+			int count = setupConverts(t, n, all, job->tick, device, slot);
+			if(count == 0) break;
+			runInterleaved(t, count);
+			markConverted(t, all, device, slot, realtimeMicros(), job->converted);
+		}
+		sleepMicros(200);
+		job->stage++;
+		return false;
+	}
+
+	int due;
+	int count = setupReads(t, job->stage, job->tick, job->converted, results, device, slot, &due);
+	if(due == 0) {
+		saveAccumulators();
+		return true;
+	}
+	if(count > 0) runInterleaved(t, count);
+	for(i = 0; i < buscount; i++) {
+		if(device[i] < 0) continue;
+		s.device = device[i];
+		s.time = triggertimes[device[i]];
+		s.temperature = busTemperature(t, slot, results, i);
+		recordSample(&s);
+		updateAdaptive(&s);
+		detectAnomalies(&s);
+		controlSample(&s);
+		accumulateSample(s.device, s.time, s.temperature);
+		historyAdd(s.device, s.time, s.temperature);
+		publish(FRAMESAMPLE, s.device, s.time, s.temperature, 0);
+	}
+	job->stage++;
+	return false;
+}
+
+/* Runs transactions against simulated devices, each on the bus whose pin
+ * is in simpins, the way runInterleaved would on the real buses. Devices on
+ * the same bus share the line, so it's low if any of them pulls it low.
+ */
+void simulateBuses(struct wiretransaction *t, int count, struct simdevice *sims, const uint8_t *simpins, int simcount) {
+	static struct waveedge edges[MAXEDGES];
+	static uint8_t samples[MAXEDGES];
+	static uint8_t line[MAXEDGES];
+	int i, j, k;
+	for(i = 0; i < count; i++) {
+		int edgecount = compileWaveform(t[i].tx, t[i].txlen, t[i].rxlen, edges, MAXEDGES);
+		memset(line, HIGH, sizeof(line));
+		for(j = 0; j < simcount; j++) {
+			if(simpins[j] != t[i].pin) continue;
+			simulateWaveform(&sims[j], edges, edgecount, samples);
+			for(k = 0; k < edgecount; k++) line[k] &= samples[k];
+		}
+		t[i].present = line[0] == LOW;
+		if(t[i].rxlen > 0) decodeSamples(line, t[i].rx, t[i].rxlen);
+		t[i].done = true;
+	}
+}
+
+/* Does transaction n of t go to pin and start with the ROM command and ID
+ * of device (-1 for a SKIPROM)?
+ */
+bool checkTransaction(const struct wiretransaction *t, int count, int n, uint8_t pin, int device) {
+	if(n < 0 || n >= count || t[n].pin != pin) return false;
+	if(device < 0) return t[n].tx[0] == SKIPROM;
+	return t[n].tx[0] == MATCHROM && memcmp(&t[n].tx[1], devices[device].rom, 8) == 0;
+}
+
+/* Goes through a sample the way sampleStep does, on four made up buses:
+ * one with all of its devices due, one with two of its three due, one with
+ * nothing due and one with a single device. Checks which transaction goes
+ * to which bus in each round and that every device's temperature comes
+ * back from its own bus, including when an earlier bus has nothing to
+ * read so the transactions and the buses don't line up.
+ */
+bool checkSampleMapping() {
+	static const uint8_t pins[] = {4, 17, 27, 22};
+	static const int bus[] = {0, 0, 1, 1, 1, 2, 3}; // A to G
+	static const float temperatures[] = {4.5, 5.0, 6.0, 6.5, 7.0, 7.5, 8.0};
+	static const bool due[] = {true, true, true, false, true, false, true};
+	enum {A, B, C, D, E, F, G, DEVICES};
+	/* The real tables are put back afterwards */
+	static struct device saveddevices[MAXBUSES * MAXDEVICES];
+	static struct adaptive savedadapt[MAXBUSES * MAXDEVICES];
+	uint8_t savedpins[MAXBUSES];
+	int savedbuscount = buscount;
+	int saveddevicecount = devicecount;
+	int savedmaxlevel = maxlevel;
+	memcpy(saveddevices, devices, sizeof(devices));
+	memcpy(savedadapt, adapt, sizeof(adapt));
+	memcpy(savedpins, buspins, sizeof(buspins));
+
+	struct simdevice sims[DEVICES];
+	uint8_t simpins[DEVICES];
+	int i;
+	buscount = sizeof(pins);
+	memcpy(buspins, pins, sizeof(pins));
+	devicecount = DEVICES;
+	maxlevel = 1;
+	unsigned tick = 1; // only devices at level 1 are due
+	for(i = 0; i < DEVICES; i++) {
+		uint8_t rom[8] = {0x21, (uint8_t)(0xA0 + i), 0x11, 0x22, 0x33, 0x44, 0x55, 0};
+		simInit(&sims[i], rom, temperatures[i]);
+		simpins[i] = pins[bus[i]];
+		devices[i].pin = pins[bus[i]];
+		memcpy(devices[i].rom, sims[i].rom, 8);
+		adapt[i].level = due[i] ? 1 : 0;
+	}
+
+	struct wiretransaction t[MAXBUSES];
+	uint8_t results[MAXBUSES][TEMPREADLEN];
+	int device[MAXBUSES];
+	int slot[MAXBUSES];
+	bool all[MAXBUSES];
+	bool converted[MAXBUSES * MAXDEVICES];
+	memset(converted, 0, sizeof(converted));
+	allDue(all, tick);
+	bool ok = all[0] && !all[1] && !all[2] && all[3];
+
+	/* Round 1: SKIPROM on buses 0 and 3, C on bus 1, nothing on bus 2 */
+	int count = setupConverts(t, 1, all, tick, device, slot);
+	ok = ok && count == 3 && slot[2] < 0 && device[1] == C;
+	ok = ok && checkTransaction(t, count, slot[0], pins[0], -1) && checkTransaction(t, count, slot[1], pins[1], C) && checkTransaction(t, count, slot[3], pins[3], -1);
+	simulateBuses(t, count, sims, simpins, DEVICES);
+	markConverted(t, all, device, slot, 0, converted);
+	/* Round 2: just E */
+	count = setupConverts(t, 2, all, tick, device, slot);
+	ok = ok && count == 1 && slot[0] < 0 && slot[2] < 0 && slot[3] < 0 && checkTransaction(t, count, slot[1], pins[1], E);
+	simulateBuses(t, count, sims, simpins, DEVICES);
+	markConverted(t, all, device, slot, 0, converted);
+	ok = ok && setupConverts(t, 3, all, tick, device, slot) == 0;
+	for(i = 0; i < DEVICES; i++) ok = ok && converted[i] == due[i] && (sims[i].mem[TEMPADDR] != 0) == due[i];
+
+	/* Reads: A, C and G, then B and E, then nothing */
+	int waiting;
+	count = setupReads(t, 1, tick, converted, results, device, slot, &waiting);
+	ok = ok && count == 3 && waiting == 3 && device[0] == A && device[1] == C && device[2] < 0 && device[3] == G;
+	simulateBuses(t, count, sims, simpins, DEVICES);
+	ok = ok && busTemperature(t, slot, results, 0) == 4.5 && busTemperature(t, slot, results, 1) == 6.0 && busTemperature(t, slot, results, 3) == 8.0;
+	count = setupReads(t, 2, tick, converted, results, device, slot, &waiting);
+	ok = ok && count == 2 && waiting == 2 && device[0] == B && device[1] == E;
+	simulateBuses(t, count, sims, simpins, DEVICES);
+	ok = ok && busTemperature(t, slot, results, 0) == 5.0 && busTemperature(t, slot, results, 1) == 7.0;
+	ok = ok && setupReads(t, 3, tick, converted, results, device, slot, &waiting) == 0 && waiting == 0;
+
+	/* B's conversion didn't start, so bus 0 has nothing to read and E's
+	 * read is the first transaction, not the second
+	 */
+	converted[B] = false;
+	count = setupReads(t, 2, tick, converted, results, device, slot, &waiting);
+	ok = ok && count == 1 && waiting == 2 && slot[0] < 0 && slot[1] == 0;
+	simulateBuses(t, count, sims, simpins, DEVICES);
+	ok = ok && busTemperature(t, slot, results, 0) == -100 && busTemperature(t, slot, results, 1) == 7.0;
+
+	buscount = savedbuscount;
+	devicecount = saveddevicecount;
+	maxlevel = savedmaxlevel;
+	memcpy(devices, saveddevices, sizeof(devices));
+	memcpy(adapt, savedadapt, sizeof(adapt));
+	memcpy(buspins, savedpins, sizeof(buspins));
+	fprintf(stderr, "Sample mapping check: readings %s\n", ok ? "come from the right buses" : "don't come from the right buses");
+	return ok;
+}
+
+/* -V: every check runs even after one fails, so they all get reported */
+bool selfCheck() {
+	bool ok = checkWaveforms();
+	ok = checkSampleLog() && ok;
+	ok = checkArchive() && ok;
+	ok = checkCompaction() && ok;
+	ok = checkMission() && ok;
+	ok = checkPageStore() && ok;
+	ok = checkInflux() && ok;
+	ok = checkSampleMapping() && ok;
+	return ok;
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	const char *uartpath = NULL;
+	const char *chippath = NULL;
+	bool setclock = false;
+	int missiondelay = -1;
+	bool query = false;
+	const char *archivedir = NULL;
+	const char *archivequery = NULL;
+	const char *livelogquery = NULL;
+	const char *command = NULL;
+	const char *manifestdiff = NULL;
+	int benchmark = 0;
+	while((opt = getopt(argc, argv, "p:i:a:m:u:Ug:GRs:t:r:T:Pb:D:A:Qo:q:k:z:Z:l:c:S:F:f:E:X:Y:d:w:B:I:V")) != -1) {
+		switch(opt) {
+		case 'p':
+			if(buscount == MAXBUSES) {
+				fprintf(stderr, "At most %d buses\n", MAXBUSES);
+				return 1;
+			}
+			buspins[buscount++] = atoi(optarg);
+			break;
+		case 'i': sampleinterval = atoi(optarg); break;
+		case 'a': adaptmin = atoi(optarg); break;
+		case 'm': missionfile = optarg; break;
+		case 'X': pagestoredir = optarg; break;
+		case 'Y': manifestdiff = optarg; break;
+		case 'u': uartpath = optarg; break;
+		case 'U':
+			uartsimulated = true;
+			uartpath = uartEmulator();
+			if(uartpath == NULL) {
+				fprintf(stderr, "Can't start the UART emulator\n");
+				return 1;
+			}
+			break;
+		case 'g': chippath = optarg; break;
+		case 'G': cdevmock = true; break;
+		case 'R': setclock = true; break;
+		case 't':
+			controlling = true;
+			setpoint = atof(optarg);
+			break;
+		case 'r': relaypin = atoi(optarg); break;
+		case 'T': controlid = optarg; break;
+		case 'P': pidcontrol = true; break;
+		case 'b':
+			if(sscanf(optarg, "%f,%f", &bandlow, &bandhigh) != 2) {
+				fprintf(stderr, "-b wants low,high\n");
+				return 1;
+			}
+			break;
+		case 'D': degreebase = atof(optarg); break;
+		case 'A': accumulatorfile = optarg; break;
+		case 'Q': query = true; break;
+		case 'o': archivedir = optarg; break;
+		case 'q': archivequery = optarg; break;
+		case 'z': livelogdir = optarg; break;
+		case 'Z': livelogquery = optarg; break;
+		case 'l': socketpath = optarg; break;
+		case 'c': command = optarg; break;
+		case 'F':
+			if(!parseForward(optarg)) {
+				fprintf(stderr, "-F wants host:port\n");
+				return 1;
+			}
+			break;
+		case 'f': spooldir = optarg; break;
+		case 'd': databasepath = optarg; break;
+		case 'w': commitinterval = atoi(optarg); break;
+		case 'B': benchmark = atoi(optarg); break;
+		case 'I':
+			if(!influxParse(&sampleinflux, optarg)) {
+				fprintf(stderr, "-I wants host:port/database\n");
+				return 1;
+			}
+			influxto = optarg;
+			break;
+		case 'E': snprintf(edgename, sizeof(edgename), "%s", optarg); break;
+		case 'S':
+			if(!parseSinkPolicies(optarg)) {
+				fprintf(stderr, "-S wants name:policy,... with names csv, archive, log, forward, sqlite or influx and policies block, drop or aggregate\n");
+				return 1;
+			}
+			break;
+		case 'k':
+			if(!parseRetention(optarg)) {
+				fprintf(stderr, "-k wants raw,minutes,hours,days\n");
+				return 1;
+			}
+			break;
+		case 's': missiondelay = atoi(optarg); break;
+		case 'V': return selfCheck() ? 0 : 1;
+		default:
+			fprintf(stderr, "usage: %s [-p pin] [-i seconds] [-a seconds] [-m missionfile] [-X pagestore [-Y manifest[,manifest]]] [-u uart] [-U] [-g gpiochip] [-G] [-R] [-s delay] [-t setpoint [-r relaypin] [-T id] [-P]] [-b low,high] [-D base] [-A file [-Q]] [-o archive [-q id,from,to,points] [-k raw,min,hour,day]] [-z dir [-Z id,from,to]] [-l socket [-c command]] [-S sink:policy,...] [-F host:port [-f spooldir] [-E name]] [-d database [-w ms] [-B readings]] [-I host:port/database] [-V]\n", argv[0]);
+			return 1;
+		}
+	}
+	if(command != NULL) {
+		if(socketpath == NULL || !askServer(command)) {
+			fprintf(stderr, "Can't ask the program on %s\n", socketpath == NULL ? "(no -l)" : socketpath);
+			return 1;
+		}
+		return 0;
+	}
+	if(databasepath != NULL) {
+		if(benchmark > 0) return databaseBenchmark(databasepath, benchmark) ? 0 : 1;
+		if(!databaseOpen(&sampledb, databasepath, commitinterval)) {
+			fprintf(stderr, "Can't open the database %s\n", databasepath);
+			return 1;
+		}
+	}
+	if(pagestoredir != NULL) {
+		if(!storeOpen(&pagestore, pagestoredir)) {
+			fprintf(stderr, "Can't open the page store in %s\n", pagestoredir);
+			return 1;
+		}
+		if(manifestdiff != NULL) return diffManifests(manifestdiff) ? 0 : 1;
+	}
+	if(archivedir != NULL) {
+		if(!archiveOpen(&samplearchive, archivedir)) {
+			fprintf(stderr, "Can't open the archive in %s\n", archivedir);
+			return 1;
+		}
+		archiving = true;
+		if(archivequery != NULL) return printArchive(archivequery) ? 0 : 1;
+		if(!startCompaction()) {
+			fprintf(stderr, "Can't start compacting the archive\n");
+			return 1;
+		}
+	}
+	if(livelogdir != NULL) {
+		mkdir(livelogdir, 0755);
+		if(livelogquery != NULL) return printLivelog(livelogquery) ? 0 : 1;
+	}
+	if(accumulatorfile != NULL) loadAccumulators();
+	if(query) {
+		printAccumulators();
+		return 0;
+	}
+	if(buscount == 0) buspins[buscount++] = targetpin;
+	targetpin = buspins[0];
+	if(uartpath != NULL) {
+		transport = UARTTRANSPORT;
+		buscount = 1; // one bus per UART
+		if(!uartOpen(uartpath)) {
+			fprintf(stderr, "Can't open %s\n", uartpath);
+			return 1;
+		}
+	} else if(cdevmock) {
+		uint8_t rom[8] = {0x21, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x00};
+		simInit(&mockdevice, rom, 4.0);
+		transport = CDEVTRANSPORT;
+	} else if(chippath != NULL) {
+#ifdef GPIOD
+		transport = CDEVTRANSPORT;
+		if(!cdevOpen(chippath, buspins, buscount)) {
+			fprintf(stderr, "Can't get the lines from %s\n", chippath);
+			return 1;
+		}
+#else
+		fprintf(stderr, "Built without libgpiod, rebuild with -DGPIOD -lgpiod\n");
+		return 1;
+#endif
+	} else if(!bcm2835_init()) return 1;
+	int i;
+	for(i = 0; i < buscount; i++) {
+		discoverDevices(buspins[i]);
+		if(setclock) fprintf(stderr, "Set the clock on %d devices\n", setRTCAll(buspins[i]));
+		if(missiondelay >= 0) {
+			clearMemAll(buspins[i]);
+			fprintf(stderr, "Started a mission on %d devices\n", missionStartAll(buspins[i], missiondelay, ENABLEOSC | ENABLEMIS | ENABLERLO));
+		}
+	}
+	if(controlling && !relayOpen()) {
+		fprintf(stderr, "Can't set up the relay on %d\n", relaypin);
+		return 1;
+	}
+	if(socketpath != NULL && !serverStart()) {
+		fprintf(stderr, "Can't listen on %s\n", socketpath);
+		return 1;
+	}
+	if(forwardto != NULL && !startForwarding()) {
+		fprintf(stderr, "Can't open the spool in %s\n", spooldir);
+		return 1;
+	}
+	if(influxto != NULL && !startInflux()) {
+		fprintf(stderr, "Can't start sending to InfluxDB\n");
+		return 1;
+	}
+	printf("time, id, temperature\n");
+	if(!startSinks()) {
+		fprintf(stderr, "Can't start the sinks\n");
+		return 1;
+	}
+	if(missionfile != NULL || pagestoredir != NULL) queueJob(BULK, "mission", missionDownloadStep, targetpin, REGISTERSTART, RESERVED3);
+	if(adaptmin > 0) {
+		while(maxlevel < 16 && (sampleinterval >> (maxlevel + 1)) >= adaptmin) maxlevel++;
+	}
+	uint64_t interval = ((uint64_t)sampleinterval * 1000000) >> maxlevel;
+	uint64_t nextsample = monotonicMicros();
+	unsigned tick = 0;
+	/* Hourly and daily jobs go by the clock, not by counting samples,
+	 * so they're as often whatever -i is. Both first run at startup.
+	 */
+	uint64_t nexthourly = nextsample;
+	uint64_t nextdaily = nextsample;
+	while(true) {
+		uint64_t now = monotonicMicros();
+		if(now >= nextsample) {
+			struct busjob *job = queueJob(URGENT, "sample", sampleStep, targetpin, 0, 0);
+			if(job != NULL) {
+				job->due = nextsample;
+				job->tick = tick;
+			}
+			tick++;
+			nextsample += interval;
+			if(nextsample < now) nextsample = now + interval; // don't try to catch up
+			if((tick - 1) % (1u << maxlevel) != 0) continue; // in between routine samples
+			queueJob(BULK, "probe", healthProbeStep, targetpin, 0, 0);
+			if(now >= nexthourly) {
+				queueJob(BULK, "registers", registerRefreshStep, targetpin, 0, 0);
+				queueJob(BULK, "discover", discoverStep, 0, 0, 0);
+				nexthourly = now + HOURMICROS;
+			}
+			if(now >= nextdaily) {
+				queueJob(BULK, "rtc", rtcDriftStep, targetpin, 0, 0);
+				if(archiving) requestCompaction();
+				nextdaily = now + 24 * HOURMICROS;
+			}
+		}
+		/* Keep the bus clear just before a sample so the conversions
+		 * start right on time rather than after a page of bulk work.
+		 */
+		bool clearing = nextsample - now < SAMPLEGUARD;
+		controlTick();
+		if(!runBusStep(clearing)) {
+			uint64_t wait = nextsample - now;
+			if(controlling && wait > 1000000) wait = 1000000; // keep an eye on the compressor timers
+			struct joblane *bulk = &lanes[BULK];
+			if(bulk->count > 0) { // wake up for a job that's backing off
+				uint64_t retry = bulk->jobs[bulk->head].notbefore;
+				if(retry > now && retry - now < wait) wait = retry - now;
+			}
+			sleepMicros(wait);
+		}
 	}
 	return 0;
 }
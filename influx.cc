@@ -0,0 +1,328 @@
+/* InfluxDB output for the DS1921L logger
+ *
+ * 2021 Angular Fish
+ *
+ * See influx.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <zlib.h>
+#include "archive.h"
+#include "forward.h"
+#include "influx.h"
+
+#define MAXBACKOFF 60
+#define RESPONSEMAX 4096
+
+bool influxParse(struct influx *x, const char *arg) {
+	const char *colon = strchr(arg, ':');
+	const char *slash = colon == NULL ? NULL : strchr(colon, '/');
+	if(colon == NULL || slash == NULL || colon == arg || slash[1] == 0) return false;
+	if(colon - arg >= (int)sizeof(x->host) || slash - colon - 1 >= (int)sizeof(x->port) || slash == colon + 1) return false;
+	memcpy(x->host, arg, colon - arg);
+	x->host[colon - arg] = 0;
+	memcpy(x->port, colon + 1, slash - colon - 1);
+	x->port[slash - colon - 1] = 0;
+	return snprintf(x->path, sizeof(x->path), "/write?db=%s&precision=u", slash + 1) < (int)sizeof(x->path);
+}
+
+/* Tag values can't have spaces, commas or equals signs without a backslash */
+int escapeTag(char *out, int max, const char *value) {
+	int n = 0;
+	for(; *value != 0 && n < max - 2; value++) {
+		if(*value == ' ' || *value == ',' || *value == '=') out[n++] = '\\';
+		out[n++] = *value;
+	}
+	out[n] = 0;
+	return n;
+}
+
+int influxPrefix(char *prefix, const uint8_t *rom, const char *name) {
+	char hex[17];
+	char tag[64];
+	romToHex(rom, hex);
+	escapeTag(tag, sizeof(tag), name);
+	int n = snprintf(prefix, INFLUXPREFIX, "ibutton,device=%s,pi=%s temperature=", hex, tag);
+	return n < INFLUXPREFIX ? n : INFLUXPREFIX - 1;
+}
+
+/* Digits of a non-negative number, backwards */
+int digits(char *out, uint64_t value) {
+	int n = 0;
+	do {
+		out[n++] = '0' + value % 10;
+		value /= 10;
+	} while(value > 0);
+	return n;
+}
+
+/* The value to two decimal places and the time, without going through
+ * printf. Returns the length.
+ */
+int formatReading(char *out, int64_t time, float temperature) {
+	char reversed[24];
+	int n = 0;
+	int i;
+	long hundredths = temperature < 0 ? (long)(temperature * 100 - 0.5) : (long)(temperature * 100 + 0.5);
+	if(hundredths < 0) {
+		out[n++] = '-';
+		hundredths = -hundredths;
+	}
+	int count = digits(reversed, hundredths / 100);
+	for(i = count - 1; i >= 0; i--) out[n++] = reversed[i];
+	out[n++] = '.';
+	out[n++] = '0' + hundredths / 10 % 10;
+	out[n++] = '0' + hundredths % 10;
+	out[n++] = ' ';
+	count = digits(reversed, time < 0 ? 0 : time);
+	for(i = count - 1; i >= 0; i--) out[n++] = reversed[i];
+	out[n++] = '\n';
+	return n;
+}
+
+void influxAdd(struct influx *x, const char *prefix, int prefixlength, int64_t time, float temperature) {
+	char line[INFLUXPREFIX + 48];
+	memcpy(line, prefix, prefixlength);
+	int length = prefixlength + formatReading(&line[prefixlength], time, temperature);
+	pthread_mutex_lock(&x->lock);
+	if(x->length + length > INFLUXSPOOL) {
+		/* Make room by throwing away whole lines from the front */
+		size_t cut = 0;
+		while(cut < x->length && x->length - cut + length > INFLUXSPOOL) {
+			char *newline = (char *)memchr(&x->spool[cut], '\n', x->length - cut);
+			cut = newline == NULL ? x->length : newline - x->spool + 1;
+			x->dropped++;
+		}
+		memmove(x->spool, &x->spool[cut], x->length - cut);
+		x->length -= cut;
+		x->base += cut;
+	}
+	memcpy(&x->spool[x->length], line, length);
+	x->length += length;
+	pthread_cond_signal(&x->added);
+	pthread_mutex_unlock(&x->lock);
+}
+
+/* gzip rather than zlib's own format, which is what Content-Encoding wants */
+int gzipBatch(const char *in, size_t length, uint8_t *out, size_t max) {
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	if(deflateInit2(&z, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+	z.next_in = (Bytef *)in;
+	z.avail_in = length;
+	z.next_out = out;
+	z.avail_out = max;
+	int result = deflate(&z, Z_FINISH);
+	int packed = max - z.avail_out;
+	deflateEnd(&z);
+	return result == Z_STREAM_END ? packed : -1;
+}
+
+/* Reads a response's headers and body, returns the status or -1 if the
+ * connection went. keepopen is cleared if the connection can't be used
+ * again.
+ */
+int readResponse(int fd, char *body, size_t max, bool *keepopen) {
+	char headers[RESPONSEMAX];
+	size_t have = 0;
+	char *end = NULL;
+	while(end == NULL) {
+		if(have == sizeof(headers) - 1) return -1;
+		ssize_t n = recv(fd, &headers[have], sizeof(headers) - 1 - have, 0);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) return -1;
+		have += n;
+		headers[have] = 0;
+		end = strstr(headers, "\r\n\r\n");
+	}
+	int status;
+	if(sscanf(headers, "HTTP/1.%*d %d", &status) != 1) return -1;
+	*end = 0;
+	size_t extra = have - (end + 4 - headers);
+	long contentlength = -1;
+	char *line;
+	for(line = strstr(headers, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n")) {
+		if(strncasecmp(line + 2, "content-length:", 15) == 0) contentlength = atol(line + 17);
+		if(strncasecmp(line + 2, "connection: close", 17) == 0) *keepopen = false;
+	}
+	if(contentlength < 0) {
+		/* Only a 204 has no body without saying so */
+		if(status != 204) *keepopen = false;
+		contentlength = status == 204 ? 0 : extra;
+	}
+	/* Keep the start of the body for the error message, skip the rest */
+	size_t kept = extra < max - 1 ? extra : max - 1;
+	memcpy(body, end + 4, kept);
+	long left = contentlength - extra;
+	char skip[1024];
+	while(left > 0) {
+		ssize_t n = recv(fd, skip, left < (long)sizeof(skip) ? left : sizeof(skip), 0);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) return -1;
+		if(kept < max - 1) {
+			size_t more = (size_t)n < max - 1 - kept ? n : max - 1 - kept;
+			memcpy(&body[kept], skip, more);
+			kept += more;
+		}
+		left -= n;
+	}
+	body[kept] = 0;
+	return status;
+}
+
+/* POSTs a packed batch, returns the status or -1 */
+int postBatch(struct influx *x, int *fd, const uint8_t *packed, int length, char *body, size_t max) {
+	if(*fd < 0) {
+		*fd = connectTo(x->host, x->port);
+		if(*fd < 0) return -1;
+	}
+	char request[1024];
+	int n = snprintf(request, sizeof(request),
+		"POST %s HTTP/1.1\r\n"
+		"Host: %s:%s\r\n"
+		"Content-Type: text/plain; charset=utf-8\r\n"
+		"Content-Encoding: gzip\r\n"
+		"Content-Length: %d\r\n"
+		"\r\n", x->path, x->host, x->port, length);
+	bool keepopen = true;
+	int status = -1;
+	if(sendAll(*fd, request, n) && sendAll(*fd, packed, length)) status = readResponse(*fd, body, max, &keepopen);
+	if(status < 0 || !keepopen) {
+		close(*fd);
+		*fd = -1;
+	}
+	return status;
+}
+
+void *influxMain(void *arg) {
+	struct influx *x = (struct influx *)arg;
+	char *batch = (char *)malloc(INFLUXBATCH);
+	size_t packedmax = compressBound(INFLUXBATCH) + 32;
+	uint8_t *packed = (uint8_t *)malloc(packedmax);
+	if(batch == NULL || packed == NULL) return NULL;
+	char body[256];
+	int fd = -1;
+	int backoff = 1;
+	bool retrying = false;
+	uint64_t reported = 0;
+	while(true) {
+		/* Wait for something to send, then a while for more to come
+		 * unless it's a retry, which has waited long enough already.
+		 */
+		pthread_mutex_lock(&x->lock);
+		while(x->length == 0) pthread_cond_wait(&x->added, &x->lock);
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += INFLUXINTERVAL;
+		while(!retrying && x->length < INFLUXBATCH) {
+			if(pthread_cond_timedwait(&x->added, &x->lock, &until) == ETIMEDOUT) break;
+		}
+		if(x->dropped != reported) {
+			fprintf(stderr, "influx: spool full, %llu lines thrown away so far\n", (unsigned long long)x->dropped);
+			reported = x->dropped;
+		}
+		/* As many whole lines as fit in a batch */
+		size_t length = x->length;
+		if(length > INFLUXBATCH) {
+			length = INFLUXBATCH;
+			while(length > 0 && x->spool[length - 1] != '\n') length--;
+		}
+		memcpy(batch, x->spool, length);
+		uint64_t from = x->base;
+		pthread_mutex_unlock(&x->lock);
+
+		int packedlength = gzipBatch(batch, length, packed, packedmax);
+		int status = packedlength < 0 ? -1 : postBatch(x, &fd, packed, packedlength, body, sizeof(body));
+		bool done = status >= 200 && status < 300;
+		if(status >= 400 && status < 500 && status != 429) {
+			fprintf(stderr, "influx: batch refused with %d, throwing it away: %s\n", status, body);
+			done = true;
+		}
+		if(done) {
+			/* Take it off the front, less anything already thrown away */
+			pthread_mutex_lock(&x->lock);
+			if(from + length > x->base) {
+				size_t cut = from + length - x->base;
+				memmove(x->spool, &x->spool[cut], x->length - cut);
+				x->length -= cut;
+				x->base += cut;
+			}
+			pthread_mutex_unlock(&x->lock);
+			backoff = 1;
+			retrying = false;
+			continue;
+		}
+		if(status < 0) fprintf(stderr, "influx: can't reach %s:%s, trying again in %ds\n", x->host, x->port, backoff);
+		else fprintf(stderr, "influx: %d from %s:%s, trying again in %ds\n", status, x->host, x->port, backoff);
+		sleep(backoff);
+		if(backoff < MAXBACKOFF) backoff *= 2;
+		retrying = true;
+	}
+	return NULL;
+}
+
+bool influxStart(struct influx *x) {
+	x->spool = (char *)malloc(INFLUXSPOOL);
+	if(x->spool == NULL) return false;
+	x->length = 0;
+	x->base = 0;
+	x->dropped = 0;
+	pthread_mutex_init(&x->lock, NULL);
+	pthread_cond_init(&x->added, NULL);
+	return pthread_create(&x->thread, NULL, influxMain, x) == 0;
+}
+
+/* Checks formatReading's rounding and signs, which don't go through printf
+ * and so aren't checked by it, and the escaping in influxPrefix.
+ */
+bool checkInflux() {
+	static const struct {
+		float temperature;
+		int64_t time;
+		const char *line;
+	} cases[] = {
+		{4.06, 1634567890123456LL, "4.06 1634567890123456\n"},
+		{4.0, 0, "4.00 0\n"},
+		{-0.5, 7, "-0.50 7\n"},
+		{-0.05, 7, "-0.05 7\n"},
+		{-0.004, 7, "0.00 7\n"}, // rounds to nothing, so no sign
+		{-0.006, 7, "-0.01 7\n"},
+		{0.125, 7, "0.13 7\n"}, // halves go away from zero
+		{-0.125, 7, "-0.13 7\n"},
+		{19.999, 7, "20.00 7\n"},
+		{-40.0, 7, "-40.00 7\n"},
+		{-100, 7, "-100.00 7\n"},
+		{85.0, -5, "85.00 0\n"}, // no negative times
+	};
+	char line[64];
+	char wanted[64];
+	bool ok = true;
+	size_t i;
+	for(i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		int n = formatReading(line, cases[i].time, cases[i].temperature);
+		if(n != (int)strlen(cases[i].line) || memcmp(line, cases[i].line, n) != 0) {
+			fprintf(stderr, "Influx: %g formatted as %.*s", cases[i].temperature, n, line);
+			ok = false;
+		}
+	}
+	/* Every temperature a DS1921L can read agrees with printf */
+	int half;
+	for(half = -80; half <= 170; half++) {
+		int n = formatReading(line, 1600000000000000LL + half, half / 2.0);
+		snprintf(wanted, sizeof(wanted), "%.2f %lld\n", half / 2.0, 1600000000000000LL + half);
+		ok = ok && n == (int)strlen(wanted) && memcmp(line, wanted, n) == 0;
+	}
+	uint8_t rom[8] = {0x21, 0xAB, 0xCD, 0xEF, 0x01, 0x23, 0x45, 0x67};
+	char prefix[INFLUXPREFIX];
+	const char *expected = "ibutton,device=21ABCDEF01234567,pi=cold\\ room\\,2\\=b temperature=";
+	ok = ok && influxPrefix(prefix, rom, "cold room,2=b") == (int)strlen(expected) && strcmp(prefix, expected) == 0;
+	fprintf(stderr, "Influx check: lines %s\n", ok ? "formatted right" : "formatted wrong");
+	return ok;
+}
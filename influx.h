@@ -0,0 +1,62 @@
+/* InfluxDB output for the DS1921L logger
+ *
+ * 2021 Angular Fish
+ *
+ * Readings are written as InfluxDB line protocol:
+ * ibutton,device=<id>,pi=<name> temperature=4.06 1634567890123456
+ * with the time in microseconds (precision=u). Everything up to the value
+ * is the same for every reading from a device, so it's made once per device
+ * and only the value and the time are formatted for each reading.
+ *
+ * Lines are added to a spool in memory of at most INFLUXSPOOL bytes; if
+ * InfluxDB is away long enough for it to fill up the oldest lines are
+ * thrown away to make room. A thread of its own gathers up to INFLUXBATCH
+ * bytes of lines every INFLUXINTERVAL seconds, gzips them and POSTs them to
+ * /write?db=<database>&precision=u over a connection kept open between
+ * writes. If the connection fails, or InfluxDB says it's busy or broken
+ * (429 or 5xx), the same batch is tried again after waiting 1, 2, 4...
+ * up to 60 seconds. A batch InfluxDB refuses outright (any other 4xx) would
+ * never go in, so it's thrown away and the reason printed.
+ */
+
+#ifndef INFLUX_H
+#define INFLUX_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define INFLUXSPOOL (4 << 20)
+#define INFLUXBATCH (256 << 10)
+#define INFLUXINTERVAL 5
+#define INFLUXPREFIX 128
+
+struct influx {
+	char host[256];
+	char port[16];
+	char path[512];
+	char *spool; // whole lines
+	size_t length;
+	uint64_t base; // how many bytes have ever been taken off the front
+	uint64_t dropped; // lines thrown away because the spool was full
+	pthread_mutex_t lock;
+	pthread_cond_t added;
+	pthread_t thread;
+};
+
+/* -I host:port/database */
+bool influxParse(struct influx *x, const char *arg);
+
+/* Starts the thread that sends the spool */
+bool influxStart(struct influx *x);
+
+/* Makes the part of a line that's the same for every reading from a device */
+int influxPrefix(char *prefix, const uint8_t *rom, const char *name);
+
+/* Adds a reading to the spool */
+void influxAdd(struct influx *x, const char *prefix, int prefixlength, int64_t time, float temperature);
+
+/* Checks the lines made against known ones, for -V */
+bool checkInflux();
+
+#endif
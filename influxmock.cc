@@ -0,0 +1,203 @@
+/* Stand-in for InfluxDB, for trying out ibutton -I without one
+ *
+ * 2021 Angular Fish
+ *
+ * Listens for line protocol POSTed to /write, the way InfluxDB does (see
+ * influx.h), unpacks it if it's gzipped and checks every line has a
+ * measurement, fields and a time. Good batches get a 204, bad ones a 400
+ * saying which line was wrong. With -f n every nth batch gets a 503 instead,
+ * to see that ibutton holds on to it and tries again. Each batch is
+ * summed up on stdout, with every line too if -v is given.
+ *
+ * It handles one connection at a time, which is all ibutton needs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <zlib.h>
+#include "forward.h"
+
+#define HEADERMAX 8192
+#define BODYMAX (16 << 20)
+
+bool verbose = false;
+int failevery = 0;
+long requests = 0;
+long long lines = 0;
+
+/* A line is measurement[,tags] fields time, with backslashes in front of
+ * any spaces that are part of a name or value.
+ */
+bool checkLine(const char *line, size_t length) {
+	int spaces[3];
+	int count = 0;
+	size_t i;
+	for(i = 0; i < length; i++) {
+		if(line[i] == '\\') {
+			i++;
+			continue;
+		}
+		if(line[i] == ' ') {
+			if(count == 2) return false;
+			spaces[count++] = i;
+		}
+	}
+	if(count != 2 || spaces[0] == 0) return false;
+	if(memchr(&line[spaces[0] + 1], '=', spaces[1] - spaces[0] - 1) == NULL) return false;
+	if((size_t)spaces[1] + 1 == length) return false;
+	for(i = spaces[1] + 1; i < length; i++) {
+		if(!isdigit((unsigned char)line[i])) return false;
+	}
+	return true;
+}
+
+/* Checks every line, returns how many or -1 with the bad one in error */
+long checkBatch(const char *text, size_t length, char *error, size_t max) {
+	long count = 0;
+	size_t at = 0;
+	while(at < length) {
+		const char *newline = (const char *)memchr(&text[at], '\n', length - at);
+		size_t end = newline == NULL ? length : newline - text;
+		if(end > at) {
+			if(!checkLine(&text[at], end - at)) {
+				snprintf(error, max, "bad line %ld: %.*s", count + 1, (int)(end - at > 80 ? 80 : end - at), &text[at]);
+				return -1;
+			}
+			if(verbose) printf("%.*s\n", (int)(end - at), &text[at]);
+			count++;
+		}
+		at = end + 1;
+	}
+	return count;
+}
+
+bool gunzip(const uint8_t *in, size_t length, char *out, size_t max, size_t *outlength) {
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	if(inflateInit2(&z, 15 + 32) != Z_OK) return false;
+	z.next_in = (Bytef *)in;
+	z.avail_in = length;
+	z.next_out = (Bytef *)out;
+	z.avail_out = max;
+	int result = inflate(&z, Z_FINISH);
+	*outlength = max - z.avail_out;
+	inflateEnd(&z);
+	return result == Z_STREAM_END;
+}
+
+bool reply(int fd, int status, const char *reason, const char *body) {
+	char response[512];
+	int n = snprintf(response, sizeof(response), "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nContent-Length: %d\r\n\r\n%s",
+		status, reason, (int)strlen(body), body);
+	return sendAll(fd, response, n);
+}
+
+/* Handles one request, returns false when the connection is finished with */
+bool handleRequest(int fd, uint8_t *body, char *text) {
+	char headers[HEADERMAX];
+	size_t have = 0;
+	char *end = NULL;
+	while(end == NULL) {
+		if(have == sizeof(headers) - 1) return false;
+		ssize_t n = recv(fd, &headers[have], sizeof(headers) - 1 - have, 0);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) return false;
+		have += n;
+		headers[have] = 0;
+		end = strstr(headers, "\r\n\r\n");
+	}
+	*end = 0;
+	char method[16], path[1024];
+	if(sscanf(headers, "%15s %1023s", method, path) != 2) return false;
+	long length = 0;
+	bool gzipped = false;
+	char *line;
+	for(line = strstr(headers, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n")) {
+		if(strncasecmp(line + 2, "content-length:", 15) == 0) length = atol(line + 17);
+		if(strncasecmp(line + 2, "content-encoding: gzip", 22) == 0) gzipped = true;
+	}
+	if(length < 0 || length > BODYMAX) return false;
+	size_t extra = have - (end + 4 - headers);
+	if(extra > (size_t)length) return false; // pipelined requests aren't handled
+	memcpy(body, end + 4, extra);
+	if(!recvAll(fd, &body[extra], length - extra)) return false;
+	requests++;
+
+	if(strcmp(method, "POST") != 0 || strncmp(path, "/write?", 7) != 0 || strstr(path, "db=") == NULL) {
+		return reply(fd, 404, "Not Found", "{\"error\":\"POST to /write?db=...\"}");
+	}
+	if(failevery > 0 && requests % failevery == 0) {
+		printf("request %ld: %ld bytes, answered 503\n", requests, length);
+		fflush(stdout);
+		return reply(fd, 503, "Service Unavailable", "");
+	}
+	size_t textlength = length;
+	if(gzipped) {
+		if(!gunzip(body, length, text, BODYMAX, &textlength)) return reply(fd, 400, "Bad Request", "{\"error\":\"bad gzip\"}");
+	} else {
+		memcpy(text, body, length);
+	}
+	char error[160];
+	long count = checkBatch(text, textlength, error, sizeof(error));
+	if(count < 0) {
+		printf("request %ld: %s\n", requests, error);
+		fflush(stdout);
+		char json[400] = "{\"error\":\"";
+		size_t n = strlen(json);
+		const char *c;
+		for(c = error; *c != 0; c++) {
+			if(*c == '"' || *c == '\\') json[n++] = '\\';
+			json[n++] = *c;
+		}
+		strcpy(&json[n], "\"}");
+		return reply(fd, 400, "Bad Request", json);
+	}
+	lines += count;
+	printf("request %ld: %ld bytes (%zu unpacked), %ld lines, %lld so far\n", requests, length, textlength, count, lines);
+	fflush(stdout);
+	return reply(fd, 204, "No Content", "");
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	int port = 8086;
+	while((opt = getopt(argc, argv, "p:f:v")) != -1) {
+		switch(opt) {
+		case 'p': port = atoi(optarg); break;
+		case 'f': failevery = atoi(optarg); break;
+		case 'v': verbose = true; break;
+		default:
+			fprintf(stderr, "usage: %s [-p port] [-f n] [-v]\n", argv[0]);
+			return 1;
+		}
+	}
+	int listener = socket(AF_INET6, SOCK_STREAM, 0);
+	int one = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	struct sockaddr_in6 address;
+	memset(&address, 0, sizeof(address));
+	address.sin6_family = AF_INET6;
+	address.sin6_port = htons(port);
+	address.sin6_addr = in6addr_any;
+	if(bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 4) != 0) {
+		fprintf(stderr, "Can't listen on port %d\n", port);
+		return 1;
+	}
+	uint8_t *body = (uint8_t *)malloc(BODYMAX);
+	char *text = (char *)malloc(BODYMAX);
+	if(body == NULL || text == NULL) return 1;
+	fprintf(stderr, "Listening on port %d\n", port);
+	while(true) {
+		int fd = accept(listener, NULL, NULL);
+		if(fd < 0) continue;
+		while(handleRequest(fd, body, text));
+		close(fd);
+	}
+}
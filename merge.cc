@@ -0,0 +1,268 @@
+/* Merges the readings from many archives into one timeline
+ *
+ * 2021 Angular Fish
+ *
+ * Takes archive directories (or single <id>.raw files from them, see
+ * archive.h) and writes every reading from all of them in time order to one
+ * file of forwardrecords (see forward.h), which carry the device's ID with
+ * each reading. The raw files are already in time order, so this is a k-way
+ * merge: a heap holds the next reading from each file and the earliest is
+ * taken off the top each time.
+ *
+ * To use every core the span of time is cut into one part per thread at
+ * times picked from a sample of all the readings, so the parts are about the
+ * same size. Where each part starts in every file is found by binary search,
+ * and so where its output goes is known before any merging starts. Every
+ * thread then merges its own part straight into the output. Inputs and
+ * output are all memory mapped.
+ *
+ * Every reading is kept, so merging an archive with another that has some
+ * of the same readings gives those readings twice.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "archive.h"
+#include "forward.h"
+
+#define MAXTHREADS 64
+#define SAMPLESPERFILE 64 // readings per file used to pick where the parts start
+
+struct input {
+	uint8_t rom[8];
+	const struct archiverecord *records;
+	int64_t count;
+	size_t size; // of the mapping
+};
+
+struct partition {
+	int64_t from; // times in the part, from <= time < to
+	int64_t to;
+	int64_t *starts; // first record in each input
+	int64_t *ends;
+	int64_t offset; // of the part's first record in the output
+	int64_t count;
+	pthread_t thread;
+};
+
+struct input *inputs = NULL;
+int inputcount = 0;
+int inputcapacity = 0;
+struct forwardrecord *output;
+
+bool addInput(const char *path) {
+	const char *name = strrchr(path, '/');
+	name = name == NULL ? path : name + 1;
+	char hex[17];
+	if(strlen(name) != 20 || strcmp(&name[16], ".raw") != 0) return false;
+	memcpy(hex, name, 16);
+	hex[16] = 0;
+	uint8_t rom[8];
+	if(!hexToROM(hex, rom)) return false;
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) return false;
+	struct stat st;
+	fstat(fd, &st);
+	int64_t count = st.st_size / sizeof(struct archiverecord);
+	if(count == 0) {
+		close(fd);
+		return true;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) return false;
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	if(inputcount == inputcapacity) {
+		inputcapacity = inputcapacity ? inputcapacity * 2 : 64;
+		inputs = (struct input *)realloc(inputs, inputcapacity * sizeof(struct input));
+		if(inputs == NULL) return false;
+	}
+	struct input *in = &inputs[inputcount++];
+	memcpy(in->rom, rom, 8);
+	in->records = (const struct archiverecord *)map;
+	in->count = count;
+	in->size = st.st_size;
+	return true;
+}
+
+/* A directory means every raw file in it */
+bool addPath(const char *path) {
+	struct stat st;
+	if(stat(path, &st) != 0) return false;
+	if(!S_ISDIR(st.st_mode)) return addInput(path);
+	DIR *dir = opendir(path);
+	if(dir == NULL) return false;
+	struct dirent *entry;
+	char file[PATH_MAX];
+	while((entry = readdir(dir)) != NULL) {
+		size_t length = strlen(entry->d_name);
+		if(length != 20 || strcmp(&entry->d_name[16], ".raw") != 0) continue;
+		snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+		if(!addInput(file)) fprintf(stderr, "Skipping %s\n", file);
+	}
+	closedir(dir);
+	return true;
+}
+
+/* Index of the first record at or after time */
+int64_t firstAtOrAfter(const struct input *in, int64_t time) {
+	int64_t low = 0;
+	int64_t high = in->count;
+	while(low < high) {
+		int64_t middle = (low + high) / 2;
+		if(in->records[middle].time < time) low = middle + 1;
+		else high = middle;
+	}
+	return low;
+}
+
+int compareTimes(const void *a, const void *b) {
+	int64_t x = *(const int64_t *)a;
+	int64_t y = *(const int64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Heap of inputs ordered by their next reading's time, then by input so
+ * the output is the same every run.
+ */
+bool before(const struct partition *p, int a, int b) {
+	int64_t ta = inputs[a].records[p->starts[a]].time;
+	int64_t tb = inputs[b].records[p->starts[b]].time;
+	return ta < tb || (ta == tb && a < b);
+}
+
+void siftDown(const struct partition *p, int *heap, int size, int i) {
+	while(true) {
+		int smallest = i;
+		int left = i * 2 + 1;
+		int right = left + 1;
+		if(left < size && before(p, heap[left], heap[smallest])) smallest = left;
+		if(right < size && before(p, heap[right], heap[smallest])) smallest = right;
+		if(smallest == i) return;
+		int swap = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = swap;
+		i = smallest;
+	}
+}
+
+void *mergePartition(void *arg) {
+	struct partition *p = (struct partition *)arg;
+	int *heap = (int *)malloc(inputcount * sizeof(int));
+	if(heap == NULL) return NULL;
+	int size = 0;
+	int i;
+	for(i = 0; i < inputcount; i++) {
+		if(p->starts[i] < p->ends[i]) heap[size++] = i;
+	}
+	for(i = size / 2 - 1; i >= 0; i--) siftDown(p, heap, size, i);
+	struct forwardrecord *out = &output[p->offset];
+	while(size > 0) {
+		int top = heap[0];
+		const struct archiverecord *r = &inputs[top].records[p->starts[top]];
+		out->time = r->time;
+		memcpy(out->rom, inputs[top].rom, 8);
+		out->temperature = r->temperature;
+		out->reserved = 0;
+		out++;
+		if(++p->starts[top] == p->ends[top]) heap[0] = heap[--size];
+		siftDown(p, heap, size, 0);
+	}
+	free(heap);
+	return NULL;
+}
+
+double elapsed(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *outpath = NULL;
+	while((opt = getopt(argc, argv, "o:t:")) != -1) {
+		switch(opt) {
+		case 'o': outpath = optarg; break;
+		case 't': threads = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s -o timeline [-t threads] archive|file.raw...\n", argv[0]);
+			return 1;
+		}
+	}
+	if(outpath == NULL || optind == argc) {
+		fprintf(stderr, "usage: %s -o timeline [-t threads] archive|file.raw...\n", argv[0]);
+		return 1;
+	}
+	if(threads < 1) threads = 1;
+	if(threads > MAXTHREADS) threads = MAXTHREADS;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int i, j;
+	for(i = optind; i < argc; i++) {
+		if(!addPath(argv[i])) {
+			fprintf(stderr, "Can't read %s\n", argv[i]);
+			return 1;
+		}
+	}
+	int64_t total = 0;
+	for(i = 0; i < inputcount; i++) total += inputs[i].count;
+
+	/* Pick where the parts start from an even sample of every file */
+	int64_t *samples = (int64_t *)malloc((inputcount * SAMPLESPERFILE + 1) * sizeof(int64_t));
+	int samplecount = 0;
+	for(i = 0; i < inputcount; i++) {
+		int n = inputs[i].count < SAMPLESPERFILE ? inputs[i].count : SAMPLESPERFILE;
+		for(j = 0; j < n; j++) samples[samplecount++] = inputs[i].records[inputs[i].count * j / n].time;
+	}
+	qsort(samples, samplecount, sizeof(int64_t), compareTimes);
+	struct partition parts[MAXTHREADS];
+	int64_t offset = 0;
+	for(i = 0; i < threads; i++) {
+		struct partition *p = &parts[i];
+		p->from = i == 0 ? INT64_MIN : samples[(int64_t)samplecount * i / threads];
+		p->to = i == threads - 1 ? INT64_MAX : samples[(int64_t)samplecount * (i + 1) / threads];
+		p->starts = (int64_t *)malloc(inputcount * sizeof(int64_t));
+		p->ends = (int64_t *)malloc(inputcount * sizeof(int64_t));
+		if(p->starts == NULL || p->ends == NULL) return 1;
+		p->offset = offset;
+		p->count = 0;
+		for(j = 0; j < inputcount; j++) {
+			p->starts[j] = p->from == INT64_MIN ? 0 : firstAtOrAfter(&inputs[j], p->from);
+			p->ends[j] = p->to == INT64_MAX ? inputs[j].count : firstAtOrAfter(&inputs[j], p->to);
+			p->count += p->ends[j] - p->starts[j];
+		}
+		offset += p->count;
+	}
+	free(samples);
+
+	int fd = open(outpath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	size_t size = total * sizeof(struct forwardrecord);
+	if(fd < 0 || ftruncate(fd, size) != 0) {
+		fprintf(stderr, "Can't write %s\n", outpath);
+		return 1;
+	}
+	if(size > 0) {
+		output = (struct forwardrecord *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if(output == MAP_FAILED) {
+			fprintf(stderr, "Can't map %s\n", outpath);
+			return 1;
+		}
+		for(i = 0; i < threads; i++) pthread_create(&parts[i].thread, NULL, mergePartition, &parts[i]);
+		for(i = 0; i < threads; i++) pthread_join(parts[i].thread, NULL);
+		munmap(output, size);
+	}
+	close(fd);
+	double seconds = elapsed(&start);
+	fprintf(stderr, "Merged %lld readings from %d files with %d threads in %.2fs, %.0f MB/s\n", (long long)total, inputcount, threads, seconds, size / seconds / 1e6);
+	return 0;
+}
@@ -0,0 +1,218 @@
+/* DS1921L mission images
+ *
+ * 2021 Angular Fish
+ *
+ * See mission.h.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "mission.h"
+
+uint8_t crc8(const uint8_t *data, int length) {
+	uint8_t crc = 0;
+	int i, j;
+	for(i = 0; i < length; i++) {
+		uint8_t byte = data[i];
+		for(j = 0; j < 8; j++) {
+			uint8_t mix = (crc ^ byte) & 0x01;
+			crc >>= 1;
+			if(mix) crc ^= 0x8C;
+			byte >>= 1;
+		}
+	}
+	return crc;
+}
+
+uint16_t crc16(const uint8_t *data, size_t length) {
+	uint16_t crc = 0;
+	size_t i;
+	int j;
+	for(i = 0; i < length; i++) {
+		crc ^= data[i];
+		for(j = 0; j < 8; j++) {
+			if(crc & 1) crc = (crc >> 1) ^ 0xA001;
+			else crc >>= 1;
+		}
+	}
+	return crc;
+}
+
+uint16_t readCRC(uint16_t address, const uint8_t *data, int length) {
+	uint8_t buffer[3 + 32];
+	if(length > 32) return 0;
+	buffer[0] = 0xA5;
+	buffer[1] = address & 0xFF;
+	buffer[2] = address >> 8;
+	memcpy(&buffer[3], data, length);
+	return ~crc16(buffer, 3 + length);
+}
+
+uint8_t fromBCD(uint8_t bcdbyte) {
+	return (bcdbyte >> 4) * 10 + (bcdbyte & 0x0F);
+}
+
+int hoursFromBCD(uint8_t hours) {
+	if(hours & 0x40) return fromBCD(hours & 0x1F) % 12 + (hours & 0x20 ? 12 : 0);
+	return fromBCD(hours & 0x3F);
+}
+
+bool missionPage(uint16_t address) {
+	return (address >= REGISTERSTART && address < RESERVED1) || (address >= HISTSTART && address < RESERVED2) || (address >= DATALOGSTART && address < RESERVED3);
+}
+
+void missionTrailer(const uint8_t *rom, const uint16_t *crcs, struct missiontrailer *trailer) {
+	memset(trailer, 0, sizeof(*trailer));
+	memcpy(trailer->rom, rom, 8);
+	int i;
+	for(i = 0; i < MISSIONPAGES; i++) {
+		if(!missionPage(i * 32)) continue;
+		trailer->crc[i][0] = crcs[i] & 0xFF;
+		trailer->crc[i][1] = crcs[i] >> 8;
+	}
+}
+
+bool validBCD(uint8_t byte) {
+	return (byte & 0x0F) <= 9 && (byte >> 4) <= 9;
+}
+
+const char *missionCheck(const uint8_t *file, size_t length, uint8_t *rom, bool *hasrom) {
+	*hasrom = false;
+	if(length != MEMSIZE && length != MISSIONFILESIZE) return "wrong size";
+	if(length == MISSIONFILESIZE) {
+		const struct missiontrailer *trailer = (const struct missiontrailer *)&file[MEMSIZE];
+		if(crc8(trailer->rom, 7) != trailer->rom[7] || trailer->rom[0] != DS1921FAMILY) return "bad ROM ID";
+		int i;
+		for(i = 0; i < MISSIONPAGES; i++) {
+			if(!missionPage(i * 32)) continue;
+			if(readCRC(i * 32, &file[i * 32], 32) != (trailer->crc[i][0] | trailer->crc[i][1] << 8)) return "bad CRC";
+		}
+		memcpy(rom, trailer->rom, 8);
+		*hasrom = true;
+	}
+	uint32_t count = file[MISSIONSAMPLES] | file[MISSIONSAMPLES + 1] << 8 | file[MISSIONSAMPLES + 2] << 16;
+	if(count == 0) return NULL; // nothing to date
+	const uint8_t *stamp = &file[MISSIONSTAMP];
+	if(!validBCD(stamp[0] & 0x7F) || !validBCD(stamp[1] & 0x1F) || !validBCD(stamp[2] & 0x3F) || !validBCD(stamp[3] & 0x1F) || !validBCD(stamp[4])) return "mission time isn't BCD";
+	int minute = fromBCD(stamp[0] & 0x7F);
+	int hour = hoursFromBCD(stamp[1]);
+	int day = fromBCD(stamp[2] & 0x3F);
+	int month = fromBCD(stamp[3] & 0x1F);
+	if(minute > 59 || hour > 23 || day < 1 || day > 31 || month < 1 || month > 12) return "mission time out of range";
+	if(file[SAMPLERATE] == 0) return "no sample rate";
+	return NULL;
+}
+
+int decodeMission(const uint8_t *image, void (*fn)(int64_t time, float temperature, void *arg), void *arg) {
+	struct tm start;
+	memset(&start, 0, sizeof(start));
+	start.tm_min = fromBCD(image[MISSIONSTAMP] & 0x7F);
+	start.tm_hour = hoursFromBCD(image[MISSIONSTAMP + 1]);
+	start.tm_mday = fromBCD(image[MISSIONSTAMP + 2] & 0x3F);
+	start.tm_mon = fromBCD(image[MISSIONSTAMP + 3] & 0x1F) - 1;
+	start.tm_year = fromBCD(image[MISSIONSTAMP + 4]) + 100;
+	start.tm_isdst = -1;
+	int64_t starttime = (int64_t)mktime(&start) * 1000000;
+	int64_t rate = (int64_t)image[SAMPLERATE] * 60 * 1000000;
+	uint32_t count = image[MISSIONSAMPLES] | image[MISSIONSAMPLES + 1] << 8 | image[MISSIONSAMPLES + 2] << 16;
+	if(rate == 0) return 0;
+	uint32_t first = count > DATALOGSIZE ? count - DATALOGSIZE : 0;
+	uint32_t i;
+	for(i = first; i < count; i++) {
+		fn(starttime + i * rate, image[DATALOGSTART + i % DATALOGSIZE] / 2.0 - 40.0, arg);
+	}
+	return count - first;
+}
+
+/* Counts the samples decodeMission hands out and checks each against the
+ * datalog byte it should have come from.
+ */
+struct missioncheck {
+	const uint8_t *image;
+	int64_t start; // of the first sample still in the datalog
+	int64_t rate;
+	uint32_t index;
+	int count;
+	bool ok;
+};
+
+void checkSample(int64_t time, float temperature, void *arg) {
+	struct missioncheck *c = (struct missioncheck *)arg;
+	uint8_t raw = c->image[DATALOGSTART + c->index % DATALOGSIZE];
+	if(time != c->start + c->count * c->rate || temperature != raw / 2.0 - 40.0) c->ok = false;
+	c->index++;
+	c->count++;
+}
+
+/* Builds a mission image the way a device fills one, with a trailer of the
+ * CRCs it would send, and checks decoding and each way checking should
+ * fail. The CRCs are checked against their published check values first.
+ */
+bool checkMission() {
+	static uint8_t file[MISSIONFILESIZE];
+	bool ok = crc8((const uint8_t *)"123456789", 9) == 0xA1 && crc16((const uint8_t *)"123456789", 9) == 0xBB3D;
+	uint8_t rom[8] = {DS1921FAMILY, 0x10, 0x20, 0x30, 0x40, 0x50, 0x60, 0};
+	rom[7] = crc8(rom, 7);
+	memset(file, 0, sizeof(file));
+	int i;
+	for(i = 0; i < DATALOGSIZE; i++) file[DATALOGSTART + i] = (i * 7 + 3) & 0xFF;
+	file[SAMPLERATE] = 10;
+	uint8_t stamp[] = {0x26, 0x40 | 0x20 | 0x09, 0x14, 0x03, 0x21}; // 9:26 PM, 14/3/21 in 12 hour mode
+	memcpy(&file[MISSIONSTAMP], stamp, sizeof(stamp));
+	uint32_t count = DATALOGSIZE + 252; // wrapped round
+	file[MISSIONSAMPLES] = count & 0xFF;
+	file[MISSIONSAMPLES + 1] = (count >> 8) & 0xFF;
+	file[MISSIONSAMPLES + 2] = count >> 16;
+	/* The CRC covers the command, the address and the data to the end of
+	 * the page, and is sent inverted
+	 */
+	uint16_t address = DATALOGSTART + 7;
+	uint8_t sent[3 + 25] = {0xA5, (uint8_t)(address & 0xFF), (uint8_t)(address >> 8)};
+	memcpy(&sent[3], &file[address], 25);
+	ok = ok && readCRC(address, &file[address], 25) == (uint16_t)~crc16(sent, sizeof(sent));
+	uint16_t crcs[MISSIONPAGES];
+	for(i = 0; i < MISSIONPAGES; i++) crcs[i] = readCRC(i * 32, &file[i * 32], 32);
+	missionTrailer(rom, crcs, (struct missiontrailer *)&file[MEMSIZE]);
+
+	struct tm start;
+	memset(&start, 0, sizeof(start));
+	start.tm_min = 26;
+	start.tm_hour = 21;
+	start.tm_mday = 14;
+	start.tm_mon = 2;
+	start.tm_year = 121;
+	start.tm_isdst = -1;
+	struct missioncheck c;
+	memset(&c, 0, sizeof(c));
+	c.image = file;
+	c.rate = 10 * 60 * 1000000LL;
+	c.start = (int64_t)mktime(&start) * 1000000 + 252 * c.rate;
+	c.index = 252;
+	c.ok = true;
+	ok = ok && decodeMission(file, checkSample, &c) == DATALOGSIZE && c.count == DATALOGSIZE && c.ok;
+
+	uint8_t got[8];
+	bool hasrom;
+	ok = ok && missionCheck(file, MISSIONFILESIZE, got, &hasrom) == NULL && hasrom && memcmp(got, rom, 8) == 0;
+	ok = ok && missionCheck(file, MEMSIZE, got, &hasrom) == NULL && !hasrom; // from before the trailer
+	ok = ok && missionCheck(file, MEMSIZE + 1, got, &hasrom) != NULL;
+	file[SRAMSTART] ^= 1; // not downloaded, so not covered
+	ok = ok && missionCheck(file, MISSIONFILESIZE, got, &hasrom) == NULL;
+	file[DATALOGSTART + 1000] ^= 1;
+	const char *problem = missionCheck(file, MISSIONFILESIZE, got, &hasrom);
+	ok = ok && problem != NULL && strcmp(problem, "bad CRC") == 0;
+	file[DATALOGSTART + 1000] ^= 1;
+	file[MEMSIZE + 7] ^= 1; // the ROM ID's CRC
+	problem = missionCheck(file, MISSIONFILESIZE, got, &hasrom);
+	ok = ok && problem != NULL && strcmp(problem, "bad ROM ID") == 0;
+	file[MISSIONSTAMP + 3] = 0x13; // month 13
+	problem = missionCheck(file, MEMSIZE, got, &hasrom);
+	ok = ok && problem != NULL && strcmp(problem, "mission time out of range") == 0;
+	file[MISSIONSTAMP + 3] = 0x1A;
+	problem = missionCheck(file, MEMSIZE, got, &hasrom);
+	ok = ok && problem != NULL && strcmp(problem, "mission time isn't BCD") == 0;
+
+	fprintf(stderr, "Mission check: %s\n", ok ? "decodes and checks out" : "doesn't decode or check out");
+	return ok;
+}
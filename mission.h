@@ -0,0 +1,94 @@
+/* DS1921L mission images
+ *
+ * 2021 Angular Fish
+ *
+ * A downloaded mission is a copy of the device's memory. The registers say
+ * when the mission started, how many minutes apart the samples are and how
+ * many have been taken. The datalog holds the last 2048 of them, one byte
+ * each, wrapping around if the mission has gone on longer than that.
+ *
+ * Mission files (-m) are the image followed by a trailer with the ROM ID of
+ * the device it came from and, for every page that was downloaded, the CRC16
+ * the device sent along with it (pages are read with READ MEMORY WITH CRC).
+ * The CRCs are the device's, not worked out from what arrived, so a page
+ * misread off the bus fails the check just as one damaged on disk later
+ * does, and a file can be checked and put in the archive long after it was
+ * downloaded. Files from before the trailer are just the image.
+ */
+
+#ifndef MISSION_H
+#define MISSION_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Memory mapping for the chip */
+#define SRAMSTART 0x0000
+#define REGISTERSTART 0x0200
+#define ALARMSTART 0x0220
+#define RESERVED1 0x0280
+#define HISTSTART 0x0800
+#define RESERVED2 0x0880
+#define DATALOGSTART 0x1000
+#define RESERVED3 0x1800
+#define MEMSIZE 0x1800
+
+/* Mission registers */
+#define SAMPLERATE 0x020D
+#define MISSIONSTAMP 0x0215
+#define MISSIONSAMPLES 0x021A
+#define DATALOGSIZE 2048
+
+#define DS1921FAMILY 0x21
+
+#define MISSIONPAGES (MEMSIZE / 32)
+
+struct missiontrailer {
+	uint8_t rom[8];
+	uint8_t crc[MISSIONPAGES][2]; // from the device for each downloaded page, low byte first
+};
+
+#define MISSIONFILESIZE (MEMSIZE + sizeof(struct missiontrailer))
+
+/* Dallas/Maxim CRC8, the last byte of the ROM ID */
+uint8_t crc8(const uint8_t *data, int length);
+
+/* Dallas/Maxim CRC16, as the DS1921L uses for its memory */
+uint16_t crc16(const uint8_t *data, size_t length);
+
+/* The CRC16 a DS1921L sends after the first page of a READ MEMORY WITH CRC
+ * (0xA5) from address, where data is the length bytes from address to the
+ * end of the page. It covers the command and address too, and comes inverted.
+ */
+uint16_t readCRC(uint16_t address, const uint8_t *data, int length);
+
+uint8_t fromBCD(uint8_t bcdbyte);
+
+/* Hours register in either 12 or 24 hour mode */
+int hoursFromBCD(uint8_t hours);
+
+/* Is the 32 byte page at address one that a download reads? The registers
+ * and alarms, the histogram and the datalog are, the rest isn't.
+ */
+bool missionPage(uint16_t address);
+
+/* Fills the trailer for a download from a device, with crcs the CRC16 the
+ * device sent with each page (indexed by address / 32, see readCRC)
+ */
+void missionTrailer(const uint8_t *rom, const uint16_t *crcs, struct missiontrailer *trailer);
+
+/* Checks a mission file of length bytes: the trailer's CRCs if it has one,
+ * and that the mission registers hold a real date. Fills rom from the
+ * trailer if there is one. Returns NULL if it's fine or what's wrong.
+ */
+const char *missionCheck(const uint8_t *file, size_t length, uint8_t *rom, bool *hasrom);
+
+/* Calls fn with the time (microseconds since the epoch) and temperature of
+ * every sample still in the datalog. Returns the number of samples.
+ */
+int decodeMission(const uint8_t *image, void (*fn)(int64_t time, float temperature, void *arg), void *arg);
+
+/* Checks decoding and checking against a made up mission, for -V */
+bool checkMission();
+
+#endif
@@ -0,0 +1,319 @@
+/* Puts a season's worth of mission files into the archive
+ *
+ * 2021 Angular Fish
+ *
+ * Takes any number of mission files (from ibutton -m, see mission.h),
+ * checks each one's CRCs and registers, works out the time of every sample
+ * from the mission registers and adds them to an archive (see archive.h).
+ *
+ * It goes in two rounds, both shared out between a thread per core:
+ * 1. Read, check and decode every file
+ * 2. Add each device's samples to the archive, its missions oldest first
+ * The second round goes by device so no two threads ever write to the same
+ * device's files, and each thread has its own handle on the archive.
+ *
+ * Files take different amounts of time (a bad one stops early, a short
+ * mission has few samples, a device can have one mission or fifty) so
+ * instead of handing each thread a fixed share, every thread starts with
+ * its own queue and takes work from the far end of another thread's queue
+ * when its own runs out.
+ *
+ * Files from before mission files had a trailer have no ROM ID in them, so
+ * for those the file name has to start with the ID in hex. They have no CRC
+ * either, so only their registers can be checked, and each one is listed as
+ * it's accepted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "archive.h"
+#include "mission.h"
+
+#define MAXTHREADS 64
+
+/* Work stealing
+ * Each thread's queue is a run of item numbers. The owner takes from the
+ * back, thieves from the front, so they only meet over the last item. There
+ * are no new items once a round starts, so every queue being empty means
+ * the round is over.
+ */
+struct workqueue {
+	pthread_mutex_t lock;
+	int *items;
+	int front;
+	int back; // one past the last
+};
+
+struct pool {
+	int threads;
+	struct workqueue queues[MAXTHREADS];
+	void (*work)(int item, int thread);
+	int steals;
+};
+
+struct worker {
+	struct pool *pool;
+	int index;
+	pthread_t thread;
+};
+
+bool takeOwn(struct workqueue *q, int *item) {
+	pthread_mutex_lock(&q->lock);
+	bool got = q->back > q->front;
+	if(got) *item = q->items[--q->back];
+	pthread_mutex_unlock(&q->lock);
+	return got;
+}
+
+bool steal(struct workqueue *q, int *item) {
+	pthread_mutex_lock(&q->lock);
+	bool got = q->back > q->front;
+	if(got) *item = q->items[q->front++];
+	pthread_mutex_unlock(&q->lock);
+	return got;
+}
+
+void *poolMain(void *arg) {
+	struct worker *w = (struct worker *)arg;
+	struct pool *p = w->pool;
+	int item;
+	while(true) {
+		if(takeOwn(&p->queues[w->index], &item)) {
+			p->work(item, w->index);
+			continue;
+		}
+		/* Try everyone else, starting with the next thread along */
+		int i;
+		bool got = false;
+		for(i = 1; i < p->threads && !got; i++) got = steal(&p->queues[(w->index + i) % p->threads], &item);
+		if(!got) return NULL;
+		__atomic_add_fetch(&p->steals, 1, __ATOMIC_RELAXED);
+		p->work(item, w->index);
+	}
+}
+
+/* Runs work on items 0 to count - 1, dealt out round the threads to begin
+ * with. Returns how many were stolen.
+ */
+int poolRun(int threads, int count, void (*work)(int item, int thread)) {
+	struct pool p;
+	struct worker workers[MAXTHREADS];
+	int i;
+	p.threads = threads;
+	p.work = work;
+	p.steals = 0;
+	for(i = 0; i < threads; i++) {
+		struct workqueue *q = &p.queues[i];
+		pthread_mutex_init(&q->lock, NULL);
+		q->items = (int *)malloc((count / threads + 1) * sizeof(int));
+		q->front = 0;
+		q->back = 0;
+	}
+	for(i = 0; i < count; i++) {
+		struct workqueue *q = &p.queues[i % threads];
+		q->items[q->back++] = i;
+	}
+	for(i = 0; i < threads; i++) {
+		workers[i].pool = &p;
+		workers[i].index = i;
+		pthread_create(&workers[i].thread, NULL, poolMain, &workers[i]);
+	}
+	for(i = 0; i < threads; i++) pthread_join(workers[i].thread, NULL);
+	for(i = 0; i < threads; i++) {
+		free(p.queues[i].items);
+		pthread_mutex_destroy(&p.queues[i].lock);
+	}
+	return p.steals;
+}
+
+/* One mission file */
+struct dump {
+	const char *path;
+	const char *error; // NULL if it was fine
+	bool unchecked; // no trailer, so no CRC to check it against
+	uint8_t rom[8];
+	int64_t *times;
+	float *temperatures;
+	int count;
+	int added; // to the archive, not counting ones it already had
+	int failed; // couldn't be written to the archive
+};
+
+struct dump *dumps;
+int dumpcount;
+int *order; // dumps by device then time, the good ones only
+int ordered;
+int *groups; // where each device's run in order starts, and one past the end
+int groupcount;
+struct archive *archives; // one per thread
+uint8_t image[MAXTHREADS][MISSIONFILESIZE + 1];
+
+void addSample(int64_t time, float temperature, void *arg) {
+	struct dump *d = (struct dump *)arg;
+	d->times[d->count] = time;
+	d->temperatures[d->count] = temperature;
+	d->count++;
+}
+
+/* Round 1: read, check and decode a file */
+void decodeDump(int item, int thread) {
+	struct dump *d = &dumps[item];
+	uint8_t *file = image[thread];
+	int fd = open(d->path, O_RDONLY);
+	if(fd < 0) {
+		d->error = "can't open";
+		return;
+	}
+	ssize_t length = read(fd, file, MISSIONFILESIZE + 1);
+	close(fd);
+	if(length < 0) {
+		d->error = "can't read";
+		return;
+	}
+	bool hasrom;
+	d->error = missionCheck(file, length, d->rom, &hasrom);
+	if(d->error != NULL) return;
+	if(!hasrom) {
+		const char *name = strrchr(d->path, '/');
+		name = name == NULL ? d->path : name + 1;
+		char hex[17];
+		snprintf(hex, sizeof(hex), "%s", name);
+		if(!hexToROM(hex, d->rom)) {
+			d->error = "no ROM ID in the file or its name";
+			return;
+		}
+		d->unchecked = true;
+	}
+	d->times = (int64_t *)malloc(DATALOGSIZE * sizeof(int64_t));
+	d->temperatures = (float *)malloc(DATALOGSIZE * sizeof(float));
+	if(d->times == NULL || d->temperatures == NULL) {
+		d->error = "out of memory";
+		return;
+	}
+	decodeMission(file, addSample, d);
+}
+
+int compareDumps(const void *a, const void *b) {
+	const struct dump *x = &dumps[*(const int *)a];
+	const struct dump *y = &dumps[*(const int *)b];
+	int c = memcmp(x->rom, y->rom, 8);
+	if(c != 0) return c;
+	int64_t tx = x->count > 0 ? x->times[0] : 0;
+	int64_t ty = y->count > 0 ? y->times[0] : 0;
+	return tx < ty ? -1 : tx > ty;
+}
+
+/* Round 2: add one device's missions to the archive, oldest first.
+ * Samples the archive already has (a mission downloaded twice, or
+ * overlapping the next one) are refused by archiveAppend.
+ */
+void archiveDevice(int item, int thread) {
+	int i, j;
+	for(i = groups[item]; i < groups[item + 1]; i++) {
+		struct dump *d = &dumps[order[i]];
+		for(j = 0; j < d->count; j++) {
+			int result = archiveAppend(&archives[thread], d->rom, d->times[j], d->temperatures[j]);
+			if(result == ARCHIVEADDED) d->added++;
+			else if(result == ARCHIVEFAILED) d->failed++;
+		}
+	}
+}
+
+double elapsed(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *dir = NULL;
+	while((opt = getopt(argc, argv, "o:t:")) != -1) {
+		switch(opt) {
+		case 'o': dir = optarg; break;
+		case 't': threads = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s -o archive [-t threads] missionfile...\n", argv[0]);
+			return 1;
+		}
+	}
+	if(dir == NULL || optind == argc) {
+		fprintf(stderr, "usage: %s -o archive [-t threads] missionfile...\n", argv[0]);
+		return 1;
+	}
+	if(threads < 1) threads = 1;
+	if(threads > MAXTHREADS) threads = MAXTHREADS;
+	/* Every device has a handful of files open */
+	struct rlimit files;
+	if(getrlimit(RLIMIT_NOFILE, &files) == 0) {
+		files.rlim_cur = files.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &files);
+	}
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int i;
+	dumpcount = argc - optind;
+	dumps = (struct dump *)calloc(dumpcount, sizeof(struct dump));
+	order = (int *)malloc(dumpcount * sizeof(int));
+	groups = (int *)malloc((dumpcount + 1) * sizeof(int));
+	archives = (struct archive *)malloc(threads * sizeof(struct archive));
+	if(dumps == NULL || order == NULL || groups == NULL || archives == NULL) return 1;
+	for(i = 0; i < dumpcount; i++) dumps[i].path = argv[optind + i];
+
+	int steals = poolRun(threads, dumpcount, decodeDump);
+
+	int bad = 0;
+	int unchecked = 0;
+	ordered = 0;
+	for(i = 0; i < dumpcount; i++) {
+		if(dumps[i].error != NULL) {
+			fprintf(stderr, "%s: %s\n", dumps[i].path, dumps[i].error);
+			bad++;
+		} else {
+			if(dumps[i].unchecked) {
+				fprintf(stderr, "%s: no trailer, accepted without any CRC check\n", dumps[i].path);
+				unchecked++;
+			}
+			order[ordered++] = i;
+		}
+	}
+	qsort(order, ordered, sizeof(int), compareDumps);
+	groupcount = 0;
+	for(i = 0; i < ordered; i++) {
+		if(i == 0 || memcmp(dumps[order[i]].rom, dumps[order[i - 1]].rom, 8) != 0) groups[groupcount++] = i;
+	}
+	groups[groupcount] = ordered;
+
+	for(i = 0; i < threads; i++) {
+		if(!archiveOpen(&archives[i], dir)) {
+			fprintf(stderr, "Can't open the archive in %s\n", dir);
+			return 1;
+		}
+	}
+	steals += poolRun(threads, groupcount, archiveDevice);
+	for(i = 0; i < threads; i++) archiveClose(&archives[i]);
+
+	long long samples = 0;
+	long long added = 0;
+	long long failed = 0;
+	for(i = 0; i < dumpcount; i++) {
+		samples += dumps[i].count;
+		added += dumps[i].added;
+		failed += dumps[i].failed;
+		if(dumps[i].failed > 0) fprintf(stderr, "%s: %d samples couldn't be written to the archive\n", dumps[i].path, dumps[i].failed);
+		free(dumps[i].times);
+		free(dumps[i].temperatures);
+	}
+	fprintf(stderr, "%d files (%d bad, %d without a CRC) from %d devices: %lld samples, %lld new to the archive, in %.2fs with %d threads (%d items stolen)\n",
+		dumpcount, bad, unchecked, groupcount, samples, added, elapsed(&start), threads, steals);
+	if(failed > 0) return 1;
+	return bad > 0 ? 2 : 0;
+}
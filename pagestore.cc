@@ -0,0 +1,284 @@
+/* Content addressed page store for the DS1921L logger
+ *
+ * 2021 Angular Fish
+ *
+ * See pagestore.h for the layout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "archive.h"
+#include "mission.h"
+#include "pagestore.h"
+
+#define MANIFESTMAGIC 0x314E414D // "MAN1"
+
+uint64_t pageHash(const uint8_t *page) {
+	uint64_t hash = 14695981039346656037ULL;
+	int i;
+	for(i = 0; i < STOREPAGESIZE; i++) hash = (hash ^ page[i]) * 1099511628211ULL;
+	return hash;
+}
+
+/* Slot in the table for hash: where it is, or the empty one it would go in */
+uint32_t findSlot(const struct pagestore *s, uint64_t hash) {
+	uint32_t mask = s->capacity - 1;
+	uint32_t i = hash & mask;
+	while(s->slots[i] != 0 && s->hashes[i] != hash) i = (i + 1) & mask;
+	return i;
+}
+
+bool growTable(struct pagestore *s) {
+	uint32_t oldcapacity = s->capacity;
+	uint64_t *oldhashes = s->hashes;
+	uint32_t *oldslots = s->slots;
+	s->capacity = oldcapacity ? oldcapacity * 2 : 1024;
+	s->hashes = (uint64_t *)calloc(s->capacity, sizeof(uint64_t));
+	s->slots = (uint32_t *)calloc(s->capacity, sizeof(uint32_t));
+	if(s->hashes == NULL || s->slots == NULL) return false;
+	uint32_t i;
+	for(i = 0; i < oldcapacity; i++) {
+		if(oldslots[i] == 0) continue;
+		uint32_t j = findSlot(s, oldhashes[i]);
+		s->hashes[j] = oldhashes[i];
+		s->slots[j] = oldslots[i];
+	}
+	free(oldhashes);
+	free(oldslots);
+	return true;
+}
+
+bool storeOpen(struct pagestore *s, const char *dir) {
+	memset(s, 0, sizeof(*s));
+	snprintf(s->dir, sizeof(s->dir), "%s", dir);
+	mkdir(dir, 0755);
+	char path[PATH_MAX + 16];
+	snprintf(path, sizeof(path), "%s/manifests", dir);
+	mkdir(path, 0755);
+	snprintf(path, sizeof(path), "%s/pages", dir);
+	s->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if(s->fd < 0 || !growTable(s)) return false;
+	/* The table is built from the hashes stored with the pages */
+	struct storedpage page;
+	while(pread(s->fd, &page, sizeof(page), (off_t)s->count * sizeof(page)) == sizeof(page)) {
+		if(s->count * 2 >= s->capacity && !growTable(s)) return false;
+		uint32_t i = findSlot(s, page.hash);
+		s->hashes[i] = page.hash;
+		s->slots[i] = ++s->count;
+	}
+	return true;
+}
+
+void storeClose(struct pagestore *s) {
+	close(s->fd);
+	free(s->hashes);
+	free(s->slots);
+	memset(s, 0, sizeof(*s));
+	s->fd = -1;
+}
+
+bool storePut(struct pagestore *s, const uint8_t *page, uint64_t *hash, bool *isnew) {
+	*hash = pageHash(page);
+	*isnew = false;
+	uint32_t i = findSlot(s, *hash);
+	struct storedpage stored;
+	if(s->slots[i] != 0) {
+		if(pread(s->fd, &stored, sizeof(stored), (off_t)(s->slots[i] - 1) * sizeof(stored)) != sizeof(stored)) return false;
+		if(memcmp(stored.data, page, STOREPAGESIZE) != 0) {
+			fprintf(stderr, "Page store: two pages with hash %016llX\n", (unsigned long long)*hash);
+			return false;
+		}
+		return true;
+	}
+	stored.hash = *hash;
+	memcpy(stored.data, page, STOREPAGESIZE);
+	if(pwrite(s->fd, &stored, sizeof(stored), (off_t)s->count * sizeof(stored)) != sizeof(stored)) return false;
+	s->hashes[i] = *hash;
+	s->slots[i] = ++s->count;
+	*isnew = true;
+	if(s->count * 2 >= s->capacity) return growTable(s);
+	return true;
+}
+
+bool storeGet(struct pagestore *s, uint64_t hash, uint8_t *page) {
+	uint32_t i = findSlot(s, hash);
+	if(s->slots[i] == 0) return false;
+	struct storedpage stored;
+	if(pread(s->fd, &stored, sizeof(stored), (off_t)(s->slots[i] - 1) * sizeof(stored)) != sizeof(stored)) return false;
+	memcpy(page, stored.data, STOREPAGESIZE);
+	return true;
+}
+
+int storeDownload(struct pagestore *s, const uint8_t *rom, int64_t time, const uint8_t *image, const uint16_t *addresses, const uint16_t *crcs, int count) {
+	struct manifest m;
+	memset(&m, 0, sizeof(m));
+	if(count > MAXMANIFESTPAGES) return -1;
+	m.magic = MANIFESTMAGIC;
+	m.count = count;
+	memcpy(m.rom, rom, 8);
+	m.time = time;
+	int added = 0;
+	int i;
+	for(i = 0; i < count; i++) {
+		bool isnew;
+		m.entries[i].address = addresses[i];
+		m.entries[i].crc = crcs[i];
+		if(!storePut(s, &image[addresses[i]], &m.entries[i].hash, &isnew)) return -1;
+		if(isnew) added++;
+	}
+	/* Pages go to disk before the manifest that needs them */
+	fdatasync(s->fd);
+	char hex[17];
+	char path[PATH_MAX + 64];
+	char temporary[PATH_MAX + 72];
+	romToHex(rom, hex);
+	snprintf(path, sizeof(path), "%s/manifests/%s-%lld", s->dir, hex, (long long)time);
+	snprintf(temporary, sizeof(temporary), "%s.new", path);
+	FILE *f = fopen(temporary, "wb");
+	if(f == NULL) return -1;
+	size_t length = sizeof(m) - sizeof(m.entries) + count * sizeof(struct manifestentry);
+	bool ok = fwrite(&m, 1, length, f) == length;
+	ok = fclose(f) == 0 && ok;
+	if(!ok || rename(temporary, path) != 0) {
+		unlink(temporary);
+		return -1;
+	}
+	return added;
+}
+
+/* Does the entry's page start on a page and lie inside the device memory? */
+bool validEntry(const struct manifestentry *e) {
+	return e->address % STOREPAGESIZE == 0 && e->address + STOREPAGESIZE <= MEMSIZE;
+}
+
+/* A manifest has to be exactly its header and count entries, and every entry
+ * has to be a page of the device, or it's refused. The addresses are used to
+ * put pages back in an image, so a damaged one mustn't land outside it.
+ */
+bool manifestRead(const char *path, struct manifest *m) {
+	FILE *f = fopen(path, "rb");
+	if(f == NULL) return false;
+	struct stat st;
+	size_t header = sizeof(*m) - sizeof(m->entries);
+	bool ok = fstat(fileno(f), &st) == 0;
+	ok = ok && fread(m, 1, header, f) == header && m->magic == MANIFESTMAGIC && m->count <= MAXMANIFESTPAGES;
+	ok = ok && (size_t)st.st_size == header + m->count * sizeof(struct manifestentry);
+	ok = ok && fread(m->entries, sizeof(struct manifestentry), m->count, f) == m->count;
+	fclose(f);
+	uint32_t i;
+	for(i = 0; ok && i < m->count; i++) ok = validEntry(&m->entries[i]);
+	return ok;
+}
+
+bool manifestRestore(struct pagestore *s, const struct manifest *m, uint8_t *image) {
+	uint32_t i;
+	for(i = 0; i < m->count; i++) {
+		if(!validEntry(&m->entries[i]) || !storeGet(s, m->entries[i].hash, &image[m->entries[i].address])) return false;
+	}
+	return true;
+}
+
+/* Writes length bytes of a manifest to the store's manifests under name */
+void writeCheckManifest(struct pagestore *s, const char *name, const void *data, size_t length, char *path, size_t size) {
+	snprintf(path, size, "%s/manifests/%s", s->dir, name);
+	FILE *f = fopen(path, "wb");
+	if(f == NULL) return;
+	if(fwrite(data, 1, length, f) != length) {}
+	fclose(f);
+}
+
+/* Stores two downloads that share most of their pages, opens the store
+ * again and restores both, then checks manifests damaged in each way
+ * manifestRead should catch are refused.
+ */
+bool checkPageStore() {
+	static uint8_t first[MEMSIZE];
+	static uint8_t second[MEMSIZE];
+	static uint8_t restored[MEMSIZE];
+	uint16_t addresses[MAXMANIFESTPAGES];
+	uint16_t crcs[MAXMANIFESTPAGES];
+	uint8_t rom[8] = {DS1921FAMILY, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0};
+	rom[7] = crc8(rom, 7);
+	int count = 0;
+	int i;
+	for(i = 0; i < MEMSIZE; i++) first[i] = i < DATALOGSTART + 20 * STOREPAGESIZE ? (i * 13 + i / 256) & 0xFF : 0;
+	for(i = 0; i < MEMSIZE; i += STOREPAGESIZE) {
+		if(!missionPage(i)) continue;
+		addresses[count] = i;
+		crcs[count] = readCRC(i, &first[i], STOREPAGESIZE);
+		count++;
+	}
+	/* The datalog past the first 20 pages is all blank, so one page */
+	int distinct = count - (DATALOGSIZE / STOREPAGESIZE - 20) + 1;
+	memcpy(second, first, MEMSIZE);
+	second[REGISTERSTART + 3] ^= 0xFF;
+	second[DATALOGSTART + 20 * STOREPAGESIZE] = 0x55;
+	second[DATALOGSTART + 21 * STOREPAGESIZE] = 0x55; // the same as the page before it
+
+	char dir[] = "/tmp/pagestoreXXXXXX";
+	if(checkDirectory(dir) == NULL) return false;
+	struct pagestore s;
+	bool ok = storeOpen(&s, dir);
+	ok = ok && storeDownload(&s, rom, 1000, first, addresses, crcs, count) == distinct;
+	ok = ok && storeDownload(&s, rom, 2000, second, addresses, crcs, count) == 2;
+	ok = ok && storeDownload(&s, rom, 3000, second, addresses, crcs, count) == 0;
+	storeClose(&s);
+
+	ok = ok && storeOpen(&s, dir) && s.count == (uint32_t)distinct + 2;
+	char hex[17];
+	char path[PATH_MAX + 64];
+	struct manifest m;
+	romToHex(rom, hex);
+	const uint8_t *images[] = {first, second};
+	int j;
+	for(j = 0; j < 2; j++) {
+		snprintf(path, sizeof(path), "%s/manifests/%s-%d", dir, hex, (j + 1) * 1000);
+		memset(restored, 0, MEMSIZE);
+		ok = ok && manifestRead(path, &m) && m.count == (uint32_t)count && memcmp(m.rom, rom, 8) == 0 && m.time == (j + 1) * 1000;
+		ok = ok && manifestRestore(&s, &m, restored);
+		for(i = 0; ok && i < count; i++) {
+			ok = memcmp(&restored[addresses[i]], &images[j][addresses[i]], STOREPAGESIZE) == 0 && m.entries[i].address == addresses[i] && m.entries[i].crc == crcs[i];
+		}
+	}
+
+	/* Damaged copies of the last manifest read */
+	size_t length = sizeof(m) - sizeof(m.entries) + m.count * sizeof(struct manifestentry);
+	struct manifest bad;
+	char badpath[PATH_MAX + 64];
+	struct manifest check;
+	memcpy(&bad, &m, length);
+	bad.entries[5].address = MEMSIZE; // past the end
+	writeCheckManifest(&s, "past", &bad, length, badpath, sizeof(badpath));
+	ok = ok && !manifestRead(badpath, &check);
+	bad.entries[5].address = DATALOGSTART + 1; // not on a page
+	writeCheckManifest(&s, "misaligned", &bad, length, badpath, sizeof(badpath));
+	ok = ok && !manifestRead(badpath, &check);
+	writeCheckManifest(&s, "short", &m, length - 1, badpath, sizeof(badpath));
+	ok = ok && !manifestRead(badpath, &check);
+	writeCheckManifest(&s, "long", &m, length + 1, badpath, sizeof(badpath));
+	ok = ok && !manifestRead(badpath, &check);
+	memcpy(&bad, &m, length);
+	bad.count++;
+	writeCheckManifest(&s, "count", &bad, length, badpath, sizeof(badpath));
+	ok = ok && !manifestRead(badpath, &check);
+	bad.count = m.count;
+	bad.magic ^= 1;
+	writeCheckManifest(&s, "magic", &bad, length, badpath, sizeof(badpath));
+	ok = ok && !manifestRead(badpath, &check);
+	/* Fine on disk, but names a page the store doesn't have */
+	bad.magic = m.magic;
+	bad.entries[5].hash ^= 1;
+	ok = ok && !manifestRestore(&s, &bad, restored);
+	bad.entries[5].hash = m.entries[5].hash;
+	bad.entries[5].address = MEMSIZE - 1;
+	ok = ok && !manifestRestore(&s, &bad, restored);
+
+	storeClose(&s);
+	removeCheckDirectory(dir);
+	fprintf(stderr, "Page store check: %s\n", ok ? "restores and refuses damaged manifests" : "doesn't restore or refuse damaged manifests");
+	return ok;
+}
@@ -0,0 +1,87 @@
+/* Content addressed page store for the DS1921L logger
+ *
+ * 2021 Angular Fish
+ *
+ * Downloading a logger whose mission hasn't moved on much gives nearly the
+ * same pages as last time: the registers, alarms and histogram hardly change
+ * and most of the datalog is the same. Instead of a whole image for every
+ * download, each distinct 32 byte page is kept once, under a hash of what's
+ * in it, and each download is a manifest listing the hash of the page at
+ * each address. A download only adds the pages that are new, and what
+ * changed between two downloads is just the addresses whose hashes differ.
+ *
+ * The store is a directory:
+ * pages                 every distinct page, with its hash, in the order
+ *                       they were first seen
+ * manifests/<id>-<time> one per download, named after the device's ROM ID
+ *                       and when it was downloaded (seconds since the epoch)
+ * The hashes are 64 bit FNV-1a. Pages with the same hash are compared in
+ * full before being counted as the same, and a real collision is refused
+ * rather than mixing two pages up.
+ */
+
+#ifndef PAGESTORE_H
+#define PAGESTORE_H
+
+#include <stdint.h>
+#include <limits.h>
+
+#define STOREPAGESIZE 32
+#define MAXMANIFESTPAGES 256 // a whole DS1921L is 192
+
+struct storedpage {
+	uint64_t hash;
+	uint8_t data[STOREPAGESIZE];
+};
+
+struct pagestore {
+	char dir[PATH_MAX];
+	int fd;
+	uint64_t *hashes; // open addressed table of the hashes in pages
+	uint32_t *slots; // where each one is in pages, plus one (0 is empty)
+	uint32_t count; // pages
+	uint32_t capacity; // of the table, a power of two
+};
+
+struct manifestentry {
+	uint16_t address;
+	uint16_t crc; // the device sent with the page, see readCRC in mission.h
+	uint32_t reserved2;
+	uint64_t hash;
+};
+
+struct manifest {
+	uint32_t magic;
+	uint32_t count;
+	uint8_t rom[8];
+	int64_t time; // seconds since the epoch
+	struct manifestentry entries[MAXMANIFESTPAGES];
+};
+
+uint64_t pageHash(const uint8_t *page);
+
+bool storeOpen(struct pagestore *s, const char *dir);
+void storeClose(struct pagestore *s);
+
+/* Adds a page if it isn't there already. Sets hash, and isnew if it had to
+ * be added.
+ */
+bool storePut(struct pagestore *s, const uint8_t *page, uint64_t *hash, bool *isnew);
+bool storeGet(struct pagestore *s, uint64_t hash, uint8_t *page);
+
+/* Stores the pages of image at each of count addresses and writes the
+ * download's manifest, with the CRC the device sent for each. Returns how
+ * many pages were new, or -1.
+ */
+int storeDownload(struct pagestore *s, const uint8_t *rom, int64_t time, const uint8_t *image, const uint16_t *addresses, const uint16_t *crcs, int count);
+
+/* Reads a manifest, false if it can't or it's damaged */
+bool manifestRead(const char *path, struct manifest *m);
+
+/* Fills image (MEMSIZE bytes) with the pages m lists */
+bool manifestRestore(struct pagestore *s, const struct manifest *m, uint8_t *image);
+
+/* Checks storing, restoring and damaged manifests, for -V */
+bool checkPageStore();
+
+#endif
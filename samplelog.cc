@@ -0,0 +1,329 @@
+/* Compressed sample log for the DS1921L logger
+ *
+ * 2021 Angular Fish
+ *
+ * See samplelog.h for the format.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "samplelog.h"
+
+/* Bits go into the block most significant first */
+bool putBits(struct logblock *b, uint64_t value, int count) {
+	if(b->bits + count > LOGBLOCKBYTES * 8) return false;
+	int i;
+	for(i = count - 1; i >= 0; i--) {
+		if((value >> i) & 1) b->data[b->bits / 8] |= 0x80 >> (b->bits % 8);
+		b->bits++;
+	}
+	return true;
+}
+
+struct bitreader {
+	const uint8_t *data;
+	int bits; // how many there are
+	int at;
+};
+
+bool getBits(struct bitreader *r, int count, uint64_t *value) {
+	if(r->at + count > r->bits) return false;
+	*value = 0;
+	int i;
+	for(i = 0; i < count; i++) {
+		*value = (*value << 1) | ((r->data[r->at / 8] >> (7 - r->at % 8)) & 1);
+		r->at++;
+	}
+	return true;
+}
+
+uint32_t floatBits(float f) {
+	uint32_t u;
+	memcpy(&u, &f, 4);
+	return u;
+}
+
+float bitsFloat(uint32_t u) {
+	float f;
+	memcpy(&f, &u, 4);
+	return f;
+}
+
+int leadingZeros(uint32_t x) {
+	int n = 0;
+	while(n < 32 && !(x & (0x80000000u >> n))) n++;
+	return n;
+}
+
+int trailingZeros(uint32_t x) {
+	int n = 0;
+	while(n < 32 && !(x & (1u << n))) n++;
+	return n;
+}
+
+void blockStart(struct logblock *b) {
+	memset(b, 0, sizeof(*b));
+	b->leading = -1;
+}
+
+/* Delta of delta buckets: a prefix of ones ending in a zero, then the value
+ * offset to be positive in that many bits. The last bucket has no zero.
+ */
+const int dodprefix[] = {1, 2, 3, 4, 4};
+const uint64_t dodcode[] = {0x0, 0x2, 0x6, 0xE, 0xF};
+const int dodbits[] = {0, 7, 9, 12, 64};
+const int64_t dodlow[] = {0, -63, -255, -2047, 0};
+
+bool blockAppend(struct logblock *b, int64_t time, float temperature) {
+	int64_t ms = time / 1000;
+	uint32_t value = floatBits(temperature);
+	if(b->header.count == LOGBLOCKSAMPLES) return false;
+	/* Worst case is 68 bits of time and 45 of temperature */
+	if(b->bits + 113 > LOGBLOCKBYTES * 8) return false;
+	if(b->header.count == 0) {
+		b->header.first = ms;
+		putBits(b, value, 32);
+	} else {
+		int64_t delta = ms - b->lasttime;
+		int64_t dod = delta - b->lastdelta;
+		int bucket;
+		if(dod == 0) bucket = 0;
+		else if(dod >= -63 && dod <= 64) bucket = 1;
+		else if(dod >= -255 && dod <= 256) bucket = 2;
+		else if(dod >= -2047 && dod <= 2048) bucket = 3;
+		else bucket = 4;
+		putBits(b, dodcode[bucket], dodprefix[bucket]);
+		if(bucket > 0) putBits(b, (uint64_t)(dod - dodlow[bucket]), dodbits[bucket]);
+		b->lastdelta = delta;
+
+		uint32_t x = value ^ b->lastvalue;
+		if(x == 0) {
+			putBits(b, 0, 1);
+		} else {
+			int leading = leadingZeros(x);
+			int trailing = trailingZeros(x);
+			if(leading > 31) leading = 31;
+			if(b->leading >= 0 && leading >= b->leading && trailing >= b->trailing) {
+				putBits(b, 0x2, 2);
+				putBits(b, x >> b->trailing, 32 - b->leading - b->trailing);
+			} else {
+				int meaningful = 32 - leading - trailing;
+				putBits(b, 0x3, 2);
+				putBits(b, leading, 5);
+				putBits(b, meaningful - 1, 5);
+				putBits(b, x >> trailing, meaningful);
+				b->leading = leading;
+				b->trailing = trailing;
+			}
+		}
+	}
+	b->lasttime = ms;
+	b->lastvalue = value;
+	b->header.count++;
+	b->header.bytes = (b->bits + 7) / 8;
+	return true;
+}
+
+int blockDecode(const struct blockheader *header, const uint8_t *data, int64_t *times, float *temperatures, int max) {
+	struct bitreader r = {data, header->bytes * 8, 0};
+	uint64_t v;
+	int count = 0;
+	int64_t time = header->first;
+	int64_t delta = 0;
+	uint32_t value = 0;
+	int leading = 0;
+	int trailing = 0;
+	while(count < header->count && count < max) {
+		if(count == 0) {
+			if(!getBits(&r, 32, &v)) break;
+			value = v;
+		} else {
+			int bucket = 0;
+			while(bucket < 4) {
+				if(!getBits(&r, 1, &v)) return count;
+				if(v == 0) break;
+				bucket++;
+			}
+			int64_t dod = 0;
+			if(bucket > 0) {
+				if(!getBits(&r, dodbits[bucket], &v)) break;
+				dod = (int64_t)v + dodlow[bucket];
+			}
+			delta += dod;
+			time += delta;
+
+			if(!getBits(&r, 1, &v)) break;
+			if(v == 1) {
+				if(!getBits(&r, 1, &v)) break;
+				if(v == 1) {
+					uint64_t l, m;
+					if(!getBits(&r, 5, &l) || !getBits(&r, 5, &m)) break;
+					leading = l;
+					trailing = 32 - leading - (m + 1);
+				}
+				if(!getBits(&r, 32 - leading - trailing, &v)) break;
+				value ^= (uint32_t)v << trailing;
+			}
+		}
+		times[count] = time * 1000;
+		temperatures[count] = bitsFloat(value);
+		count++;
+	}
+	return count;
+}
+
+bool addBlock(struct samplelog *log, int64_t start, off_t offset) {
+	if(log->blocks == log->capacity) {
+		int capacity = log->capacity ? log->capacity * 2 : 64;
+		int64_t *starts = (int64_t *)realloc(log->starts, capacity * sizeof(int64_t));
+		if(starts == NULL) return false;
+		log->starts = starts;
+		off_t *offsets = (off_t *)realloc(log->offsets, capacity * sizeof(off_t));
+		if(offsets == NULL) return false;
+		log->offsets = offsets;
+		log->capacity = capacity;
+	}
+	log->starts[log->blocks] = start;
+	log->offsets[log->blocks] = offset;
+	log->blocks++;
+	return true;
+}
+
+/* Builds the index from the block headers. New readings go in a new block
+ * after the last one.
+ */
+bool logOpen(struct samplelog *log, const char *path) {
+	memset(log, 0, sizeof(*log));
+	log->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if(log->fd < 0) return false;
+	off_t offset = 0;
+	struct blockheader header;
+	while(pread(log->fd, &header, sizeof(header), offset) == sizeof(header) && header.count > 0) {
+		if(!addBlock(log, header.first * 1000, offset)) return false;
+		offset += sizeof(header) + header.bytes;
+	}
+	blockStart(&log->open);
+	log->openat = offset;
+	return true;
+}
+
+void logClose(struct samplelog *log) {
+	close(log->fd);
+	free(log->starts);
+	free(log->offsets);
+	memset(log, 0, sizeof(*log));
+	log->fd = -1;
+}
+
+bool logAppend(struct samplelog *log, int64_t time, float temperature) {
+	if(!blockAppend(&log->open, time, temperature)) {
+		log->openat += sizeof(struct blockheader) + log->open.header.bytes;
+		blockStart(&log->open);
+		if(!blockAppend(&log->open, time, temperature)) return false;
+	}
+	if(log->open.header.count == 1 && !addBlock(log, log->open.header.first * 1000, log->openat)) return false;
+	size_t length = sizeof(struct blockheader) + log->open.header.bytes;
+	uint8_t buffer[sizeof(struct blockheader) + LOGBLOCKBYTES];
+	memcpy(buffer, &log->open.header, sizeof(struct blockheader));
+	memcpy(buffer + sizeof(struct blockheader), log->open.data, log->open.header.bytes);
+	return pwrite(log->fd, buffer, length, log->openat) == (ssize_t)length;
+}
+
+int logRead(struct samplelog *log, int64_t from, int64_t to, int64_t *times, float *temperatures, int max) {
+	/* The last block starting at or before from */
+	int low = 0;
+	int high = log->blocks;
+	while(low < high) {
+		int middle = (low + high) / 2;
+		if(log->starts[middle] <= from) low = middle + 1;
+		else high = middle;
+	}
+	int block = low > 0 ? low - 1 : 0;
+	int count = 0;
+	struct blockheader header;
+	uint8_t data[LOGBLOCKBYTES];
+	int64_t blocktimes[LOGBLOCKSAMPLES];
+	float blocktemperatures[LOGBLOCKSAMPLES];
+	for(; block < log->blocks && log->starts[block] < to && count < max; block++) {
+		if(pread(log->fd, &header, sizeof(header), log->offsets[block]) != sizeof(header)) break;
+		if(header.bytes > LOGBLOCKBYTES || pread(log->fd, data, header.bytes, log->offsets[block] + sizeof(header)) != header.bytes) break;
+		int n = blockDecode(&header, data, blocktimes, blocktemperatures, LOGBLOCKSAMPLES);
+		int i;
+		for(i = 0; i < n && count < max; i++) {
+			if(blocktimes[i] < from || blocktimes[i] >= to) continue;
+			times[count] = blocktimes[i];
+			temperatures[count] = blocktemperatures[i];
+			count++;
+		}
+	}
+	return count;
+}
+
+/* Encodes readings with every size of time step and temperature change,
+ * and checks they decode to exactly what went in, from a block and from a
+ * log file reopened part way through.
+ */
+bool checkSampleLog() {
+	/* Changes in the gap either side of each bucket's limits */
+	static const int64_t dods[] = {0, 64, -63, -64, 65, 256, -255, -256, 257, 2048, -2047, -2048, 2049, 3600000, -3600000, 0};
+	static const float values[] = {4.5, 4.5, 5.0, -0.5, -12.5, 85.0, -40.0, 0.0, -100, 4.5, 4.0, 4.0};
+	int64_t times[3 * LOGBLOCKSAMPLES];
+	float temperatures[3 * LOGBLOCKSAMPLES];
+	int64_t decodedtimes[3 * LOGBLOCKSAMPLES];
+	float decodedtemperatures[3 * LOGBLOCKSAMPLES];
+	int total = 3 * LOGBLOCKSAMPLES - 10;
+	int i;
+	int64_t time = 1600000000000LL;
+	int64_t delta = 60000;
+	for(i = 0; i < total; i++) {
+		delta += dods[i % (sizeof(dods) / sizeof(dods[0]))];
+		time += delta;
+		times[i] = time * 1000;
+		temperatures[i] = values[(i / 3) % (sizeof(values) / sizeof(values[0]))];
+	}
+	bool ok = true;
+
+	struct logblock b;
+	blockStart(&b);
+	for(i = 0; i < LOGBLOCKSAMPLES; i++) ok = ok && blockAppend(&b, times[i], temperatures[i]);
+	ok = ok && !blockAppend(&b, times[i], temperatures[i]); // full
+	int count = blockDecode(&b.header, b.data, decodedtimes, decodedtemperatures, LOGBLOCKSAMPLES);
+	ok = ok && count == LOGBLOCKSAMPLES;
+	ok = ok && memcmp(decodedtimes, times, count * sizeof(times[0])) == 0 && memcmp(decodedtemperatures, temperatures, count * sizeof(temperatures[0])) == 0;
+
+	/* The same reading at the same interval takes two bits */
+	blockStart(&b);
+	for(i = 0; i < 3; i++) blockAppend(&b, i * 60000000LL, 4.5);
+	int bits = b.bits;
+	blockAppend(&b, 3 * 60000000LL, 4.5);
+	ok = ok && b.bits - bits == 2;
+
+	char dir[] = "/tmp/samplelogXXXXXX";
+	char path[sizeof(dir) + 16];
+	if(mkdtemp(dir) == NULL) return false;
+	snprintf(path, sizeof(path), "%s/check.gor", dir);
+	struct samplelog log;
+	ok = ok && logOpen(&log, path);
+	for(i = 0; i < total / 2; i++) ok = ok && logAppend(&log, times[i], temperatures[i]);
+	logClose(&log);
+	ok = ok && logOpen(&log, path);
+	for(; i < total; i++) ok = ok && logAppend(&log, times[i], temperatures[i]);
+	logClose(&log);
+	ok = ok && logOpen(&log, path);
+	count = logRead(&log, times[0], times[total - 1] + 1, decodedtimes, decodedtemperatures, total);
+	ok = ok && count == total;
+	ok = ok && memcmp(decodedtimes, times, total * sizeof(times[0])) == 0 && memcmp(decodedtemperatures, temperatures, total * sizeof(temperatures[0])) == 0;
+	/* A stretch from the middle of the second block on */
+	int from = LOGBLOCKSAMPLES + 100;
+	count = logRead(&log, times[from], times[from + 300], decodedtimes, decodedtemperatures, total);
+	ok = ok && count == 300 && decodedtimes[0] == times[from] && decodedtemperatures[299] == temperatures[from + 299];
+	logClose(&log);
+	unlink(path);
+	rmdir(dir);
+
+	fprintf(stderr, "Sample log check: %s\n", ok ? "round trips" : "doesn't round trip");
+	return ok;
+}
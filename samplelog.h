@@ -0,0 +1,82 @@
+/* Compressed sample log for the DS1921L logger
+ *
+ * 2021 Angular Fish
+ *
+ * Readings from a device come at nearly the same interval every time and
+ * only move in half degree steps, so they compress very well. A sample log
+ * is a file of blocks of up to LOGBLOCKSAMPLES readings each, with times
+ * stored as the change in the gap between readings (delta of delta) and
+ * temperatures as the bits that changed since the last one (XOR), the same
+ * scheme as Facebook's Gorilla. A steady reading at a steady interval takes
+ * two bits.
+ *
+ * Each block starts with a header giving its first time, so a read from the
+ * middle of the log only has to find the right block in an index of block
+ * start times and decode from there. The block still filling is rewritten
+ * in place as readings are added so the file is always complete.
+ *
+ * Times are kept to the millisecond in the log, where the archive keeps
+ * microseconds.
+ */
+
+#ifndef SAMPLELOG_H
+#define SAMPLELOG_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define LOGBLOCKSAMPLES 256
+#define LOGBLOCKBYTES 4096 // enough for LOGBLOCKSAMPLES of the worst case
+
+struct blockheader {
+	int64_t first; // time of the first reading, milliseconds since the epoch
+	uint16_t count;
+	uint16_t bytes; // of encoded data after the header
+	uint32_t reserved;
+};
+
+/* A block being written */
+struct logblock {
+	struct blockheader header;
+	uint8_t data[LOGBLOCKBYTES];
+	int bits;
+	int64_t lasttime;
+	int64_t lastdelta;
+	uint32_t lastvalue;
+	int leading; // of the last XOR written in full, -1 before there is one
+	int trailing;
+};
+
+void blockStart(struct logblock *b);
+
+/* Adds a reading to the block, returns false if it's full */
+bool blockAppend(struct logblock *b, int64_t time, float temperature);
+
+/* Decodes up to max readings from a block, times in microseconds. Returns
+ * how many.
+ */
+int blockDecode(const struct blockheader *header, const uint8_t *data, int64_t *times, float *temperatures, int max);
+
+struct samplelog {
+	int fd;
+	struct logblock open;
+	off_t openat; // where the open block starts in the file
+	int64_t *starts; // first time of every block, for finding them
+	off_t *offsets;
+	int blocks; // counting the open one
+	int capacity;
+};
+
+bool logOpen(struct samplelog *log, const char *path);
+void logClose(struct samplelog *log);
+bool logAppend(struct samplelog *log, int64_t time, float temperature);
+
+/* Reads readings from from to to (microseconds) into times and
+ * temperatures, decoding only the blocks that cover them. Returns how many.
+ */
+int logRead(struct samplelog *log, int64_t from, int64_t to, int64_t *times, float *temperatures, int max);
+
+/* Checks encoding and decoding against known readings, for -V */
+bool checkSampleLog();
+
+#endif